@@ -1,14 +1,57 @@
 
 #include "fs.h"
 
+// The block cache holds at most BC_MAXBLOCKS blocks besides the pinned
+// ones (see bc_pinned).  The file server's workers share it: the disk
+// map's page tables are shared (bc_share), and bc_lock covers the
+// cache's bookkeeping and the reading in and writing out of blocks.
+// A cache hit is a plain memory access and takes no lock.  A block is
+// mapped into the disk map only once it has been read in, so a worker
+// never sees a half-read block: it faults and waits in bc_pgfault.
+// bc_blocks[] lists the cached blocks in the order the CLOCK hand
+// visits them.  A block is recently used if the hardware set PTE_A on
+// its page or it was just read in (bc_ref[]; the faulting access hasn't
+// happened yet when bc_pgfault returns).
+static uint32_t bc_blocks[BC_MAXBLOCKS];
+static bool bc_ref[BC_MAXBLOCKS];
+static uint32_t bc_nblocks;
+static uint32_t bc_hand;
+static struct mutex bc_lock;
+
+// Where each worker reads blocks before they go into the disk map.
+// Unlike the rest of the cache, this region is private to each worker.
+#define BC_READVA	0x0f800000	// BC_MAXRUN pages
+
+// Read-ahead runs in flight.  A run is read into staging pages and only
+// moved into the disk map once the IDE transfer is over, so nobody sees
+// a half-read block: touching one faults, and bc_pgfault waits for the
+// run instead of reading the block again.
+#define BC_NASYNC	4
+#define BC_STAGEVA	0x0f000000	// BC_NASYNC * BC_MAXRUN staging pages
+
+struct BcAsync {
+	struct IdeReq ba_req;
+	uint32_t ba_blockno;	// First block of the run
+	uint32_t ba_n;		// Blocks in the run, 0 if the slot is free
+};
+
+static struct BcAsync bc_async[BC_NASYNC];
+
+static void bc_reserve(uint32_t blockno);
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
 {
+	char *addr;
+
     // 0号block包含0号扇区，0号扇区是引导扇区，存放引导程序和内核。
 	if (blockno == 0 || (super && blockno >= super->s_nblocks))
 		panic("bad block number %08x in diskaddr", blockno);
-	return (char*) (DISKMAP + blockno * BLKSIZE);
+	addr = (char*) (DISKMAP + blockno * BLKSIZE);
+	if (va_is_mapped(addr))
+		fsstats.st_bc_hits++;
+	return addr;
 }
 
 // Is this virtual address mapped?
@@ -25,13 +68,203 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
+// The superblock and the bitmap are used all the time, and the bitmap
+// code keeps pointers into them, so they are never evicted.
+static bool
+bc_pinned(uint32_t blockno)
+{
+	return blockno == 1 ||
+		(super && blockno < 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE);
+}
+
+static uint32_t bc_write_run(uint32_t blockno);
+
+// Evict a cached block and return its slot in bc_blocks[].
+//
+// CLOCK: a recently used block gets a second chance instead, and loses
+// its accessed bit.  Cache hits take no lock, so a worker may be writing
+// the block as we look at it: sys_page_clear clears PTE_A and leaves
+// PTE_D alone, where a remap would clear both.
+//
+// The victim loses write access and PTE_D in one step, which tells us
+// whether it is dirty, so no write can slip in between the two.  A
+// worker writing to it from then on faults and waits for bc_lock in
+// bc_pgfault, and then reads it in again, instead of changing it
+// behind our back.
+static uint32_t
+bc_evict(void)
+{
+	uint32_t i;
+	void *addr;
+	int r;
+
+	for (;;) {
+		i = bc_hand;
+		bc_hand = (bc_hand + 1) % BC_MAXBLOCKS;
+		addr = (void *) (DISKMAP + bc_blocks[i] * BLKSIZE);
+		if (!va_is_mapped(addr))
+			return i; // 已经被别人unmap了，直接重用这个槽位。
+		if (bc_ref[i] || (uvpt[PGNUM(addr)] & PTE_A)) {
+			bc_ref[i] = 0;
+			if ((r = sys_page_clear(0, addr, PTE_A)) < 0)
+				panic("in bc_evict, sys_page_clear: %e", r);
+			continue;
+		}
+		if ((r = sys_page_clear(0, addr, PTE_W|PTE_D)) < 0)
+			panic("in bc_evict, sys_page_clear: %e", r);
+		if (r & PTE_D) {
+			bc_write_run(bc_blocks[i]);
+			fsstats.st_bc_writebacks++;
+		}
+		if ((r = sys_page_unmap(0, addr)) < 0)
+			panic("in bc_evict, sys_page_unmap: %e", r);
+		fsstats.st_bc_evictions++;
+		return i;
+	}
+}
+
+// Make room in the cache for blockno, which is about to be read in,
+// unless it is pinned.
+static void
+bc_reserve(uint32_t blockno)
+{
+	uint32_t slot;
+
+	if (bc_pinned(blockno))
+		return;
+	// 先腾出位置再分配新页，这样内存占用不会超过预算。
+	if (bc_nblocks < BC_MAXBLOCKS)
+		slot = bc_nblocks++;
+	else
+		slot = bc_evict();
+	bc_blocks[slot] = blockno;
+	bc_ref[slot] = 1;
+	fsstats.st_bc_cached = bc_nblocks;
+}
+
+static char *
+bc_stage(struct BcAsync *ba, uint32_t i)
+{
+	return (char *) BC_STAGEVA + ((ba - bc_async) * BC_MAXRUN + i) * BLKSIZE;
+}
+
+// Return the read-ahead run blockno is in, or NULL.
+static struct BcAsync *
+bc_async_lookup(uint32_t blockno)
+{
+	int i;
+
+	for (i = 0; i < BC_NASYNC; i++)
+		if (bc_async[i].ba_n && blockno - bc_async[i].ba_blockno < bc_async[i].ba_n)
+			return &bc_async[i];
+	return NULL;
+}
+
+// Is blockno being read ahead in the background?  Without bc_lock
+// this is only a hint: another worker may be about to change it.
+bool
+bc_inflight(uint32_t blockno)
+{
+	return bc_async_lookup(blockno) != NULL;
+}
+
+// Are any of the n blocks starting at blockno cached or in flight?
+static bool
+bc_run_present(uint32_t blockno, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++)
+		if (va_is_mapped((void *) (DISKMAP + (blockno + i) * BLKSIZE))
+		    || bc_async_lookup(blockno + i))
+			return 1;
+	return 0;
+}
+
+// Start reading the n consecutive blocks starting at blockno in the
+// background.  If another worker brought any of them in meanwhile, do
+// nothing: touching the others faults them in.  Returns -E_NO_MEM if
+// BC_NASYNC runs are in flight already.
+int
+bc_read_run_async(uint32_t blockno, uint32_t n)
+{
+	struct BcAsync *ba;
+	uint32_t i;
+	int r;
+
+	assert(n > 0 && n <= BC_MAXRUN);
+	mutex_lock(&bc_lock);
+	if (bc_run_present(blockno, n)) {
+		mutex_unlock(&bc_lock);
+		return 0;
+	}
+	for (ba = bc_async; ba < bc_async + BC_NASYNC && ba->ba_n; ba++)
+		;
+	if (ba == bc_async + BC_NASYNC) {
+		mutex_unlock(&bc_lock);
+		return -E_NO_MEM;
+	}
+	for (i = 0; i < n; i++)
+		if ((r = sys_page_alloc(0, bc_stage(ba, i), PTE_U|PTE_P|PTE_W)) < 0)
+			panic("in bc_read_run_async, sys_page_alloc: %e", r);
+	ba->ba_blockno = blockno;
+	ba->ba_n = n;
+	ba->ba_req.ir_secno = blockno * BLKSECTS;
+	ba->ba_req.ir_buf = bc_stage(ba, 0);
+	ba->ba_req.ir_nsecs = n * BLKSECTS;
+	ba->ba_req.ir_write = 0;
+	ide_submit(&ba->ba_req);
+	mutex_unlock(&bc_lock);
+	return 0;
+}
+
+// Move block i of the finished run ba from its staging page into the
+// cache, unless it is there already.
+static void
+bc_async_take(struct BcAsync *ba, uint32_t i)
+{
+	void *addr = (void *) (DISKMAP + (ba->ba_blockno + i) * BLKSIZE);
+	int r;
+
+	if (!va_is_mapped(bc_stage(ba, i)))
+		return;		// Taken already
+	if (ba->ba_req.ir_result == 0 && !va_is_mapped(addr)) {
+		bc_reserve(ba->ba_blockno + i);
+		// 新映射的页PTE_A和PTE_D都是清零的。
+		if ((r = sys_page_map(0, bc_stage(ba, i), 0, addr, PTE_U|PTE_P|PTE_W)) < 0)
+			panic("in bc_async_take, sys_page_map: %e", r);
+		fsstats.st_bc_readahead++;
+	}
+	if ((r = sys_page_unmap(0, bc_stage(ba, i))) < 0)
+		panic("in bc_async_take, sys_page_unmap: %e", r);
+}
+
+// Move the runs whose transfer is over into the cache.
+void
+bc_async_reap(void)
+{
+	struct BcAsync *ba;
+	uint32_t i;
+
+	mutex_lock(&bc_lock);
+	for (ba = bc_async; ba < bc_async + BC_NASYNC; ba++) {
+		if (!ba->ba_n || !ba->ba_req.ir_done)
+			continue;
+		for (i = 0; i < ba->ba_n; i++)
+			bc_async_take(ba, i);
+		ba->ba_n = 0;
+	}
+	mutex_unlock(&bc_lock);
+}
+
 // Fault any disk block that is read in to memory by
-// loading it from disk.
+// loading it from disk, evicting another block if the cache is full.
 static void
 bc_pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	struct BcAsync *ba;
 	int r;
 
 	// Check that the fault was within the block cache region
@@ -51,15 +284,49 @@ bc_pgfault(struct UTrapframe *utf)
 	// LAB 5: you code here:
     // JOS设置的block大小等于PGSIZE。
     addr = ROUNDDOWN(addr, PGSIZE);
-    if ((r=sys_page_alloc(0, addr, PTE_U|PTE_P|PTE_W)) < 0)
-        panic("in bc_pgfault, sys_page_alloc: %e", r);
-    if ((r=ide_read(blockno*BLKSECTS, addr, BLKSECTS)) < 0) // blockno*BLKSECTS得到blockno对应的sector no。
-        panic("in bc_pgfault, ide_read: %e", r);
-
-	// Clear the dirty bit for the disk block page since we just read the
-	// block from disk
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
-		panic("in bc_pgfault, sys_page_map: %e", r);
+    mutex_lock(&bc_lock);
+    // Another worker read the block in (or finished evicting it) while
+    // we waited for the lock.
+    if (va_is_mapped(addr) && (uvpt[PGNUM(addr)] & PTE_W)) {
+        mutex_unlock(&bc_lock);
+        return;
+    }
+    // A write to a block lent to clients (see bc_lend), which keep the
+    // page they were given: the cache gets a copy of its own.
+    if (va_is_mapped(addr)) {
+        if ((r = sys_page_alloc(0, (void *) BC_READVA, PTE_U|PTE_P|PTE_W)) < 0)
+            panic("in bc_pgfault, sys_page_alloc: %e", r);
+        memmove((void *) BC_READVA, addr, BLKSIZE);
+        // 借出前已经写回磁盘，所以拷贝是干净的（PTE_D为0）。
+        if ((r = sys_page_map(0, (void *) BC_READVA, 0, addr, PTE_U|PTE_P|PTE_W)) < 0)
+            panic("in bc_pgfault, sys_page_map: %e", r);
+        if ((r = sys_page_unmap(0, (void *) BC_READVA)) < 0)
+            panic("in bc_pgfault, sys_page_unmap: %e", r);
+        fsstats.st_bc_copied++;
+        mutex_unlock(&bc_lock);
+        return;
+    }
+    // The block is being read ahead: wait for the transfer and take
+    // just this block, leaving the rest of the run to bc_async_reap.
+    if ((ba = bc_async_lookup(blockno)) != NULL) {
+        ide_drain();
+        bc_async_take(ba, blockno - ba->ba_blockno);
+    }
+    if (!va_is_mapped(addr)) {
+        bc_reserve(blockno);
+        fsstats.st_bc_misses++;
+        if ((r=sys_page_alloc(0, (void *) BC_READVA, PTE_U|PTE_P|PTE_W)) < 0)
+            panic("in bc_pgfault, sys_page_alloc: %e", r);
+        if ((r=ide_read(blockno*BLKSECTS, (void *) BC_READVA, BLKSECTS)) < 0) // blockno*BLKSECTS得到blockno对应的sector no。
+            panic("in bc_pgfault, ide_read: %e", r);
+        // The new mapping starts out with PTE_D clear, since we just
+        // read the block from disk.
+        if ((r = sys_page_map(0, (void *) BC_READVA, 0, addr, PTE_U|PTE_P|PTE_W)) < 0)
+            panic("in bc_pgfault, sys_page_map: %e", r);
+        if ((r = sys_page_unmap(0, (void *) BC_READVA)) < 0)
+            panic("in bc_pgfault, sys_page_unmap: %e", r);
+    }
+    mutex_unlock(&bc_lock);
 
 	// Check that the block we read was allocated. (exercise for
 	// the reader: why do we do this *after* reading the block
@@ -69,6 +336,76 @@ bc_pgfault(struct UTrapframe *utf)
 		panic("reading free block %08x\n", blockno);
 }
 
+// Read the n consecutive blocks starting at blockno into the cache
+// with a single IDE command, unless another worker brought any of them
+// in meanwhile.  n is at most BC_MAXRUN, so the evictions that make
+// room for the later blocks can't pick the earlier ones (the hand would
+// have to pass them twice).
+void
+bc_read_run(uint32_t blockno, uint32_t n)
+{
+	char *addr = (char *) (DISKMAP + blockno * BLKSIZE);
+	char *stage = (char *) BC_READVA;
+	uint32_t i;
+	int r;
+
+	assert(n > 0 && n <= BC_MAXRUN);
+	mutex_lock(&bc_lock);
+	if (bc_run_present(blockno, n)) {
+		mutex_unlock(&bc_lock);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		bc_reserve(blockno + i);
+	for (i = 0; i < n; i++)
+		if ((r = sys_page_alloc(0, stage + i * BLKSIZE, PTE_U|PTE_P|PTE_W)) < 0)
+			panic("in bc_read_run, sys_page_alloc: %e", r);
+	// 连续的磁盘块在DISKMAP中的虚拟地址也是连续的，所以一条命令就能读完。
+	if ((r = ide_read(blockno * BLKSECTS, stage, n * BLKSECTS)) < 0)
+		panic("in bc_read_run, ide_read: %e", r);
+	for (i = 0; i < n; i++) {
+		if ((r = sys_page_map(0, stage + i * BLKSIZE, 0, addr + i * BLKSIZE,
+				      PTE_U|PTE_P|PTE_W)) < 0)
+			panic("in bc_read_run, sys_page_map: %e", r);
+		if ((r = sys_page_unmap(0, stage + i * BLKSIZE)) < 0)
+			panic("in bc_read_run, sys_page_unmap: %e", r);
+	}
+	fsstats.st_bc_readahead += n;
+	mutex_unlock(&bc_lock);
+}
+
+// Map the cached blocks [blockno, blockno + n) read-only at dstva, so
+// that they can be sent to a client, and return how many were mapped:
+// lending stops at the first block that isn't cached.
+//
+// The cache's own mapping of a lent block becomes read-only, and the
+// block is written back if it was dirty up to then (see bc_evict for
+// why that is one step).  So the client's page never changes under it:
+// the next write to the block faults, and bc_pgfault gives the cache a
+// fresh copy.  Eviction simply drops the cache's mapping, as for any
+// clean block.
+uint32_t
+bc_lend(uint32_t blockno, uint32_t n, void *dstva)
+{
+	char *addr = (char *) (DISKMAP + blockno * BLKSIZE);
+	uint32_t i;
+	int r;
+
+	mutex_lock(&bc_lock);
+	for (i = 0; i < n && va_is_mapped(addr + i * BLKSIZE); i++) {
+		if ((r = sys_page_clear(0, addr + i * BLKSIZE, PTE_W|PTE_D)) < 0)
+			panic("in bc_lend, sys_page_clear: %e", r);
+		if (r & PTE_D)
+			bc_write_run(blockno + i);
+		if ((r = sys_page_map(0, addr + i * BLKSIZE, 0, (char *) dstva + i * BLKSIZE,
+				      PTE_U|PTE_P)) < 0)
+			panic("in bc_lend, sys_page_map: %e", r);
+	}
+	fsstats.st_bc_lent += i;
+	mutex_unlock(&bc_lock);
+	return i;
+}
+
 // Flush the contents of the block containing VA out to disk if
 // necessary, then clear the PTE_D bit using sys_page_map.
 // If the block is not in the block cache or is not dirty, does
@@ -88,14 +425,144 @@ flush_block(void *addr)
 	// LAB 5: Your code here.
 	// panic("flush_block not implemented");
     addr = ROUNDDOWN(addr, PGSIZE);
-    if (!va_is_mapped(addr) || !va_is_dirty(addr))
+    mutex_lock(&bc_lock);
+    if (!va_is_mapped(addr) || !va_is_dirty(addr)) {
+        mutex_unlock(&bc_lock);
         return;
+    }
+    // clear PTE_D flag.  Clear it first: a write that another worker
+    // makes during the transfer then dirties the block again.
+	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+		panic("in flush_block, sys_page_map: %e", r);
     if ((r=ide_write(blockno*BLKSECTS, addr, BLKSECTS)) < 0)
 		panic("in flush_block, ide_write: %e", r);
+    mutex_unlock(&bc_lock);
+}
 
-    // clear PTE_D flag.
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
-		panic("in flush_block, sys_page_map: %e", r);
+// Write-back.  Nothing is written when it is dirtied: dirty blocks (the
+// ones whose page has PTE_D) stay in the cache until eviction, a flush
+// of their file, FSREQ_SYNC, or the flusher, which writes everything
+// BC_FLUSH_TICKS timer ticks after the first change.  Each write covers
+// a whole run of consecutive dirty blocks.
+
+static bool
+bc_is_dirty(uint32_t blockno)
+{
+	void *addr = (void *) (DISKMAP + blockno * BLKSIZE);
+
+	return va_is_mapped(addr) && va_is_dirty(addr);
+}
+
+// Write back blockno, which is dirty, together with the dirty blocks
+// right after it, with one IDE command; return how many blocks that
+// was.  PTE_D is cleared before the transfer, so a write that another
+// worker makes meanwhile dirties its block again rather than being lost.
+static uint32_t
+bc_write_run(uint32_t blockno)
+{
+	char *addr = (char *) (DISKMAP + blockno * BLKSIZE);
+	uint32_t i, n;
+	int r;
+
+	for (n = 1; n < BC_MAXRUN && bc_is_dirty(blockno + n); n++)
+		;
+	for (i = 0; i < n; i++)
+		if ((r = sys_page_map(0, addr + i * BLKSIZE, 0, addr + i * BLKSIZE,
+				      uvpt[PGNUM(addr + i * BLKSIZE)] & PTE_SYSCALL)) < 0)
+			panic("in bc_write_run, sys_page_map: %e", r);
+	if ((r = ide_write(blockno * BLKSECTS, addr, n * BLKSECTS)) < 0)
+		panic("in bc_write_run, ide_write: %e", r);
+	fsstats.st_bc_flushes++;
+	fsstats.st_bc_flushed += n;
+	return n;
+}
+
+// bc_flush_run with bc_lock held.
+static void
+bc_flush(uint32_t blockno)
+{
+	while (bc_is_dirty(blockno))
+		blockno += bc_write_run(blockno);
+}
+
+// If blockno is dirty, write it back together with the dirty blocks
+// right after it, BC_MAXRUN blocks per IDE command.
+void
+bc_flush_run(uint32_t blockno)
+{
+	mutex_lock(&bc_lock);
+	bc_flush(blockno);
+	mutex_unlock(&bc_lock);
+}
+
+// Write back every dirty block in the cache.
+void
+bc_sync(void)
+{
+	uint32_t i, b;
+
+	mutex_lock(&bc_lock);
+	// Only the first block of each run starts a write; the others go
+	// with it, whichever of them we come across first.
+	for (b = 1; bc_pinned(b); b++)
+		if (!bc_is_dirty(b - 1))
+			bc_flush(b);
+	for (i = 0; i < bc_nblocks; i++)
+		if (!bc_is_dirty(bc_blocks[i] - 1))
+			bc_flush(bc_blocks[i]);
+	mutex_unlock(&bc_lock);
+}
+
+static bool bc_flusher_on;	// Are we getting TIMER_NOTIFY?
+static uint32_t bc_ticks;	// Ticks since it was turned on
+static struct mutex bc_flusher_lock;
+
+// Called after blocks may have been dirtied: make sure the flusher will
+// write them out.
+void
+bc_dirtied(void)
+{
+	if (bc_flusher_on)
+		return;
+	mutex_lock(&bc_flusher_lock);
+	if (!bc_flusher_on && sys_irq_notify(IRQ_TIMER, TIMER_NOTIFY) == 0)
+		bc_flusher_on = 1;
+	bc_ticks = 0;
+	mutex_unlock(&bc_flusher_lock);
+}
+
+// Called on a TIMER_NOTIFY notification.  Ticks that come while the
+// server is busy arrive as one, so this is a lower bound on the time.
+void
+bc_tick(void)
+{
+	int r;
+
+	if (++bc_ticks < BC_FLUSH_TICKS)
+		return;
+	// Turn the flusher off before syncing: a worker that dirties a
+	// block after the sync has started then turns it back on.
+	mutex_lock(&bc_flusher_lock);
+	// 缓存马上就干净了，不再需要时钟通知，直到下一次修改。
+	if ((r = sys_irq_notify(IRQ_TIMER, 0)) < 0)
+		panic("sys_irq_notify: %e", r);
+	bc_flusher_on = 0;
+	mutex_unlock(&bc_flusher_lock);
+	bc_sync();
+}
+
+// Have the workers sfork'd from now on share the block cache's page
+// tables: the disk map for a disk of nblocks blocks, and the staging
+// area of the read-ahead runs, which any worker may take blocks from.
+void
+bc_share(uint32_t nblocks)
+{
+	int r;
+
+	if ((r = sfork_share((void *) DISKMAP, (void *) (DISKMAP + nblocks * BLKSIZE))) < 0
+	    || (r = sfork_share((void *) BC_STAGEVA,
+				(void *) (BC_STAGEVA + BC_NASYNC * BC_MAXRUN * BLKSIZE))) < 0)
+		panic("sfork_share: %e", r);
 }
 
 // Test that the block cache works, by smashing the superblock and
@@ -160,6 +627,7 @@ void
 bc_init(void)
 {
 	struct Super super;
+	fsstats.st_bc_max = BC_MAXBLOCKS;
 	set_pgfault_handler(bc_pgfault);
 	check_bc();
 
@@ -38,6 +38,25 @@ block_is_free(uint32_t blockno)
 	return 0;
 }
 
+// The allocator scans the bitmap a word (32 blocks) at a time from two
+// cursors, which only move back when blocks are freed: every word before
+// alloc_cursor is full, and no word before alloc_extent_cursor is
+// entirely free.  An entirely free word is a free extent of 32 blocks.
+static uint32_t alloc_cursor;
+static uint32_t alloc_extent_cursor;
+static struct mutex alloc_lock;	// The workers share the bitmap
+
+// Return bitmap word w, leaving out the bits past the end of the disk.
+static uint32_t
+bitmap_word(uint32_t w)
+{
+	uint32_t bits = bitmap[w];
+
+	if ((w + 1) * 32 > super->s_nblocks)
+		bits &= (1U << (super->s_nblocks % 32)) - 1;
+	return bits;
+}
+
 // Mark a block free in the bitmap
 void
 free_block(uint32_t blockno)
@@ -45,36 +64,76 @@ free_block(uint32_t blockno)
 	// Blockno zero is the null pointer of block numbers.
 	if (blockno == 0)
 		panic("attempt to free zero block");
+	mutex_lock(&alloc_lock);
 	bitmap[blockno/32] |= 1<<(blockno%32);
+	alloc_cursor = MIN(alloc_cursor, blockno / 32);
+	if (bitmap_word(blockno / 32) == ~0U)
+		alloc_extent_cursor = MIN(alloc_extent_cursor, blockno / 32);
+	mutex_unlock(&alloc_lock);
 }
 
-// Search the bitmap for a free block and allocate it.  When you
-// allocate a block, immediately flush the changed bitmap block
-// to disk.
+// Search the bitmap for a free block and allocate it: the lowest
+// numbered one, found with one find-first-set per bitmap word.  The
+// changed bitmap block is written back later, like any other dirty
+// block.
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
-//
-// Hint: use free_block as an example for manipulating the bitmap.
+static int
+alloc_block_locked(void)
+{
+	uint32_t w, bits, nwords = (super->s_nblocks + 31) / 32;
+
+	for (w = alloc_cursor; w < nwords; w++)
+		if ((bits = bitmap_word(w)) != 0) {
+			alloc_cursor = w;
+			bitmap[w] &= ~(1U << __builtin_ctz(bits));
+			return w * 32 + __builtin_ctz(bits);
+		}
+	alloc_cursor = nwords;
+	return -E_NO_DISK;
+}
+
 int
 alloc_block(void)
 {
-	// The bitmap consists of one or more blocks.  A single bitmap block
-	// contains the in-use bits for BLKBITSIZE blocks.  There are
-	// super->s_nblocks blocks in the disk altogether.
-
-	// LAB 5: Your code here.
-	// panic("alloc_block not implemented");
-    for (int i=1; i<super->s_nblocks; i++) {
-        if (bitmap[i/32] & (1<<i%32)) {
-	        bitmap[i/32] &= ~(1<<(i%32));
-            // flush_block(bitmap);
-            // XXX 有可能出错，如果bitmap大于一个block且i/32刚好在多出一个block的block中的话。
-            flush_block(&bitmap[i/32]); // 修改了bitmap，需要把它写回磁盘，更新磁盘上的bitmap blocks。
-            return i; // XXX 返回一个指向空闲block的指针。
-        }
-    }
-	return -E_NO_DISK;
+	int r;
+
+	mutex_lock(&alloc_lock);
+	r = alloc_block_locked();
+	mutex_unlock(&alloc_lock);
+	return r;
+}
+
+// Allocate a data block for a file whose previous block is goal - 1,
+// or 0 for its first block, so that a growing file stays contiguous
+// on disk.  Take goal itself if it is free; otherwise start a new run
+// at the beginning of a free extent, which leaves the file room to grow.
+// Fall back on alloc_block once there are no free extents left.
+int
+alloc_block_near(uint32_t goal)
+{
+	uint32_t w, nwords = (super->s_nblocks + 31) / 32;
+	int r;
+
+	mutex_lock(&alloc_lock);
+	if (goal != 0 && block_is_free(goal)) {
+		bitmap[goal / 32] &= ~(1U << (goal % 32));
+		r = goal;
+		goto out;
+	}
+	for (w = alloc_extent_cursor; w < nwords; w++)
+		if (bitmap_word(w) == ~0U) {
+			alloc_extent_cursor = w + 1;
+			bitmap[w] &= ~1U;
+			r = w * 32;
+			goto out;
+		}
+	alloc_extent_cursor = nwords;
+	r = alloc_block_locked();
+out:
+	mutex_unlock(&alloc_lock);
+	return r;
 }
 
 // Validate the file system bitmap.
@@ -114,6 +173,7 @@ fs_init(void)
 		ide_set_disk(1);
 	else
 		ide_set_disk(0);
+	ide_init_intr();
 	bc_init();
 
 	// Set "super" to point to the super block.
@@ -129,8 +189,9 @@ fs_init(void)
 // Find the disk block number slot for the 'filebno'th block in file 'f'.
 // Set '*ppdiskbno' to point to that slot.
 // The slot will be one of the f->f_direct[] entries,
-// or an entry in the indirect block.
-// When 'alloc' is set, this function will allocate an indirect block
+// an entry in the indirect block, or an entry in one of the indirect
+// blocks the double-indirect block points to.
+// When 'alloc' is set, this function will allocate indirect blocks
 // if necessary.
 //
 // Returns:
@@ -138,7 +199,8 @@ fs_init(void)
 //	-E_NOT_FOUND if the function needed to allocate an indirect block, but
 //		alloc was 0.
 //	-E_NO_DISK if there's no space on the disk for an indirect block.
-//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT).
+//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT
+//		+ NDINDIRECT).
 //
 // Analogy: This is like pgdir_walk for files.
 // Hint: Don't forget to clear any block you allocate.
@@ -147,29 +209,99 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 {
     // LAB 5: Your code here.
     // panic("file_block_walk not implemented");
-    if (filebno >= NDIRECT+NINDIRECT)
+    uint32_t *pind;
+
+    if (filebno >= NDIRECT+NINDIRECT+NDINDIRECT)
         return -E_INVAL;
     if (filebno < NDIRECT) {
         *ppdiskbno = &(f->f_direct[filebno]);
         return 0;
     }
-    if (f->f_indirect == 0) {
+    if (filebno < NDIRECT+NINDIRECT) {
+        pind = &f->f_indirect;
+        filebno -= NDIRECT;
+    } else {
+        // 二级间接块：先找到它指向的那个一级间接块。
+        filebno -= NDIRECT+NINDIRECT;
+        if (f->f_dindirect == 0) {
+            if (!alloc)
+                return -E_NOT_FOUND;
+            int bno = alloc_block();
+            if (bno < 0)
+                return -E_NO_DISK;
+            memset(diskaddr(bno), 0, BLKSIZE);
+            f->f_dindirect = bno;
+        }
+        pind = (uint32_t*)diskaddr(f->f_dindirect) + filebno / NINDIRECT;
+        filebno %= NINDIRECT;
+    }
+    if (*pind == 0) {
         if (alloc) {
             int bno = alloc_block();
             if (bno < 0)
                 return -E_NO_DISK;
             memset(diskaddr(bno), 0, BLKSIZE);
-            f->f_indirect = bno;
+            *pind = bno;
         } else {
             return -E_NOT_FOUND;
         }
     }
-    uint32_t *indirect = (uint32_t*)diskaddr(f->f_indirect);
+    uint32_t *indirect = (uint32_t*)diskaddr(*pind);
     // 尽管解引用地址，把各种分配页和载入内存的琐事较给fs/bc.c:bc_pgfault即可。
-    *ppdiskbno = &indirect[filebno-NDIRECT];
+    *ppdiskbno = &indirect[filebno];
     return 0;
 }
 
+// Find how many of f's blocks from filebno on (at most max) sit in
+// consecutive disk blocks, and set *pdiskbno to the first of them.  One
+// walk covers every block whose pointer is in the same array (f_direct
+// or an indirect block) as filebno's.
+//
+// Returns the number of blocks, 0 if filebno has no block, or < 0 on
+// error (as for file_block_walk with alloc 0).
+static int
+file_map_run(struct File *f, uint32_t filebno, uint32_t max, uint32_t *pdiskbno)
+{
+	uint32_t *p, i, left, n = 0;
+	int r;
+
+	while (n < max) {
+		if ((r = file_block_walk(f, filebno + n, &p, 0)) < 0)
+			return n > 0 ? n : r;
+		if (n == 0) {
+			if ((*pdiskbno = *p) == 0)
+				return 0;
+		}
+		// Pointers left in this array
+		if (filebno + n < NDIRECT)
+			left = NDIRECT - (filebno + n);
+		else
+			left = NINDIRECT - (filebno + n - NDIRECT) % NINDIRECT;
+		for (i = 0; i < left && n < max; i++, n++)
+			if (p[i] != *pdiskbno + n)
+				return n;
+	}
+	return n;
+}
+
+// Set *blk to the address of f's block filebno, allocating it if need
+// be, and return how many of f's blocks from there on (at most max) are
+// contiguous in memory, so that they can be copied in one go.
+static int
+file_get_run(struct File *f, uint32_t filebno, uint32_t max, char **blk)
+{
+	uint32_t diskbno;
+	int n, r;
+
+	if ((n = file_map_run(f, filebno, max, &diskbno)) > 0) {
+		*blk = diskaddr(diskbno);
+		return n;
+	}
+	if ((r = file_get_block(f, filebno, blk)) < 0)
+		return r;
+	return 1;
+}
+
 // Set *blk to the address in memory where the filebno'th
 // block of file 'f' would be mapped.
 //
@@ -183,10 +315,16 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
     // LAB 5: Your code here.
     // panic("file_get_block not implemented");
-    uint32_t *pbno;
+    uint32_t *pbno, goal = 0;
     int r = file_block_walk(f, filebno, &pbno, 1);
+    if (r < 0)
+        return r;
     if (*pbno == 0) {
-        if ((r=alloc_block()) < 0)
+        // 尽量紧接着前一个块分配，使文件在磁盘上连续。
+        if (filebno > 0 && file_block_walk(f, filebno - 1, &pbno, 0) == 0 && *pbno != 0)
+            goal = *pbno + 1;
+        file_block_walk(f, filebno, &pbno, 0);
+        if ((r=alloc_block_near(goal)) < 0)
             return r;
         *pbno = r;
     }
@@ -194,7 +332,43 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
     return 0;
 }
 
+// Probe hashed dir for name, visiting its buckets in the order an entry
+// for name would have been placed in them.  Returns 0 and sets *file if
+// found.  Otherwise returns -E_NOT_FOUND and sets *slot to the free slot
+// the entry would go in, or to NULL if every bucket is full.
+static int
+dir_hash_probe(struct File *dir, const char *name, struct File **file,
+	       struct File **slot)
+{
+	int r;
+	uint32_t h, i, j;
+	char *blk;
+	struct File *f;
+
+	h = fs_name_hash(name) % dir->f_nbuckets;
+	*slot = NULL;
+	for (i = 0; i < dir->f_nbuckets; i++) {
+		if ((r = file_get_block(dir, (h + i) % dir->f_nbuckets, &blk)) < 0)
+			return r;
+		f = (struct File*) blk;
+		for (j = 0; j < BLKFILES; j++) {
+			if (f[j].f_name[0] == '\0') {
+				if (!*slot)
+					*slot = &f[j];
+			} else if (strcmp(f[j].f_name, name) == 0) {
+				*file = &f[j];
+				return 0;
+			}
+		}
+		// 这个桶没满，说明name不会被放到后面的桶里。
+		if (*slot)
+			break;
+	}
+	return -E_NOT_FOUND;
+}
+
 // Try to find a file named "name" in dir.  If so, set *file to it.
+// A hashed directory reads one block, unless its buckets fill up.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
 //	-E_NOT_FOUND if the file is not found
@@ -202,7 +376,7 @@ static int
 dir_lookup(struct File *dir, const char *name, struct File **file)
 {
 	int r;
-	uint32_t i, j, nblock;
+	uint32_t i, j, nblock, start = 0;
 	char *blk;
 	struct File *f;
 
@@ -212,8 +386,13 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	// is always a multiple of the file system's block size.
     // JOS中的目录文件是File对象数组。
 	assert((dir->f_size % BLKSIZE) == 0);
+	if (dir->f_flags & FILE_HASHED) {
+		if ((r = dir_hash_probe(dir, name, file, &f)) != -E_NOT_FOUND || f)
+			return r;
+		start = dir->f_nbuckets;	// Try the overflow blocks
+	}
 	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++) {
+	for (i = start; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
 			return r;
 		f = (struct File*) blk; // File对象数组。
@@ -226,19 +405,27 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	return -E_NOT_FOUND;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// Set *file to point at a free File structure in dir, where an entry
+// named name belongs.  The caller is responsible for filling in the
+// File fields.
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_alloc_file(struct File *dir, const char *name, struct File **file)
 {
 	int r;
-	uint32_t nblock, i, j;
+	uint32_t nblock, i, j, start = 0;
 	char *blk;
 	struct File *f;
 
 	assert((dir->f_size % BLKSIZE) == 0);
+	if (dir->f_flags & FILE_HASHED) {
+		if ((r = dir_hash_probe(dir, name, &f, file)) == 0)
+			return -E_FILE_EXISTS;
+		if (r != -E_NOT_FOUND || *file)
+			return r;
+		start = dir->f_nbuckets;	// Every bucket is full
+	}
 	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++) {
+	for (i = start; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
 			return r;
 		f = (struct File*) blk;
@@ -258,6 +445,65 @@ dir_alloc_file(struct File *dir, struct File **file)
 	return 0;
 }
 
+// Path-lookup cache: (directory, name) to the directory's entry for the
+// name, or to NULL if there is none.  It is direct-mapped on the hash of
+// both.  A struct File never moves, so an entry goes stale only when a
+// create fills in the name or the directory's contents change some other
+// way (dcache_flush).
+#define DCACHE_SIZE	128
+
+struct Dentry {
+	struct File *d_dir;	// NULL if the slot is empty
+	struct File *d_file;	// NULL for a negative entry
+	char d_name[MAXNAMELEN];
+};
+
+static struct Dentry dcache[DCACHE_SIZE];
+
+static struct Dentry *
+dcache_slot(struct File *dir, const char *name)
+{
+	return &dcache[(fs_name_hash(name) ^ ((uint32_t) dir / sizeof(struct File)))
+		       % DCACHE_SIZE];
+}
+
+// Forget everything cached.  Used when a directory's contents change
+// under us; its subdirectories' entries may have changed too.
+static void
+dcache_flush(void)
+{
+	int i;
+
+	for (i = 0; i < DCACHE_SIZE; i++)
+		dcache[i].d_dir = NULL;
+}
+
+// dir_lookup through the path-lookup cache.
+static int
+dir_lookup_cached(struct File *dir, const char *name, struct File **file)
+{
+	struct Dentry *d = dcache_slot(dir, name);
+	int r;
+
+	if (d->d_dir == dir && strcmp(d->d_name, name) == 0) {
+		fsstats.st_dc_hits++;
+		if (!d->d_file) {
+			fsstats.st_dc_negative++;
+			return -E_NOT_FOUND;
+		}
+		*file = d->d_file;
+		return 0;
+	}
+	fsstats.st_dc_misses++;
+	r = dir_lookup(dir, name, file);
+	if (r == 0 || r == -E_NOT_FOUND) {
+		d->d_dir = dir;
+		d->d_file = r == 0 ? *file : NULL;
+		strcpy(d->d_name, name);
+	}
+	return r;
+}
+
 // Skip over slashes.
 static const char*
 skip_slash(const char *p)
@@ -305,7 +551,7 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 		if (dir->f_type != FTYPE_DIR)
 			return -E_NOT_FOUND;
 
-		if ((r = dir_lookup(dir, name, &f)) < 0) {
+		if ((r = dir_lookup_cached(dir, name, &f)) < 0) {
 			if (r == -E_NOT_FOUND && *path == '\0') {
 				if (pdir)
 					*pdir = dir;
@@ -327,6 +573,39 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 // File operations
 // --------------------------------------------------------------
 
+// The file server's workers share everything here.  ns_lock covers path
+// lookups, the path-lookup cache and creates, and doubles as the lock
+// of every directory, since those read and change directory contents.
+// Regular files are locked with one of FILE_NLOCKS locks picked by the
+// address of their struct File.  A file's lock is taken before
+// alloc_lock and the block cache's lock.
+#define FILE_NLOCKS	64
+
+static struct mutex ns_lock;
+static struct mutex file_locks[FILE_NLOCKS];
+
+static struct mutex *
+file_mutex(struct File *f)
+{
+	if (f->f_type == FTYPE_DIR)
+		return &ns_lock;
+	return &file_locks[((uint32_t) f / sizeof(struct File)) % FILE_NLOCKS];
+}
+
+// Lock f against the other workers' reads, writes, truncates and
+// flushes of it.  Callers of those functions hold f's lock.
+void
+file_lock(struct File *f)
+{
+	mutex_lock(file_mutex(f));
+}
+
+void
+file_unlock(struct File *f)
+{
+	mutex_unlock(file_mutex(f));
+}
+
 // Create "path".  On success set *pf to point at the file and return 0.
 // On error return < 0.
 int
@@ -336,18 +615,26 @@ file_create(const char *path, struct File **pf)
 	char name[MAXNAMELEN];
 	int r;
 	struct File *dir, *f;
+	struct Dentry *d;
 
+	mutex_lock(&ns_lock);
 	if ((r = walk_path(path, &dir, &f, name)) == 0)
-		return -E_FILE_EXISTS;
+		r = -E_FILE_EXISTS;
 	if (r != -E_NOT_FOUND || dir == 0)
-		return r;
-	if ((r = dir_alloc_file(dir, &f)) < 0)
-		return r;
+		goto out;
+	if ((r = dir_alloc_file(dir, name, &f)) < 0)
+		goto out;
 
 	strcpy(f->f_name, name);
 	*pf = f;
-	file_flush(dir);
-	return 0;
+	// 清除可能存在的“不存在”缓存项。
+	d = dcache_slot(dir, name);
+	if (d->d_dir == dir && strcmp(d->d_name, name) == 0)
+		d->d_dir = NULL;
+	bc_dirtied();
+out:
+	mutex_unlock(&ns_lock);
+	return r;
 }
 
 // Open "path".  On success set *pf to point at the file and return 0.
@@ -355,7 +642,116 @@ file_create(const char *path, struct File **pf)
 int
 file_open(const char *path, struct File **pf)
 {
-	return walk_path(path, 0, pf, 0);
+	int r;
+
+	mutex_lock(&ns_lock);
+	r = walk_path(path, 0, pf, 0);
+	mutex_unlock(&ns_lock);
+	return r;
+}
+
+// Read-ahead state of the files read most recently.  A read that
+// starts at the block where the previous read of the same file ended
+// is sequential, and each sequential read doubles the read-ahead window
+// up to RA_MAXBLOCKS; any other read closes it again.
+#define RA_NFILES	8
+
+struct Readahead {
+	struct File *ra_file;
+	uint32_t ra_next;	// First block after the last read
+	uint32_t ra_window;	// Blocks to read ahead of the reader
+	uint32_t ra_end;	// End of what we already read ahead
+};
+
+static struct Readahead readahead[RA_NFILES];
+static int ra_victim;
+static struct mutex ra_lock;
+
+// Is the block neither cached nor being read in?
+static bool
+block_uncached(uint32_t diskbno)
+{
+	return !va_is_mapped((void *) (DISKMAP + diskbno * BLKSIZE))
+		&& !bc_inflight(diskbno);
+}
+
+// Bring the uncached blocks among f's blocks [start, end) into the
+// cache, reading each run of consecutive disk blocks with one command.
+// With async, only start the reads and return.  Blocks already being
+// read in the background are skipped; touching one waits for it.
+static void
+file_prefetch(struct File *f, uint32_t start, uint32_t end, bool async)
+{
+	uint32_t diskbno, i, j;
+	int n;
+
+	while (start < end) {
+		if ((n = file_map_run(f, start, MIN(end - start, BC_MAXRUN), &diskbno)) <= 0) {
+			start++;
+			continue;
+		}
+		// Read each stretch of the run that isn't cached or coming.
+		for (i = 0; i < n; i = j + 1) {
+			for (j = i; j < n && !block_uncached(diskbno + j); j++)
+				;
+			for (i = j; j < n && block_uncached(diskbno + j); j++)
+				;
+			if (i == j)
+				break;
+			if (!async)
+				bc_read_run(diskbno + i, j - i);
+			else if (bc_read_run_async(diskbno + i, j - i) < 0)
+				return;	// Enough in flight; the reader will be back
+		}
+		start += n;
+	}
+}
+
+// Called by file_read before it reads f's blocks [first, last]: fetch
+// them in as few IDE commands as possible, and start reading the
+// read-ahead window after them in the background if the reader is
+// sequential.
+static void
+file_readahead(struct File *f, uint32_t first, uint32_t last)
+{
+	struct Readahead *ra;
+	uint32_t nblocks = ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE;
+	uint32_t start, end, ra_start, ra_end;
+	int i;
+
+	// Only the bookkeeping is under ra_lock; the reads aren't.
+	mutex_lock(&ra_lock);
+	for (i = 0; i < RA_NFILES && readahead[i].ra_file != f; i++)
+		;
+	if (i == RA_NFILES) {
+		ra = &readahead[ra_victim];
+		ra_victim = (ra_victim + 1) % RA_NFILES;
+		memset(ra, 0, sizeof(*ra));
+		ra->ra_file = f;
+	} else
+		ra = &readahead[i];
+
+	// 顺序读：窗口加倍；随机读：关闭预读，只批量读本次请求的块。
+	// (A read that starts in the block the last one ended in counts too.)
+	if (ra->ra_next != 0 && (first == ra->ra_next || first + 1 == ra->ra_next))
+		ra->ra_window = MIN(MAX(ra->ra_window * 2, 4), RA_MAXBLOCKS);
+	else {
+		ra->ra_window = 0;
+		ra->ra_end = 0;
+	}
+	ra->ra_next = last + 1;
+	start = MAX(first, ra->ra_end);
+	end = MIN(last + 1, nblocks);
+	ra_start = MAX(start, end);
+	ra_end = MIN(last + 1 + ra->ra_window, nblocks);
+	ra->ra_end = MAX(ra->ra_end, ra_end);
+	mutex_unlock(&ra_lock);
+
+	bc_async_reap();
+	if (start < end)
+		file_prefetch(f, start, end, 0);
+	if (ra_start < ra_end)
+		file_prefetch(f, ra_start, ra_end, 1);
 }
 
 // Read count bytes from f into buf, starting from seek position
@@ -372,11 +768,16 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 		return 0;
 
 	count = MIN(count, f->f_size - offset);
+	if (count == 0)
+		return 0;
+	file_readahead(f, offset / BLKSIZE, (offset + count - 1) / BLKSIZE);
 
+	// 连续的磁盘块在DISKMAP中也是连续的，一次拷贝一整段。
 	for (pos = offset; pos < offset + count; ) {
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+		if ((r = file_get_run(f, pos / BLKSIZE,
+				      (offset + count - 1) / BLKSIZE - pos / BLKSIZE + 1, &blk)) < 0)
 			return r;
-		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
+		bn = MIN(r * BLKSIZE - pos % BLKSIZE, offset + count - pos);
 		memmove(buf, blk + pos % BLKSIZE, bn);
 		pos += bn;
 		buf += bn;
@@ -385,6 +786,53 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	return count;
 }
 
+// Map f's blocks from offset on, as far as count bytes go, read-only at
+// dstva for FSREQ_READMAP (see bc_lend).  The block the file ends in,
+// if it is only partly used, gets a copy instead, so that nothing past
+// the end of the file shows.  offset must be block-aligned.
+// Returns the number of bytes mapped, which falls short if a block was
+// evicted before it could be lent, or < 0 on error.
+ssize_t
+file_lend(struct File *f, off_t offset, size_t count, void *dstva)
+{
+	uint32_t first, nblocks, bno, i, n;
+	char *blk, *dst;
+	int r;
+
+	assert(offset % BLKSIZE == 0);
+	if (offset >= f->f_size)
+		return 0;
+	count = MIN(count, f->f_size - offset);
+	if (count == 0)
+		return 0;
+	first = offset / BLKSIZE;
+	nblocks = count / BLKSIZE;
+	file_readahead(f, first, (offset + count - 1) / BLKSIZE);
+
+	for (bno = first; bno < first + nblocks; bno += n) {
+		if ((r = file_get_run(f, bno, first + nblocks - bno, &blk)) < 0)
+			return r;
+		// Fault in whatever another worker evicted since the read-ahead.
+		for (i = 0; i < r; i++)
+			(void) *(volatile char *) (blk + i * BLKSIZE);
+		n = bc_lend(((uintptr_t) blk - DISKMAP) / BLKSIZE, r,
+			    (char *) dstva + (bno - first) * BLKSIZE);
+		if (n < r)
+			return (bno + n - first) * BLKSIZE;
+	}
+	if (count % BLKSIZE == 0)
+		return count;
+
+	// 文件最后一个不完整的块：复制一份，页的其余部分为0。
+	if ((r = file_get_block(f, bno, &blk)) < 0)
+		return r;
+	dst = (char *) dstva + nblocks * BLKSIZE;
+	if ((r = sys_page_alloc(0, dst, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	memmove(dst, blk, count % BLKSIZE);
+	return count;
+}
+
 
 // Write count bytes from buf into f, starting at seek position
 // offset.  This is meant to mimic the standard pwrite function.
@@ -397,19 +845,25 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	off_t pos;
 	char *blk;
 
+	// Writing a directory can change any of its entries
+	if (f->f_type == FTYPE_DIR)
+		dcache_flush();
+
 	// Extend file if necessary
 	if (offset + count > f->f_size)
 		if ((r = file_set_size(f, offset + count)) < 0)
 			return r;
 
 	for (pos = offset; pos < offset + count; ) {
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+		if ((r = file_get_run(f, pos / BLKSIZE,
+				      (offset + count - 1) / BLKSIZE - pos / BLKSIZE + 1, &blk)) < 0)
 			return r;
-		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
+		bn = MIN(r * BLKSIZE - pos % BLKSIZE, offset + count - pos);
 		memmove(blk + pos % BLKSIZE, buf, bn);
 		pos += bn;
 		buf += bn;
 	}
+	bc_dirtied();
 
 	return count;
 }
@@ -444,7 +898,7 @@ static void
 file_truncate_blocks(struct File *f, off_t newsize)
 {
 	int r;
-	uint32_t bno, old_nblocks, new_nblocks;
+	uint32_t bno, old_nblocks, new_nblocks, first, *dind;
 
 	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
 	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
@@ -456,16 +910,37 @@ file_truncate_blocks(struct File *f, off_t newsize)
 		free_block(f->f_indirect);
 		f->f_indirect = 0;
 	}
+	if (f->f_dindirect) {
+		// Free the indirect blocks no longer needed, then the
+		// double-indirect block itself if none are.
+		dind = (uint32_t *) diskaddr(f->f_dindirect);
+		first = 0;
+		if (new_nblocks > NDIRECT + NINDIRECT)
+			first = ROUNDUP(new_nblocks - NDIRECT - NINDIRECT, NINDIRECT) / NINDIRECT;
+		for (bno = first; bno < NINDIRECT; bno++)
+			if (dind[bno]) {
+				free_block(dind[bno]);
+				dind[bno] = 0;
+			}
+		if (first == 0) {
+			free_block(f->f_dindirect);
+			f->f_dindirect = 0;
+		}
+	}
 }
 
 // Set the size of file f, truncating or extending as necessary.
 int
 file_set_size(struct File *f, off_t newsize)
 {
+	// Truncating a directory drops the entries past newsize, and the
+	// cache must not hand out pointers into the freed blocks.
+	if (f->f_type == FTYPE_DIR)
+		dcache_flush();
 	if (f->f_size > newsize)
 		file_truncate_blocks(f, newsize);
 	f->f_size = newsize;
-	flush_block(f);
+	bc_dirtied();
 	return 0;
 }
 
@@ -476,18 +951,26 @@ file_set_size(struct File *f, off_t newsize)
 void
 file_flush(struct File *f)
 {
-	int i;
-	uint32_t *pdiskbno;
+	int i, j, n;
+	uint32_t diskbno, nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE, *dind;
 
-	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
-		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
-		    pdiskbno == NULL || *pdiskbno == 0)
+	for (i = 0; i < nblocks; i += MAX(n, 1)) {
+		if ((n = file_map_run(f, i, nblocks - i, &diskbno)) <= 0)
 			continue;
-		flush_block(diskaddr(*pdiskbno));
+		// 连续的脏块用一条命令写回。
+		for (j = 0; j < n; j++)
+			bc_flush_run(diskbno + j);
 	}
 	flush_block(f);
 	if (f->f_indirect)
 		flush_block(diskaddr(f->f_indirect));
+	if (f->f_dindirect) {
+		dind = (uint32_t *) diskaddr(f->f_dindirect);
+		for (i = 0; i < NINDIRECT; i++)
+			if (dind[i])
+				flush_block(diskaddr(dind[i]));
+		flush_block(dind);
+	}
 }
 
 
@@ -495,8 +978,6 @@ file_flush(struct File *f)
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	bc_sync();
 }
 
@@ -11,8 +11,42 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* Most blocks the block cache keeps in memory at once, not counting the
+ * superblock and the bitmap, which stay cached.  Override with
+ * -DBC_MAXBLOCKS=n. */
+#ifndef BC_MAXBLOCKS
+#define BC_MAXBLOCKS	1024
+#endif
+
+/* Longest run of blocks read with one IDE command (256 sectors at most) */
+#define BC_MAXRUN	MIN(256 / BLKSECTS, BC_MAXBLOCKS / 2)
+
+/* Most blocks file_read reads ahead of a sequential reader */
+#define RA_MAXBLOCKS	64
+
+/* Notification bits the kernel sends us for IRQ_TIMER and IRQ_IDE; the
+ * ring ids take the bits below them. */
+#define TIMER_NOTIFY	(1U << 30)
+#define IDE_NOTIFY	(1U << 31)
+
+/* Timer ticks dirty blocks may wait before the flusher writes them */
+#define BC_FLUSH_TICKS	30
+
+/* An IDE transfer done in the background (see ide_submit) */
+struct IdeReq {
+	uint32_t ir_secno;	// First sector
+	void *ir_buf;
+	uint32_t ir_nsecs;	// At most 256
+	bool ir_write;
+	volatile bool ir_done;	// Set when the transfer is over...
+	int ir_result;		// ...with this result
+	uint32_t ir_ndone;	// Sectors transferred so far
+	struct IdeReq *ir_next;	// Next in the queue
+};
+
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
+struct FsStats fsstats;		// counters for FSREQ_STATS
 
 /* ide.c */
 bool	ide_probe_disk1(void);
@@ -20,12 +54,26 @@ void	ide_set_disk(int diskno);
 void	ide_set_partition(uint32_t first_sect, uint32_t nsect);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
+void	ide_init_intr(void);
+void	ide_submit(struct IdeReq *req);
+void	ide_intr(void);
+void	ide_drain(void);
 
 /* bc.c */
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	bc_flush_run(uint32_t blockno);
+void	bc_sync(void);
+void	bc_dirtied(void);
+void	bc_tick(void);
+void	bc_read_run(uint32_t blockno, uint32_t n);
+int	bc_read_run_async(uint32_t blockno, uint32_t n);
+bool	bc_inflight(uint32_t blockno);
+void	bc_async_reap(void);
+void	bc_share(uint32_t nblocks);
+uint32_t	bc_lend(uint32_t blockno, uint32_t n, void *dstva);
 void	bc_init(void);
 
 /* fs.c */
@@ -34,15 +82,19 @@ int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
+ssize_t	file_lend(struct File *f, off_t offset, size_t count, void *dstva);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
 void	file_flush(struct File *f);
 int	file_remove(const char *path);
 void	fs_sync(void);
+void	file_lock(struct File *f);
+void	file_unlock(struct File *f);
 
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
 int	alloc_block(void);
+int	alloc_block_near(uint32_t goal);
 
 /* test.c */
 void	fs_test(void);
@@ -33,6 +33,7 @@ typedef int bool;
 
 #define ROUNDUP(n, v) ((n) - 1 + (v) - ((n) - 1) % (v))
 #define MAX_DIR_ENTS 128
+#define DIR_MINBUCKETS 8
 
 struct Dir
 {
@@ -42,6 +43,7 @@ struct Dir
 };
 
 uint32_t nblocks;
+uint32_t fillstart, fillend;	// Area taken by fillfiles
 char *diskmap, *diskpos;
 struct Super *super;
 uint32_t *bitmap;
@@ -125,26 +127,40 @@ finishdisk(void)
 	int r, i;
 
 	for (i = 0; i < blockof(diskpos); ++i)
-		bitmap[i/32] &= ~(1<<(i%32));
+		if (i < fillstart || i >= fillend || (i - fillstart) % 4 != 3)
+			bitmap[i/32] &= ~(1<<(i%32));
 
 	if ((r = msync(diskmap, nblocks * BLKSIZE, MS_SYNC)) < 0)
 		panic("msync: %s", strerror(errno));
 }
 
+// Point f at its len bytes of data, laid out contiguously from block
+// start.  The indirect blocks go after the data, to keep it one extent.
 void
 finishfile(struct File *f, uint32_t start, uint32_t len)
 {
-	int i;
+	uint32_t i, k, *ind, *dind;
 	f->f_size = len;
 	len = ROUNDUP(len, BLKSIZE);
 	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
 		f->f_direct[i] = start + i;
 	if (i == NDIRECT) {
-		uint32_t *ind = alloc(BLKSIZE);
+		ind = alloc(BLKSIZE);
 		f->f_indirect = blockof(ind);
-		for (; i < len / BLKSIZE; ++i)
+		for (; i < len / BLKSIZE && i < NDIRECT + NINDIRECT; ++i)
 			ind[i - NDIRECT] = start + i;
 	}
+	if (i == NDIRECT + NINDIRECT && i < len / BLKSIZE) {
+		dind = alloc(BLKSIZE);
+		f->f_dindirect = blockof(dind);
+		for (; i < len / BLKSIZE; ++i) {
+			k = i - NDIRECT - NINDIRECT;
+			if (k % NINDIRECT == 0)
+				dind[k / NINDIRECT] = blockof(alloc(BLKSIZE));
+			ind = (uint32_t *) (diskmap + dind[k / NINDIRECT] * BLKSIZE);
+			ind[k % NINDIRECT] = start + i;
+		}
+	}
 }
 
 void
@@ -166,13 +182,29 @@ diradd(struct Dir *d, uint32_t type, const char *name)
 	return out;
 }
 
+// Write out d as a hashed directory (see inc/fs.h), with half of its
+// buckets' slots free to leave room for the files created at run time.
 void
 finishdir(struct Dir *d)
 {
-	int size = d->n * sizeof(struct File);
-	struct File *start = alloc(size);
-	memmove(start, d->ents, size);
-	finishfile(d->f, blockof(start), ROUNDUP(size, BLKSIZE));
+	uint32_t nbuckets = (2 * d->n + BLKFILES - 1) / BLKFILES;
+	struct File *start, *slot;
+	uint32_t b, i, j;
+
+	if (nbuckets < DIR_MINBUCKETS)
+		nbuckets = DIR_MINBUCKETS;
+	start = alloc(nbuckets * BLKSIZE);
+	for (i = 0; i < d->n; i++) {
+		b = fs_name_hash(d->ents[i].f_name) % nbuckets;
+		for (slot = NULL; !slot; b = (b + 1) % nbuckets)
+			for (j = 0; j < BLKFILES && !slot; j++)
+				if (start[b * BLKFILES + j].f_name[0] == '\0')
+					slot = &start[b * BLKFILES + j];
+		*slot = d->ents[i];
+	}
+	finishfile(d->f, blockof(start), nbuckets * BLKSIZE);
+	d->f->f_flags |= FILE_HASHED;
+	d->f->f_nbuckets = nbuckets;
 	free(d->ents);
 	d->ents = NULL;
 }
@@ -208,17 +240,55 @@ writefile(struct Dir *dir, const char *name)
 	close(fd);
 }
 
+// Fill n blocks with the files fill.0, fill.1, ..., leaving every
+// fourth block of the area they take free, for trying the allocator on
+// a mostly full, fragmented disk.
+void
+fillfiles(struct Dir *dir, uint32_t n)
+{
+	struct File *f = NULL;
+	uint32_t *ind = NULL;
+	uint32_t b, nb = 0, nfiles = 0;
+	char name[MAXNAMELEN];
+
+	fillstart = blockof(diskpos);
+	while (n > 0) {
+		b = blockof(alloc(BLKSIZE));
+		if ((b - fillstart) % 4 == 3)
+			continue;	// Freed by finishdisk
+		n--;
+		if (f == NULL || nb == NDIRECT + NINDIRECT) {
+			snprintf(name, sizeof name, "fill.%u", nfiles++);
+			f = diradd(dir, FTYPE_REG, name);
+			ind = NULL;
+			nb = 0;
+		}
+		if (nb >= NDIRECT && ind == NULL) {
+			ind = (uint32_t *) (diskmap + b * BLKSIZE);
+			f->f_indirect = b;
+			continue;
+		}
+		if (nb < NDIRECT)
+			f->f_direct[nb] = b;
+		else
+			ind[nb - NDIRECT] = b;
+		f->f_size = ++nb * BLKSIZE;
+	}
+	fillend = blockof(diskpos);
+}
+
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS files...\n");
+	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS [-f FILLBLOCKS] files...\n");
 	exit(2);
 }
 
 int
 main(int argc, char **argv)
 {
-	int i;
+	int i, first = 3;
+	uint32_t nfill = 0;
 	char *s;
 	struct Dir root;
 
@@ -228,14 +298,23 @@ main(int argc, char **argv)
 		usage();
 
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 1024)
+	if (*s || s == argv[2] || nblocks < 2 || nblocks > BLKBITSIZE)
 		usage();
 
+	if (argc >= 5 && strcmp(argv[3], "-f") == 0) {
+		nfill = strtol(argv[4], &s, 0);
+		if (*s || s == argv[4])
+			usage();
+		first = 5;
+	}
+
 	opendisk(argv[1]);
 
 	startdir(&super->s_root, &root);
-	for (i = 3; i < argc; i++)
+	for (i = first; i < argc; i++)
 		writefile(&root, argv[i]);
+	if (nfill > 0)
+		fillfiles(&root, nfill);
 	finishdir(&root);
 
 	finishdisk();
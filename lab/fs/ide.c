@@ -1,5 +1,7 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * Minimal PIO-based IDE driver code.  ide_read and ide_write poll;
+ * requests queued with ide_submit are driven by IRQ 14 instead, so the
+ * file server can go on serving cached blocks while the disk works.
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  */
@@ -10,10 +12,23 @@
 #define IDE_BSY		0x80
 #define IDE_DRDY	0x40
 #define IDE_DF		0x20
+#define IDE_DRQ		0x08
 #define IDE_ERR		0x01
 
+#define IDE_NIEN	0x02	// Device control: don't interrupt
+
 static int diskno = 1;
 
+// The file server's workers share the drive: ide_lock covers it and
+// everything below.
+static struct mutex ide_lock;
+
+// Requests queued by ide_submit, oldest first.  The drive works on
+// ide_head once ide_started is set.
+static struct IdeReq *ide_head, *ide_tail;
+static bool ide_started;
+static bool ide_irq;		// Does the kernel forward IRQ_IDE to us?
+
 static int
 ide_wait_ready(bool check_error)
 {
@@ -60,6 +75,28 @@ ide_set_disk(int d)
 }
 
 
+// Ask the drive for an interrupt after each sector, or not.  Polled
+// commands turn them off so they don't wake the serve loop for nothing.
+static void
+ide_set_intr(bool on)
+{
+	if (ide_irq)
+		outb(0x3F6, on ? 0 : IDE_NIEN);
+}
+
+static void ide_poll_queue(void);
+
+static void
+ide_command(uint32_t secno, size_t nsecs, int cmd)
+{
+	outb(0x1F2, nsecs);	// 0 means 256
+	outb(0x1F3, secno & 0xFF);
+	outb(0x1F4, (secno >> 8) & 0xFF);
+	outb(0x1F5, (secno >> 16) & 0xFF);
+	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
+	outb(0x1F7, cmd);
+}
+
 int
 ide_read(uint32_t secno, void *dst, size_t nsecs)
 {
@@ -67,22 +104,20 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 
 	assert(nsecs <= 256);
 
+	mutex_lock(&ide_lock);
+	ide_poll_queue();
 	ide_wait_ready(0);
+	ide_set_intr(0);
+	ide_command(secno, nsecs, 0x20);	// CMD 0x20 means read sector
 
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x20);	// CMD 0x20 means read sector
-
-	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
+	for (r = 0; nsecs > 0; nsecs--, dst += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
-			return r;
+			break;
 		insl(0x1F0, dst, SECTSIZE/4);
 	}
+	mutex_unlock(&ide_lock);
 
-	return 0;
+	return r;
 }
 
 int
@@ -92,21 +127,159 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 
 	assert(nsecs <= 256);
 
+	mutex_lock(&ide_lock);
+	ide_poll_queue();
 	ide_wait_ready(0);
+	ide_set_intr(0);
+	ide_command(secno, nsecs, 0x30);	// CMD 0x30 means write sector
 
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x30);	// CMD 0x30 means write sector
-
-	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
+	for (r = 0; nsecs > 0; nsecs--, src += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
-			return r;
+			break;
 		outsl(0x1F0, src, SECTSIZE/4);
 	}
+	mutex_unlock(&ide_lock);
 
-	return 0;
+	return r;
+}
+
+// Have the kernel forward IRQ_IDE to us as the notification IDE_NOTIFY,
+// which the serve loop hands to ide_intr.  Without it, ide_submit just
+// does the request on the spot.
+void
+ide_init_intr(void)
+{
+	int r;
+
+	if ((r = sys_irq_notify(IRQ_IDE, IDE_NOTIFY)) < 0) {
+		cprintf("IDE interrupts unavailable: %e\n", r);
+		return;
+	}
+	ide_irq = 1;
+	ide_set_intr(0);
 }
 
+static void ide_complete(int r);
+
+// Issue the command for ide_head.
+static void
+ide_start(void)
+{
+	struct IdeReq *req = ide_head;
+
+	ide_wait_ready(0);
+	ide_set_intr(1);
+	ide_command(req->ir_secno, req->ir_nsecs, req->ir_write ? 0x30 : 0x20);
+	ide_started = 1;
+	req->ir_ndone = 0;
+	if (req->ir_write) {
+		// The drive asks for the first sector without interrupting.
+		if (ide_wait_ready(1) < 0) {
+			ide_complete(-1);
+			return;
+		}
+		outsl(0x1F0, req->ir_buf, SECTSIZE/4);
+		req->ir_ndone = 1;
+	}
+}
+
+// Retire ide_head with result r and start the next request.
+static void
+ide_complete(int r)
+{
+	struct IdeReq *req = ide_head;
+
+	if (!(ide_head = req->ir_next))
+		ide_tail = NULL;
+	ide_started = 0;
+	req->ir_result = r;
+	req->ir_done = 1;
+	if (ide_head)
+		ide_start();
+}
+
+// Move ide_head along by a sector if the drive is ready for that.  The
+// drive's state, not the number of interrupts seen, says what to do, so
+// a stale notification (for a sector ide_drain already polled) is
+// harmless.
+static void
+ide_step(void)
+{
+	struct IdeReq *req = ide_head;
+	int r;
+
+	if (!req || !ide_started)
+		return;
+	r = inb(0x1F7);		// Also acknowledges the drive's interrupt
+	if (r & IDE_BSY)
+		return;
+	if (r & (IDE_DF|IDE_ERR)) {
+		ide_complete(-1);
+		return;
+	}
+	if (!req->ir_write) {
+		if (!(r & IDE_DRQ))
+			return;
+		insl(0x1F0, req->ir_buf + req->ir_ndone * SECTSIZE, SECTSIZE/4);
+		if (++req->ir_ndone == req->ir_nsecs)
+			ide_complete(0);
+	} else if ((r & IDE_DRQ) && req->ir_ndone < req->ir_nsecs) {
+		outsl(0x1F0, req->ir_buf + req->ir_ndone * SECTSIZE, SECTSIZE/4);
+		req->ir_ndone++;
+	} else if (!(r & IDE_DRQ) && req->ir_ndone == req->ir_nsecs)
+		ide_complete(0);
+}
+
+// Queue req.  req->ir_done is set, and req->ir_result holds 0 or -1,
+// once the transfer is over; until then the caller must leave req and
+// its buffer alone.
+void
+ide_submit(struct IdeReq *req)
+{
+	assert(req->ir_nsecs > 0 && req->ir_nsecs <= 256);
+
+	req->ir_done = 0;
+	req->ir_next = NULL;
+	if (!ide_irq) {
+		req->ir_result = req->ir_write
+			? ide_write(req->ir_secno, req->ir_buf, req->ir_nsecs)
+			: ide_read(req->ir_secno, req->ir_buf, req->ir_nsecs);
+		req->ir_done = 1;
+		return;
+	}
+	mutex_lock(&ide_lock);
+	if (ide_tail)
+		ide_tail->ir_next = req;
+	else
+		ide_head = req;
+	ide_tail = req;
+	if (!ide_started)
+		ide_start();
+	mutex_unlock(&ide_lock);
+}
+
+// Called on an IDE_NOTIFY notification.
+void
+ide_intr(void)
+{
+	mutex_lock(&ide_lock);
+	ide_step();
+	mutex_unlock(&ide_lock);
+}
+
+// Finish every queued request, polling.  The polled commands need the
+// drive to themselves.
+static void
+ide_poll_queue(void)
+{
+	while (ide_head)
+		ide_step();
+}
+
+void
+ide_drain(void)
+{
+	mutex_lock(&ide_lock);
+	ide_poll_queue();
+	mutex_unlock(&ide_lock);
+}
@@ -28,14 +28,24 @@
 //    communicate with the server.  File IDs are a lot like
 //    environment IDs in the kernel.  Use openfile_lookup to translate
 //    file IDs to struct OpenFile.
+//
+// The server runs as FS_NWORKERS environments that share all three
+// (see serve_start_workers).  o_lock serializes the requests on one
+// open file, which share its seek position; file_lock serializes the
+// operations on one file, however many times it is open.
 
 struct OpenFile {
 	uint32_t o_fileid;	// file id
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	struct mutex o_lock;	// Held across a read or write
+	bool o_opening;		// Being opened: not free, though unshared yet
 };
 
+// Number of environments running the serve loop
+#define FS_NWORKERS	4
+
 // Max number of open files in the file system at once
 #define MAXOPEN		1024
 #define FILEVA		0xD0000000
@@ -44,9 +54,23 @@ struct OpenFile {
 struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
+static struct mutex opentab_lock;	// Held while allocating an entry
+
+// Virtual address at which to receive page mappings containing client
+// requests.  The pages after it receive the buffer a client lends us
+// for a big read or write; fsreq_npages is how many pages came with
+// the current request.  Each worker has its own request window.
+#define FSREQ_NPAGES	(2 + FSIPC_MAXIO / PGSIZE)
+union Fsipc *fsreq = (union Fsipc *)0x0fc00000;
+static uint32_t fsreq_npages THREAD_LOCAL;
 
-// Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// The entry this worker's current open request allocated, if any
+static struct OpenFile *opening THREAD_LOCAL;
+
+// Where serve_readmap maps the blocks it sends to a client.  They stay
+// mapped after the reply, until the worker's next FSREQ_READMAP.
+#define FSLENDVA	0x0f400000	// FSIPC_MAXIO / BLKSIZE pages
+static struct IpcVec lendvec THREAD_LOCAL;
 
 void
 serve_init(void)
@@ -66,21 +90,33 @@ openfile_alloc(struct OpenFile **o)
 {
 	int i, r;
 
+	mutex_lock(&opentab_lock);
 	// Find an available open-file table entry
 	for (i = 0; i < MAXOPEN; i++) {
+		if (opentab[i].o_opening)
+			continue;
 		switch (pageref(opentab[i].o_fd)) {
 		case 0:
 			if ((r = sys_page_alloc(0, opentab[i].o_fd, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
+				goto out;
 			/* fall through */
 		case 1:
 			opentab[i].o_fileid += MAXOPEN;
 			*o = &opentab[i];
 			memset(opentab[i].o_fd, 0, PGSIZE);
-			return (*o)->o_fileid;
+			// Until the client has the Fd page, the entry would look
+			// free to the other workers.  serve() clears this once
+			// the reply is sent.
+			opentab[i].o_opening = 1;
+			opening = &opentab[i];
+			r = (*o)->o_fileid;
+			goto out;
 		}
 	}
-	return -E_MAX_OPEN;
+	r = -E_MAX_OPEN;
+out:
+	mutex_unlock(&opentab_lock);
+	return r;
 }
 
 // Look up an open file for envid.
@@ -144,7 +180,10 @@ try_open:
 
 	// Truncate
 	if (req->req_omode & O_TRUNC) {
-		if ((r = file_set_size(f, 0)) < 0) {
+		file_lock(f);
+		r = file_set_size(f, 0);
+		file_unlock(f);
+		if (r < 0) {
 			if (debug)
 				cprintf("file_set_size failed: %e", r);
 			return r;
@@ -197,18 +236,36 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 
 	// Second, call the relevant file system function (from fs/fs.c).
 	// On failure, return the error code to the client.
-	return file_set_size(o->o_file, req->req_size);
+	file_lock(o->o_file);
+	r = file_set_size(o->o_file, req->req_size);
+	file_unlock(o->o_file);
+	return r;
+}
+
+// Return where the buffer lent along with the current request starts,
+// if it holds at least n bytes from offset bufoff into its first page;
+// otherwise return NULL.
+static char *
+fsreq_buf(size_t bufoff, size_t n)
+{
+	if (bufoff >= PGSIZE || n > FSIPC_MAXIO
+	    || 1 + ROUNDUP(bufoff + n, PGSIZE) / PGSIZE > fsreq_npages)
+		return NULL;
+	return (char *) fsreq + PGSIZE + bufoff;
 }
 
 // Read at most ipc->read.req_n bytes from the current seek position
 // in ipc->read.req_fileid.  Return the bytes read from the file to
-// the caller in ipc->readRet, then update the seek position.  Returns
-// the number of bytes successfully read, or < 0 on error.
+// the caller in ipc->readRet, or in the buffer it lent us if it sent
+// one, then update the seek position.  Returns the number of bytes
+// successfully read, or < 0 on error.
 int
 serve_read(envid_t envid, union Fsipc *ipc)
 {
 	struct Fsreq_read *req = &ipc->read;
 	struct Fsret_read *ret = &ipc->readRet;
+	void *buf = ret;
+	size_t n = MIN(req->req_n, PGSIZE);
 
 	if (debug)
 		cprintf("serve_read %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
@@ -218,18 +275,61 @@ serve_read(envid_t envid, union Fsipc *ipc)
     int r;
     if ((r=openfile_lookup(envid, req->req_fileid, &o)) < 0)
         return r;
-    r = file_read(o->o_file, (void*)ret, req->req_n, o->o_fd->fd_offset); // 每个Fd对象有自己的offset。
+    if (fsreq_npages > 1) {
+        n = req->req_n;
+        if ((buf = fsreq_buf(req->req_bufoff, n)) == NULL)
+            return -E_INVAL;
+    }
+    mutex_lock(&o->o_lock);
+    file_lock(o->o_file);
+    r = file_read(o->o_file, buf, n, o->o_fd->fd_offset); // 每个Fd对象有自己的offset。
+    file_unlock(o->o_file);
     if (r > 0) {
         o->o_fd->fd_offset += r; // 更新该Fd对象的offset。
     }
+    mutex_unlock(&o->o_lock);
 	return r; // 返回读取的字节数。
 }
 
+// FSREQ_READMAP: read from req_offset like serve_read, but reply with
+// the block cache's own pages holding the file (see file_lend), mapped
+// copy-on-write into the client, rather than copying the data.  Sets
+// *pg_store and *perm_store to the vector to send.  Returns the number
+// of bytes of the file sent, or < 0 on error.
+int
+serve_readmap(envid_t envid, struct Fsreq_readmap *req, void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	int r;
 
-// Write req->req_n bytes from req->req_buf to req_fileid, starting at
-// the current seek position, and update the seek position
-// accordingly.  Extend the file if necessary.  Returns the number of
-// bytes written, or < 0 on error.
+	if (debug)
+		cprintf("serve_readmap %08x %08x %08x %08x\n", envid, req->req_fileid,
+			req->req_n, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_offset < 0 || req->req_offset % BLKSIZE != 0)
+		return -E_INVAL;
+	file_lock(o->o_file);
+	r = file_lend(o->o_file, req->req_offset, MIN(req->req_n, FSIPC_MAXIO),
+		      (void *) FSLENDVA);
+	file_unlock(o->o_file);
+	if (r > 0) {
+		lendvec.iv_nsegs = 1;
+		lendvec.iv_segs[0].seg_va = (void *) FSLENDVA;
+		lendvec.iv_segs[0].seg_npages = ROUNDUP(r, PGSIZE) / PGSIZE;
+		*pg_store = &lendvec;
+		*perm_store = PTE_P | PTE_U | PTE_COW | IPC_VEC;
+	}
+	return r;
+}
+
+
+// Write req->req_n bytes from req->req_buf (or from the buffer the
+// client lent us, if it sent one) to req_fileid, starting at the
+// current seek position, and update the seek position accordingly.
+// Extend the file if necessary.  Returns the number of bytes written,
+// or < 0 on error.
 int
 serve_write(envid_t envid, struct Fsreq_write *req)
 {
@@ -239,12 +339,23 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 	// LAB 5: Your code here.
 	// panic("serve_write not implemented");
     struct OpenFile* o = NULL;
+    char *buf = req->req_buf;
     int r = openfile_lookup(envid, req->req_fileid, &o);
     if(r < 0)
         return r;
-    r = file_write(o->o_file, req->req_buf, req->req_n, o->o_fd->fd_offset);
+    if (fsreq_npages > 1)
+        buf = fsreq_buf(req->req_bufoff, req->req_n);
+    else if (req->req_n > sizeof(req->req_buf))
+        buf = NULL;
+    if (buf == NULL)
+        return -E_INVAL;
+    mutex_lock(&o->o_lock);
+    file_lock(o->o_file);
+    r = file_write(o->o_file, buf, req->req_n, o->o_fd->fd_offset);
+    file_unlock(o->o_file);
     if(r > 0)
         o->o_fd->fd_offset += r;
+    mutex_unlock(&o->o_lock);
     return r; // 返回写入的字节数。
 }
 
@@ -282,7 +393,9 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
+	file_lock(o->o_file);
 	file_flush(o->o_file);
+	file_unlock(o->o_file);
 	return 0;
 }
 
@@ -294,17 +407,164 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Return the file server's counters in ipc->statsRet.
+int
+serve_stats(envid_t envid, union Fsipc *ipc)
+{
+	if (debug)
+		cprintf("serve_stats %08x\n", envid);
+
+	ipc->statsRet = fsstats;
+	return 0;
+}
+
+// Rings registered with FSREQ_RING.  Ring i is mapped at
+// FSRINGVA + i*FSRING_NPAGES*PGSIZE.  We keep our own copies of the
+// indices we advance, since the client can scribble on the shared ones.
+#define FSRINGVA	0xE0000000
+
+struct RingSlot {
+	envid_t rs_owner;	// 0 if the slot is free
+	struct FsRing *rs_ring;
+	uint32_t rs_sq_head;
+	uint32_t rs_cq_tail;
+};
+
+static struct RingSlot rings[FSRING_MAX];
+
+// Register the struct FsRing the client sent as the request pages and
+// return its ring id.
+int
+serve_ring(envid_t envid, union Fsipc *req)
+{
+	struct RingSlot *rs;
+	const volatile struct Env *e;
+	int i, j, r;
+
+	if (debug)
+		cprintf("serve_ring %08x\n", envid);
+
+	if (fsreq_npages != FSRING_NPAGES)
+		return -E_INVAL;
+	for (i = 0; i < FSRING_MAX; i++) {
+		rs = &rings[i];
+		e = &envs[ENVX(rs->rs_owner)];
+		// 原来的客户端已经退出的槽位可以重用。
+		if (rs->rs_owner == 0 || e->env_id != rs->rs_owner
+		    || e->env_status == ENV_FREE)
+			break;
+	}
+	if (i == FSRING_MAX)
+		return -E_MAX_OPEN;
+
+	rs->rs_ring = (struct FsRing *) (FSRINGVA + i * FSRING_NPAGES * PGSIZE);
+	for (j = 0; j < FSRING_NPAGES; j++)
+		if ((r = sys_page_map(0, (char *) fsreq + j * PGSIZE,
+				      0, (char *) rs->rs_ring + j * PGSIZE,
+				      PTE_P | PTE_U | PTE_W)) < 0)
+			return r;
+	rs->rs_owner = envid;
+	rs->rs_sq_head = rs->rs_cq_tail = 0;
+	return i;
+}
+
+// Run the operation of a ring request on f, which the caller has
+// locked.
+static int
+serve_ring_op(struct File *f, struct FsSqe *sqe, char *data)
+{
+	switch (sqe->sqe_type) {
+	case FSREQ_READ:
+	case FSREQ_WRITE:
+		if (sqe->sqe_offset < 0 || sqe->sqe_dataoff > FSRING_DATASIZE
+		    || sqe->sqe_n > FSRING_DATASIZE - sqe->sqe_dataoff)
+			return -E_INVAL;
+		if (sqe->sqe_type == FSREQ_READ)
+			return file_read(f, data + sqe->sqe_dataoff,
+					 sqe->sqe_n, sqe->sqe_offset);
+		return file_write(f, data + sqe->sqe_dataoff,
+				  sqe->sqe_n, sqe->sqe_offset);
+	case FSREQ_SET_SIZE:
+		return file_set_size(f, sqe->sqe_offset);
+	case FSREQ_FLUSH:
+		file_flush(f);
+		return 0;
+	default:
+		return -E_INVAL;
+	}
+}
+
+// Run one request taken off a ring owned by envid.
+static int
+serve_ring_req(envid_t envid, struct FsSqe *sqe, char *data)
+{
+	struct OpenFile *o;
+	int r;
+
+	if ((r = openfile_lookup(envid, sqe->sqe_fileid, &o)) < 0)
+		return r;
+	file_lock(o->o_file);
+	r = serve_ring_op(o->o_file, sqe, data);
+	file_unlock(o->o_file);
+	return r;
+}
+
+// Run every request queued on a ring, post the completions together,
+// and notify the owner once for the whole batch.
+static void
+serve_ring_queue(struct RingSlot *rs)
+{
+	struct FsRing *ring = rs->rs_ring;
+	struct FsSqe sqe;
+	struct FsCqe *cqe;
+	uint32_t tail = ring->sq_tail;
+	int n = 0;
+
+	while (rs->rs_sq_head != tail) {
+		// A well-behaved client never overflows the completion
+		// queue; stop if this one did.
+		if (rs->rs_cq_tail - ring->cq_head >= FSRING_NENT)
+			break;
+		sqe = ring->sq[rs->rs_sq_head++ % FSRING_NENT];
+		cqe = &ring->cq[rs->rs_cq_tail++ % FSRING_NENT];
+		cqe->cqe_tag = sqe.sqe_tag;
+		cqe->cqe_result = serve_ring_req(rs->rs_owner, &sqe, FSRING_DATA(ring));
+		n++;
+	}
+	if (n == 0)
+		return;
+	// The completions must be visible before the new cq_tail.
+	__sync_synchronize();
+	ring->sq_head = rs->rs_sq_head;
+	ring->cq_tail = rs->rs_cq_tail;
+	if (sys_ipc_notify(rs->rs_owner, 1 << (rs - rings)) < 0)
+		rs->rs_owner = 0;	// The client is gone
+}
+
+// Serve the rings named by the bits of a notification.
+static void
+serve_rings(uint32_t bits)
+{
+	int i;
+
+	for (i = 0; i < FSRING_MAX; i++)
+		if ((bits & (1 << i)) && rings[i].rs_owner)
+			serve_ring_queue(&rings[i]);
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
-	// Open is handled specially because it passes pages
+	// Open and readmap are handled specially because they pass pages
 	/* [FSREQ_OPEN] =	(fshandler)serve_open, */
 	[FSREQ_READ] =		serve_read,
 	[FSREQ_STAT] =		serve_stat,
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_RING] =		serve_ring,
+	[FSREQ_STATS] =		serve_stats
 };
 
 void
@@ -314,31 +574,92 @@ serve(void)
 	int perm, r;
 	void *pg;
 
+	// Each reply is sent with ipc_reply_recv, which also waits for the
+	// next request (and switches straight back to the client if nobody
+	// else is waiting).  The next request's page replaces fsreq, so
+	// there is no need to unmap it in between.  A big read or write
+	// brings the client's buffer along in the window after fsreq.
+	if ((r = sys_ipc_set_rcvwin(FSREQ_NPAGES)) < 0)
+		panic("sys_ipc_set_rcvwin: %e", r);
+	perm = 0;
+	req = ipc_recv((int32_t *) &whom, fsreq, &perm);
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		fsreq_npages = thisenv->env_ipc_npages;
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
 
+		if (whom == 0) {
+			// A notification: the disk made progress, the timer
+			// ticked, or clients queued requests on rings.
+			if (req & IDE_NOTIFY) {
+				ide_intr();
+				bc_async_reap();
+			}
+			if (req & TIMER_NOTIFY)
+				bc_tick();
+			serve_rings(req);
+			perm = 0;
+			req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+			continue;
+		}
+
 		// All requests must contain an argument page
 		if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
-			continue; // just leave it hanging...
+			// just leave it hanging...
+			perm = 0;
+			req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+			continue;
 		}
 
 		pg = NULL;
 		if (req == FSREQ_OPEN) {
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+		} else if (req == FSREQ_READMAP) {
+			r = serve_readmap(whom, &fsreq->readmap, &pg, &perm);
 		} else if (req < ARRAY_SIZE(handlers) && handlers[req]) {
 			r = handlers[req](whom, fsreq);
 		} else {
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		req = ipc_reply_recv(whom, r, pg, perm,
+				     (envid_t *) &whom, fsreq, &perm);
+		// The client has the Fd page by now, if the open worked.
+		if (opening) {
+			opening->o_opening = 0;
+			opening = NULL;
+		}
+	}
+}
+
+// Start FS_NWORKERS - 1 more environments running serve(), so that a
+// client waiting for the disk doesn't hold up the ones whose blocks are
+// cached, and clients on different CPUs are served in parallel.  They
+// are sfork'd threads sharing our memory.  The block cache and the Fd
+// pages are in regions whose page tables are shared too, so a block one
+// worker reads in, or an Fd page it allocates, is there for all of them.
+//
+// Clients spread themselves over the workers (see lib/file.c).  The
+// disk's notifications come to us, the timer's to the worker that
+// turned the flusher on, and the rings' to the worker ipc_find_env
+// finds first, which thus serves all the rings.
+static void
+serve_start_workers(void)
+{
+	envid_t id;
+	int i, r;
+
+	bc_share(super->s_nblocks);
+	if ((r = sfork_share((void *) FILEVA, (void *) (FILEVA + MAXOPEN * PGSIZE))) < 0)
+		panic("sfork_share: %e", r);
+	for (i = 1; i < FS_NWORKERS; i++) {
+		if ((id = sfork()) < 0)
+			panic("sfork: %e", id);
+		if (id == 0)
+			return;	// Off to serve() with the others
 	}
 }
 
@@ -346,6 +667,7 @@ void
 umain(int argc, char **argv)
 {
 	static_assert(sizeof(struct File) == 256);
+	static_assert(FSRING_MAX <= 30);	// See TIMER_NOTIFY
 	binaryname = "fs";
 	cprintf("FS is running\n");
 
@@ -356,6 +678,7 @@ umain(int argc, char **argv)
 	serve_init();
 	fs_init();
         fs_test();
+	serve_start_workers();
 	serve();
 }
 
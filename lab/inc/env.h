@@ -44,9 +44,30 @@ enum EnvType {
 	ENV_TYPE_FS,		// File system server
 };
 
+// Vectored IPC.  Passing IPC_VEC in the perm argument of an IPC send
+// means srcva points to a struct IpcVec: the pages of its ranges are
+// mapped, in order, at consecutive pages of the receiver's window,
+// which starts at the receiver's dstva and is env_ipc_rcvwin pages
+// long (see sys_ipc_set_rcvwin).
+#define IPC_VEC		0x1000	// Flag in perm; not a PTE bit
+#define IPC_MAXSEGS	8	// Page ranges per message
+#define IPC_MAXPAGES	1024	// Pages per message and per window
+
+struct IpcSeg {
+	void *seg_va;		// Page-aligned start of the range
+	uint32_t seg_npages;	// Length of the range in pages
+};
+
+struct IpcVec {
+	uint32_t iv_nsegs;
+	struct IpcSeg iv_segs[IPC_MAXSEGS];
+};
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
+	struct Env *env_rq_next;	// Next env on a CPU's run queue
+	struct Env *env_rq_prev;	// Previous env on a CPU's run queue
 	envid_t env_id;			// Unique environment identifier
 	envid_t env_parent_id;		// env_id of this env's parent
 	enum EnvType env_type;		// Indicates special system environments
@@ -63,9 +84,26 @@ struct Env {
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
 	void *env_ipc_dstva;		// VA at which to map received page
+	uint32_t env_ipc_rcvwin;	// Pages we accept from dstva on
+	uint32_t env_ipc_npages;	// Number of pages received
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+
+	// Blocking IPC send (sys_ipc_send).  The queue links and
+	// env_ipc_waitingfor of a blocked sender are protected by the
+	// lock of the receiver it is waiting for.
+	struct Env *env_ipc_waithead;	// Senders blocked on us, in FIFO order
+	struct Env *env_ipc_waittail;
+	struct Env *env_ipc_waitnext;	// Next sender on the same queue
+	struct Env *env_ipc_waitingfor;	// Receiver we are blocked sending to
+	uint32_t env_ipc_send_value;	// The message we are sending
+	struct IpcSeg env_ipc_send_segs[IPC_MAXSEGS];
+	uint32_t env_ipc_send_nsegs;
+	int env_ipc_send_perm;
+	bool env_ipc_calling;		// In sys_ipc_call, until the reply
+	void *env_ipc_call_dstva;	// ...which is received at this VA
+	uint32_t env_ipc_notify;	// Pending sys_ipc_notify bits
 };
 
 #endif // !JOS_INC_ENV_H
@@ -23,8 +23,11 @@
 #define NDIRECT		10
 // Number of direct block pointers in an indirect block
 #define NINDIRECT	(BLKSIZE / 4)
+// Number of block pointers reached through the double-indirect block
+#define NDINDIRECT	(NINDIRECT * NINDIRECT)
 
-#define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+// The block pointers reach 4GB, but off_t stops short of 2GB
+#define MAXFILESIZE	0x7FFFF000
 
 // Unlike in most "real" file systems, for simplicity we will use this one File structure to represent file meta-data as it appears both on disk and in memory.
 struct File {
@@ -36,10 +39,14 @@ struct File {
 	// A block is allocated iff its value is != 0.
 	uint32_t f_direct[NDIRECT];	// direct blocks
 	uint32_t f_indirect;		// indirect block
+	uint32_t f_dindirect;		// double-indirect block
+
+	uint32_t f_flags;		// FILE_* flags; 0 on old disks
+	uint32_t f_nbuckets;		// Hashed directory: hash buckets
 
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 8 - 8];
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
@@ -49,6 +56,25 @@ struct File {
 #define FTYPE_REG	0	// Regular file
 #define FTYPE_DIR	1	// Directory
 
+// File flags
+#define FILE_HASHED	0x1	// Hashed directory
+
+// A hashed directory is the same array of struct File as a linear one,
+// but the entry for a name goes in block fs_name_hash(name) % f_nbuckets,
+// or if that block is full, the next one that isn't (wrapping around).
+// Entries that fit in none of the first f_nbuckets blocks go in the
+// blocks after them, which are searched linearly.  Entries are never
+// removed, so a lookup can stop at the first bucket with a free slot.
+static inline uint32_t
+fs_name_hash(const char *name)
+{
+	uint32_t h = 2166136261U;	// FNV-1a
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619U;
+	return h;
+}
+
 
 // File system super-block (both in-memory and on-disk)
 
@@ -64,16 +90,58 @@ struct Super {
 enum {
 	FSREQ_OPEN = 1,
 	FSREQ_SET_SIZE,
-	// Read returns a Fsret_read on the request page
+	// Read returns a Fsret_read on the request page, or reads
+	// straight into the caller's lent buffer (see below)
 	FSREQ_READ,
 	FSREQ_WRITE,
 	// Stat returns a Fsret_stat on the request page
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Register a struct FsRing (sent as the request pages); returns
+	// its ring id
+	FSREQ_RING,
+	// Stats returns a struct FsStats on the request page
+	FSREQ_STATS,
+	// Readmap replies with the block cache's own pages of the file,
+	// copy-on-write (see below)
+	FSREQ_READMAP
 };
 
+// File server counters, returned by FSREQ_STATS.
+struct FsStats {
+	uint32_t st_bc_hits;		// Block lookups that found it cached
+	uint32_t st_bc_misses;		// Blocks read in from disk
+	uint32_t st_bc_evictions;	// Blocks dropped to make room
+	uint32_t st_bc_writebacks;	// ...of which were dirty
+	uint32_t st_bc_cached;		// Evictable blocks cached now
+	uint32_t st_bc_max;		// ...and the most there can be
+	uint32_t st_bc_readahead;	// Blocks read in ahead of use
+	uint32_t st_bc_flushes;		// Write-back IDE commands...
+	uint32_t st_bc_flushed;		// ...and the blocks they wrote
+	uint32_t st_bc_lent;		// Blocks mapped into clients by FSREQ_READMAP
+	uint32_t st_bc_copied;		// Lent blocks copied when written to
+	uint32_t st_dc_hits;		// Path lookups answered by the cache...
+	uint32_t st_dc_negative;	// ...of which found no such file
+	uint32_t st_dc_misses;		// Path lookups that read the directory
+};
+
+// Reads and writes too big for the request page are sent as vectored
+// IPC (IPC_VEC): the request page, followed by the pages of the
+// client's own buffer, which the server reads from or writes into
+// directly.  req_bufoff is the buffer's offset in its first page.
+// At most FSIPC_MAXIO bytes move per request.
+//
+// FSREQ_READMAP reads without copying: the server replies with the
+// pages of its block cache that hold the file from req_offset on, which
+// must be block-aligned, and the client maps them over its
+// (page-aligned) buffer as its receive window.  The block the file ends
+// in is sent as a copy, zero past the end of the file.  The return value
+// is the number of bytes of the file sent, 0 at the end of the file.
+// Unlike FSREQ_READ, it leaves the seek position alone.
+#define FSIPC_MAXIO	(2*1024*1024)
+
 // 可以学习一下这个union的用法。
 union Fsipc {
 	struct Fsreq_open {
@@ -87,14 +155,21 @@ union Fsipc {
 	struct Fsreq_read {
 		int req_fileid;
 		size_t req_n;
+		size_t req_bufoff;
 	} read;
 	struct Fsret_read {
 		char ret_buf[PGSIZE];
 	} readRet;
+	struct Fsreq_readmap {
+		int req_fileid;
+		size_t req_n;
+		off_t req_offset;
+	} readmap;
 	struct Fsreq_write {
 		int req_fileid;
 		size_t req_n;
-		char req_buf[PGSIZE - (sizeof(int) + sizeof(size_t))];
+		size_t req_bufoff;
+		char req_buf[PGSIZE - (sizeof(int) + 2 * sizeof(size_t))];
 	} write;
 	struct Fsreq_stat {
 		int req_fileid;
@@ -110,9 +185,53 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct FsStats statsRet;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
 };
 
+// Asynchronous request rings.  A client shares a struct FsRing with the
+// file server (FSREQ_RING), queues requests on it, and tells the server
+// about them with sys_ipc_notify(fsenv, 1 << ring id).  The server runs
+// every queued request, posts the results on the completion queue, and
+// notifies the client back.  Reads and writes use explicit file offsets
+// and move their data through the ring's data area, the FSRING_NPAGES-1
+// pages after the ring header.
+//
+// Only FSREQ_READ, FSREQ_WRITE, FSREQ_SET_SIZE and FSREQ_FLUSH can be
+// queued.  The client may have at most FSRING_NENT requests in flight,
+// counting completions it has not consumed yet.
+#define FSRING_NENT	64
+#define FSRING_NPAGES	17
+#define FSRING_MAX	30	// Rings the server can have at once (its
+				// timer and disk use notification bits 30, 31)
+#define FSRING_DATA(ring)	((char *) (ring) + PGSIZE)
+#define FSRING_DATASIZE		((FSRING_NPAGES - 1) * PGSIZE)
+
+struct FsSqe {
+	uint32_t sqe_type;	// FSREQ_*
+	int sqe_fileid;
+	off_t sqe_offset;	// File offset, or new size for FSREQ_SET_SIZE
+	uint32_t sqe_n;		// Bytes to read or write...
+	uint32_t sqe_dataoff;	// ...at this offset in the data area
+	uint32_t sqe_tag;	// Returned in the completion
+};
+
+struct FsCqe {
+	uint32_t cqe_tag;
+	int32_t cqe_result;	// What the synchronous request would return
+};
+
+struct FsRing {
+	volatile uint32_t sq_head;	// Next request the server takes
+	volatile uint32_t sq_tail;	// End of the requests submitted
+	volatile uint32_t cq_head;	// Next completion the client takes
+	volatile uint32_t cq_tail;	// End of the completions posted
+	uint32_t sq_prepared;		// Client only: end of requests filled in
+	int r_id;			// Client only: id the server gave us
+	struct FsSqe sq[FSRING_NENT];
+	struct FsCqe cq[FSRING_NENT];
+};
+
 #endif /* !JOS_INC_FS_H */
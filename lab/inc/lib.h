@@ -23,6 +23,10 @@
 
 #define USED(x)		(void)(x)
 
+// Put a variable on the per-thread page, which sfork() does not share.
+// The variable must be initialized or zero-initialized data.
+#define THREAD_LOCAL	__attribute__((section(".thread")))
+
 // main user program
 void	umain(int argc, char **argv);
 
@@ -37,6 +41,7 @@ void	exit(void);
 
 // pgfault.c
 void	set_pgfault_handler(void (*handler)(struct UTrapframe *utf));
+int	add_pgfault_handler(int (*handler)(struct UTrapframe *utf));
 
 // readline.c
 char*	readline(const char *buf);
@@ -51,12 +56,23 @@ static envid_t sys_exofork(void);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
+int	sys_env_set_type(envid_t env, int type);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_clear(envid_t env, void *pg, int bits);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		     void *rcv_pg);
+int	sys_ipc_reply_recv(envid_t to_env, uint32_t value, void *pg, int perm,
+			   void *rcv_pg);
+int	sys_ipc_set_rcvwin(uint32_t npages);
+int	sys_ipc_notify(envid_t to_env, uint32_t bits);
+int	sys_irq_notify(uint32_t irq, uint32_t bits);
+int	sys_vm_copy(envid_t dst_env, void *start, void *end, int mode);
 
 // This must be inlined.  Exercise for reader: why?
 static inline envid_t __attribute__((always_inline))
@@ -72,12 +88,26 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_recv(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
+int	sfork_share(void *start, void *end);
+void	set_cow_handler(void);
+
+// mutex.c
+struct mutex {
+	volatile uint32_t locked;
+};
+void	mutex_init(struct mutex *m);
+void	mutex_lock(struct mutex *m);
+int	mutex_trylock(struct mutex *m);
+void	mutex_unlock(struct mutex *m);
 
 // fd.c
 int	close(int fd);
@@ -95,8 +125,21 @@ int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	fs_stats(struct FsStats *st);
+int	file_readmap(int fdnum, off_t offset, void *dstva, size_t n);
+
+// fsring.c
+int	fsring_init(struct FsRing *ring);
+struct FsSqe *fsring_get_sqe(struct FsRing *ring);
+int	fsring_prep(struct FsSqe *sqe, uint32_t type, int fdnum, off_t offset,
+		    uint32_t dataoff, size_t n, uint32_t tag);
+void	fsring_submit(struct FsRing *ring);
+struct FsCqe *fsring_peek_cqe(struct FsRing *ring);
+struct FsCqe *fsring_wait_cqe(struct FsRing *ring);
+void	fsring_cqe_seen(struct FsRing *ring);
 
 // pageref.c
+pte_t	get_pte(const void *va);
 int	pageref(void *addr);
 
 
@@ -110,6 +153,10 @@ int	getchar(void);
 int	iscons(int fd);
 int	opencons(void);
 
+// mmap.c
+int	mmap(int fdnum, off_t offset, size_t len, int prot, void **addr_store);
+int	munmap(void *addr, size_t len);
+
 // pipe.c
 int	pipe(int pipefds[2]);
 int	pipeisclosed(int pipefd);
@@ -128,4 +175,8 @@ void	wait(envid_t env);
 #define	O_EXCL		0x0400		/* error if already exists */
 #define O_MKDIR		0x0800		/* create directory, not regular file */
 
+/* mmap protections */
+#define	PROT_READ	0x1		/* pages can be read */
+#define	PROT_WRITE	0x2		/* pages can be written, privately */
+
 #endif	// !JOS_INC_LIB_H
@@ -178,6 +178,8 @@ extern volatile pde_t uvpd[];     // VA of current page directory
 struct PageInfo {
 	// Next page on the free list.
 	struct PageInfo *pp_link;
+	// Previous page on the free list (buddy allocator only).
+	struct PageInfo *pp_prev;
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -185,7 +187,14 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	uint8_t pp_order;	// Size (log2 pages) of the free block it heads
+	uint8_t pp_flags;	// PP_*
 };
 
+#define PP_FREE		0x1	// Free, in a CPU's cache or the buddy lists
+#define PP_BUDDY	0x2	// Heads a free block on the buddy lists
+#define PP_LARGE	0x4	// Heads a 4MB page (page_alloc_large)
+
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
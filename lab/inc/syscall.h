@@ -17,7 +17,27 @@ enum {
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_vm_copy,
+	SYS_ipc_send,
+	SYS_ipc_call,
+	SYS_ipc_reply_recv,
+	SYS_ipc_set_rcvwin,
+	SYS_ipc_notify,
+	SYS_irq_notify,
+	SYS_env_set_type,
+	SYS_page_clear,
 	NSYSCALLS
 };
 
+/* sys_vm_copy modes */
+enum {
+	VM_COPY_COW = 0,	// fork: copy-on-write private writable pages,
+				// share read-only and PTE_SHARE pages
+	VM_COPY_SHARED,		// spawn: share only PTE_SHARE pages
+	VM_COPY_SHARE_ALL,	// sfork: share every page, first giving the
+				// caller a private writable copy of COW pages
+	VM_COPY_SHARE_PT,	// sfork_share: share the page tables themselves,
+				// so later mappings are seen by both
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
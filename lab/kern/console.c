@@ -9,10 +9,15 @@
 #include <kern/console.h>
 #include <kern/trap.h>
 #include <kern/picirq.h>
+#include <kern/spinlock.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
 
+// Protects the device registers and the input buffer, which are shared
+// by every CPU now that there is no big kernel lock.
+static struct spinlock cons_lock = { .name = "cons_lock" };
+
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
 delay(void)
@@ -60,8 +65,10 @@ serial_proc_data(void)
 void
 serial_intr(void)
 {
+	spin_lock(&cons_lock);
 	if (serial_exists)
 		cons_intr(serial_proc_data);
+	spin_unlock(&cons_lock);
 }
 
 static void
@@ -372,7 +379,9 @@ kbd_proc_data(void)
 void
 kbd_intr(void)
 {
+	spin_lock(&cons_lock);
 	cons_intr(kbd_proc_data);
+	spin_unlock(&cons_lock);
 }
 
 static void
@@ -420,29 +429,35 @@ cons_getc(void)
 {
 	int c;
 
+	spin_lock(&cons_lock);
+
 	// poll for any pending input characters,
 	// so that this function works even when interrupts are disabled
 	// (e.g., when called from the kernel monitor).
-	serial_intr();
-	kbd_intr();
+	if (serial_exists)
+		cons_intr(serial_proc_data);
+	cons_intr(kbd_proc_data);
 
 	// grab the next character from the input buffer.
+	c = 0;
 	if (cons.rpos != cons.wpos) {
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+	spin_unlock(&cons_lock);
+	return c;
 }
 
 // output a character to the console
 static void
 cons_putc(int c)
 {
+	spin_lock(&cons_lock);
 	serial_putc(c);
 	lpt_putc(c);
 	cga_putc(c);
+	spin_unlock(&cons_lock);
 }
 
 // initialize the console devices
@@ -10,6 +10,9 @@
 // Maximum number of CPUs
 #define NCPU  8
 
+// Free pages each CPU keeps for page_alloc and page_free
+#define PCACHE_MAX  64
+
 // Values of status in struct Cpu
 enum {
 	CPU_UNUSED = 0,
@@ -23,6 +26,14 @@ struct CpuInfo {
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	volatile bool cpu_tlb_flush;    // Asked to flush its TLB (tlb_shootdown)
+	bool cpu_tlb_pending;           // Changed a shared page table
+	struct PageInfo *cpu_tlb_deferred; // Pages to free after the shootdown
+	struct PageInfo *cpu_pcache[PCACHE_MAX]; // Free pages (page_alloc)
+	int cpu_npcache;                // Pages in cpu_pcache
+	uint64_t cpu_zero_hit;          // ALLOC_ZERO served from the zeroed pool
+	uint64_t cpu_zero_miss;         // ALLOC_ZERO that had to memset
+	uint64_t cpu_zero_fill;         // Pages zeroed while idle
 };
 
 // Initialized in mpconfig.c
@@ -18,6 +18,11 @@
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list，静态变量，默认初始化为0，即NULL
 					// (linked by Env->env_link)
+static struct spinlock env_free_lock = { .name = "env_free_lock" };	// Protects env_free_list
+// Per-environment locks, protecting each environment's address space
+// and IPC state.  Scheduling state is protected by the run queue locks
+// in kern/sched.c instead.
+static struct spinlock env_locks[NENV];
 
 #define ENVGENSHIFT	12		// >= LOGNENV
 
@@ -125,6 +130,7 @@ env_init(void)
         // 因为ENV_FREE的值为0，且在pmap.c:mem_init中，分配envs数组时，已经将整个数组的Env memset为0了，所以这里不必再初始化。
         envs[i].env_link = env_free_list;
         env_free_list = &envs[i];
+        __spin_initlock(&env_locks[i], "env_lock");
     }
 
 	// Per-CPU part of the initialization
@@ -133,6 +139,42 @@ env_init(void)
 	env_init_percpu(); // 因为每一个CPU都有一个自己的寄存器GDTR，所以每个CPU都要这样初始化一次。
 }
 
+//
+// Lock e's address space and IPC state.
+//
+void
+env_lock(struct Env *e)
+{
+	spin_lock(&env_locks[e - envs]);
+}
+
+void
+env_unlock(struct Env *e)
+{
+	spin_unlock(&env_locks[e - envs]);
+}
+
+// Lock two environments (which may be the same one) in address order,
+// so two CPUs locking the same pair can't deadlock.
+void
+env_lock_pair(struct Env *a, struct Env *b)
+{
+	if (a == b) {
+		env_lock(a);
+		return;
+	}
+	env_lock(a < b ? a : b);
+	env_lock(a < b ? b : a);
+}
+
+void
+env_unlock_pair(struct Env *a, struct Env *b)
+{
+	env_unlock(a);
+	if (b != a)
+		env_unlock(b);
+}
+
 // Load GDT and segment descriptors.
 void
 env_init_percpu(void)
@@ -195,7 +237,7 @@ env_setup_vm(struct Env *e)
     // **注意进入保护模式后，程序无法绕过地址翻译硬件直接用物理地址访存。**
     e->env_pgdir = page2kva(p);
     memcpy(e->env_pgdir, kern_pgdir, PGSIZE);
-    p->pp_ref++;
+    page_incref(p);
 
 	// UVPT maps the env's own page table read-only.
 	// Permissions: kernel R, user R
@@ -219,12 +261,22 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
+	spin_lock(&env_free_lock);
+	if (!(e = env_free_list)) {
+		spin_unlock(&env_free_lock);
 		return -E_NO_FREE_ENV;
+	}
+	env_free_list = e->env_link;
+	spin_unlock(&env_free_lock);
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e)) < 0) {
+		spin_lock(&env_free_lock);
+		e->env_link = env_free_list;
+		env_free_list = e;
+		spin_unlock(&env_free_lock);
 		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -235,8 +287,13 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
+	// Spread new environments over the CPUs' run queues;
+	// sched_yield() steals work from busy CPUs anyway.
+	e->env_cpunum = (e - envs) % ncpu;
+	// The caller makes it runnable with sched_wakeup() once it is
+	// fully set up.
+	e->env_status = ENV_NOT_RUNNABLE;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -266,11 +323,15 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
 
-	// Also clear the IPC receiving flag.
+	// Also clear the IPC receiving flag and the blocked-sender state.
 	e->env_ipc_recving = 0;
+	e->env_ipc_waithead = e->env_ipc_waittail = NULL;
+	e->env_ipc_waitingfor = NULL;
+	e->env_ipc_calling = 0;
+	e->env_ipc_rcvwin = 1;
+	e->env_ipc_notify = 0;
 
 	// commit the allocation
-	env_free_list = e->env_link;
 	*newenv_store = e;
 
 	// cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -432,6 +493,54 @@ env_create(uint8_t *binary, enum EnvType type)
     if (type == ENV_TYPE_FS) {
         e->env_tf.tf_eflags |= FL_IOPL_3;
     }
+    sched_wakeup(e);
+}
+
+//
+// If e is blocked in sys_ipc_send, take it off its receiver's queue.
+//
+static void
+ipc_cancel_send(struct Env *e)
+{
+	struct Env *rcv, *s, *prev;
+
+	// env_ipc_waitingfor is protected by the receiver's lock, which
+	// we can only take in address order along with e's.
+	while ((rcv = e->env_ipc_waitingfor) != NULL) {
+		env_lock_pair(e, rcv);
+		if (e->env_ipc_waitingfor == rcv) {
+			prev = NULL;
+			for (s = rcv->env_ipc_waithead; s != e; s = s->env_ipc_waitnext)
+				prev = s;
+			if (prev)
+				prev->env_ipc_waitnext = e->env_ipc_waitnext;
+			else
+				rcv->env_ipc_waithead = e->env_ipc_waitnext;
+			if (rcv->env_ipc_waittail == e)
+				rcv->env_ipc_waittail = prev;
+			e->env_ipc_waitingfor = NULL;
+		}
+		env_unlock_pair(e, rcv);
+	}
+}
+
+//
+// Fail the sends of everybody blocked sending to e with -E_BAD_ENV.
+// Called with e locked.
+//
+static void
+ipc_fail_senders(struct Env *e)
+{
+	struct Env *s;
+
+	while ((s = e->env_ipc_waithead) != NULL) {
+		e->env_ipc_waithead = s->env_ipc_waitnext;
+		s->env_ipc_waitingfor = NULL;
+		s->env_ipc_calling = 0;
+		s->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+		sched_wakeup(s);
+	}
+	e->env_ipc_waittail = NULL;
 }
 
 //
@@ -440,15 +549,19 @@ env_create(uint8_t *binary, enum EnvType type)
 void
 env_free(struct Env *e)
 {
-	pte_t *pt;
-	uint32_t pdeno, pteno;
+	uint32_t pdeno;
 	physaddr_t pa;
 
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
-	// gets reused.
-	if (e == curenv)
+	// gets reused.  Also drop this CPU's claim on it now, before
+	// e can be reallocated.
+	if (e == curenv) {
 		lcr3(PADDR(kern_pgdir));
+		curenv = NULL;
+	}
+	ipc_cancel_send(e);
+	env_lock(e);
 
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -461,20 +574,19 @@ env_free(struct Env *e)
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
-		// find the pa and va of the page table
+		// free the page table, and the pages it maps, unless another
+		// environment shares it (VM_COPY_SHARE_PT) and still uses them.
+		// No CPU has e's page directory loaded any more, so there are
+		// no TLB entries to invalidate.
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
-		pt = (pte_t*) KADDR(pa);
-
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
-                // 调用之前实现的用于映射的基础设施。
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
+		if (e->env_pgdir[pdeno] & PTE_PS) {
+			// A 4MB page, no page table.
+			e->env_pgdir[pdeno] = 0;
+			page_decref(pa2page(pa));
+			continue;
 		}
-
-		// free the page table itself
 		e->env_pgdir[pdeno] = 0;
-		page_decref(pa2page(pa));
+		pgtable_decref(pa2page(pa));
 	}
 
 	// free the page directory
@@ -483,9 +595,16 @@ env_free(struct Env *e)
 	page_decref(pa2page(pa));
 
 	// return the environment to the free list
+	// Senders that are still waiting for e will never be received.
+	// Nobody can queue up after this, since they check for ENV_FREE
+	// under e's lock.
+	ipc_fail_senders(e);
 	e->env_status = ENV_FREE;
+	env_unlock(e);
+	spin_lock(&env_free_lock);
 	e->env_link = env_free_list;
 	env_free_list = e;
+	spin_unlock(&env_free_lock);
 }
 
 //
@@ -496,20 +615,18 @@ env_free(struct Env *e)
 void
 env_destroy(struct Env *e)
 {
-	// If e is currently running on other CPUs, we change its state to
-	// ENV_DYING. A zombie environment will be freed the next time
-	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+	bool self = (e == curenv);
+
+	// If e is currently running on other CPUs, sched_kill changes its
+	// state to ENV_DYING. A zombie environment will be freed the next
+	// time it traps to the kernel or its CPU switches away from it.
+	if (!sched_kill(e))
 		return;
-	}
 
 	env_free(e);
 
-	if (curenv == e) {
-		curenv = NULL;
+	if (self)
 		sched_yield();
-	}
 }
 
 
@@ -522,9 +639,6 @@ env_destroy(struct Env *e)
 void
 env_pop_tf(struct Trapframe *tf)
 {
-	// Record the CPU we are running on for user-space debugging
-	curenv->env_cpunum = cpunum();
-
 	asm volatile(
 		"\tmovl %0,%%esp\n" // 让%esp指向参数tf指向的Trapframe，iret指令最后恢复%ss和%esp。
 		"\tpopal\n"
@@ -563,22 +677,24 @@ env_run(struct Env *e)
 	//	e->env_tf to sensible values.
 
 	// LAB 3: Your code here.
-    if (curenv != NULL) {
-        if (curenv->env_status == ENV_RUNNING)
-            curenv->env_status = ENV_RUNNABLE;
-            // 这里好像没有保存旧进程的寄存器状态？
-            // 不需要保存，除了运行第一个用户进程是由内核调用env_run之外，
-            // 其它对env_run的调用在sched_yield中，调用sched_yield的进程通过中断（系统调用/时钟中断）
-            // 进入的内核态，会在内核栈中创建一个Trapframe并拷贝到进程对应的Env的Trapframe成员中，
-            // 从而调用sched_yield的进程已经保存好了它自己的寄存器状态在其对应的Env结构体的
-            // Trapframe成员中了。
+    // sched_yield已经把e标记为ENV_RUNNING，并把env_cpunum设为本CPU。
+    // Switch to e's address space before releasing the old environment:
+    // once released, another CPU may pick it up, or free it.
+    if (curenv != e) {
+        // The kernel's mappings are global (see pmap_init_percpu), so
+        // this only flushes the user part of the TLB.
+        lcr3(PADDR(e->env_pgdir));
+        // 这里好像没有保存旧进程的寄存器状态？
+        // 不需要保存，除了运行第一个用户进程是由内核调用env_run之外，
+        // 其它对env_run的调用在sched_yield中，调用sched_yield的进程通过中断（系统调用/时钟中断）
+        // 进入的内核态，会在内核栈中创建一个Trapframe并拷贝到进程对应的Env的Trapframe成员中，
+        // 从而调用sched_yield的进程已经保存好了它自己的寄存器状态在其对应的Env结构体的
+        // Trapframe成员中了。
+        sched_release();
+        curenv = e;
     }
-    curenv = e;
-    curenv->env_status = ENV_RUNNING;
     curenv->env_runs++;
-    lcr3(PADDR(curenv->env_pgdir));
 
-    unlock_kernel();
     env_pop_tf(&curenv->env_tf);
 
 	panic("env_run not yet implemented");
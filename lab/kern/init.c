@@ -17,6 +17,11 @@
 
 static void boot_aps(void);
 
+// Set once the initial environments exist; APs wait for it before
+// entering the scheduler, so they don't find nothing to run and drop
+// into the monitor.
+static volatile uint32_t aps_go;
+
 
 void
 i386_init(void)
@@ -32,6 +37,7 @@ i386_init(void)
 
 	// Lab 3 user environment initialization functions
 	env_init();
+	sched_init();
 	trap_init();
 
 	// Lab 4 multiprocessor initialization functions
@@ -41,10 +47,6 @@ i386_init(void)
 	// Lab 4 multitasking initialization functions
 	pic_init();
 
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-    lock_kernel();
-
 	// Starting non-boot CPUs
 	boot_aps();
 
@@ -62,6 +64,9 @@ i386_init(void)
 	// Should not be necessary - drains keyboard because interrupt has given up.
 	kbd_intr();
 
+	// Let the APs into the scheduler now that there is something to run.
+	xchg(&aps_go, 1);
+
 	// Schedule and run the first user environment!
 	sched_yield();
 }
@@ -104,6 +109,7 @@ void
 mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
+	pmap_init_percpu();
 	lcr3(PADDR(kern_pgdir));
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
@@ -113,11 +119,11 @@ mp_main(void)
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
-    lock_kernel();
+	// to start running processes on this CPU.  The scheduler is safe
+	// to enter from several CPUs at once, but wait until the BSP has
+	// created the initial environments.
+	while (!aps_go)
+		asm volatile("pause");
 	sched_yield();
 
 	// Remove this after you finish Exercise 6
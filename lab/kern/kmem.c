@@ -0,0 +1,492 @@
+// Kernel object caches: a slab allocator on top of page_alloc.
+//
+// A kmem_cache hands out objects of one size.  It carves them out of
+// slabs, single pages that start with a struct kmem_slab and then hold
+// kc_perslab objects.  Free objects are kept constructed: the
+// constructor runs once per object when its slab is allocated, and
+// kmem_cache_free takes the object back as is, so the caller must
+// return it in the state the constructor leaves it in.  That is why the
+// slab tracks its free objects in an index array in the header, instead
+// of threading a list through the objects themselves.
+//
+// Page-sized caches (kc_size == PGSIZE, e.g. the page table cache in
+// pmap.c) have no slab header; their free pages are kept on kc_pages,
+// linked through pp_link, up to KMEM_PAGE_RESERVE of them.
+//
+// In front of the slabs each CPU has a magazine of up to KMEM_MAG free
+// objects per cache.  The kernel isn't preemptible, so a CPU uses its
+// own magazine without locking, and takes kc_lock only to move
+// KMEM_BATCH objects at a time between the magazine and the slabs.
+//
+// kmalloc/kfree serve small allocations from power-of-two caches.
+
+#include <inc/assert.h>
+#include <inc/string.h>
+
+#include <kern/pmap.h>
+#include <kern/kmem.h>
+
+#define KMEM_BATCH		(KMEM_MAG / 2)
+#define KMEM_PAGE_RESERVE	64	// Free pages a page-sized cache keeps
+
+struct kmem_slab {
+	struct kmem_cache *ks_cache;
+	struct kmem_slab *ks_next;	// On kc_partial or kc_full
+	struct kmem_slab *ks_prev;
+	uint16_t ks_nfree;
+	uint16_t ks_freeidx[];		// Indices of the free objects
+};
+
+#define KMALLOC_MIN	16
+#define KMALLOC_NCACHES	8		// KMALLOC_MIN .. KMALLOC_MAX
+
+static struct kmem_cache cache_cache;	// Where kmem_cache_create gets caches
+static struct kmem_cache *kmalloc_caches[KMALLOC_NCACHES];
+static const char *kmalloc_names[KMALLOC_NCACHES] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+
+static struct kmem_cache *kmem_list;	// All caches, for kmemstat
+static struct spinlock kmem_lock = { .name = "kmem_lock" };	// Protects kmem_list
+
+static void
+slab_insert(struct kmem_slab **head, struct kmem_slab *s)
+{
+	s->ks_prev = NULL;
+	s->ks_next = *head;
+	if (s->ks_next)
+		s->ks_next->ks_prev = s;
+	*head = s;
+}
+
+static void
+slab_remove(struct kmem_slab **head, struct kmem_slab *s)
+{
+	if (s->ks_prev)
+		s->ks_prev->ks_next = s->ks_next;
+	else
+		*head = s->ks_next;
+	if (s->ks_next)
+		s->ks_next->ks_prev = s->ks_prev;
+}
+
+static void *
+slab_obj(struct kmem_cache *c, struct kmem_slab *s, unsigned i)
+{
+	return (char *) s + c->kc_offset + i * c->kc_size;
+}
+
+static void
+kmem_cache_setup(struct kmem_cache *c, const char *name, size_t size,
+		 size_t align, void (*ctor)(void *))
+{
+	unsigned n;
+
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	assert(align <= PGSIZE && (align & (align - 1)) == 0);
+	size = ROUNDUP(size, align);
+	if (size > KMALLOC_MAX && size != PGSIZE)
+		panic("kmem_cache_create %s: can't cache %u-byte objects", name, size);
+
+	memset(c, 0, sizeof(*c));
+	c->kc_name = name;
+	c->kc_size = size;
+	c->kc_align = align;
+	c->kc_ctor = ctor;
+	__spin_initlock(&c->kc_lock, (char *) name);
+	if (size == PGSIZE)
+		c->kc_perslab = 1;
+	else {
+		n = (PGSIZE - sizeof(struct kmem_slab)) / (size + sizeof(uint16_t));
+		while (ROUNDUP(sizeof(struct kmem_slab) + n * sizeof(uint16_t), align)
+		       + n * size > PGSIZE)
+			n--;
+		c->kc_perslab = n;
+		c->kc_offset = ROUNDUP(sizeof(struct kmem_slab) + n * sizeof(uint16_t), align);
+	}
+
+	spin_lock(&kmem_lock);
+	c->kc_link = kmem_list;
+	kmem_list = c;
+	spin_unlock(&kmem_lock);
+}
+
+// Add a slab to c, constructing its objects.
+// Returns false if out of memory.  Called with c->kc_lock held.
+static bool
+kmem_grow(struct kmem_cache *c)
+{
+	struct PageInfo *pp;
+	struct kmem_slab *s;
+	unsigned i;
+
+	if ((pp = page_alloc(0)) == NULL)
+		return false;
+	if (c->kc_size == PGSIZE) {
+		if (c->kc_ctor)
+			c->kc_ctor(page2kva(pp));
+		pp->pp_link = c->kc_pages;
+		c->kc_pages = pp;
+		c->kc_npages++;
+	} else {
+		s = page2kva(pp);
+		s->ks_cache = c;
+		s->ks_nfree = c->kc_perslab;
+		for (i = 0; i < c->kc_perslab; i++) {
+			// Hand out the lowest addresses first.
+			s->ks_freeidx[i] = c->kc_perslab - 1 - i;
+			if (c->kc_ctor)
+				c->kc_ctor(slab_obj(c, s, i));
+		}
+		slab_insert(&c->kc_partial, s);
+		c->kc_nempty++;
+		c->kc_nslabfree += c->kc_perslab;
+	}
+	c->kc_nslabs++;
+	c->kc_ngrow++;
+	return true;
+}
+
+// Take a free object out of the slabs, growing the cache if need be.
+// Returns NULL if out of memory.  Called with c->kc_lock held.
+static void *
+kmem_take(struct kmem_cache *c)
+{
+	struct PageInfo *pp;
+	struct kmem_slab *s;
+	unsigned i;
+
+	if (c->kc_size == PGSIZE) {
+		if (!c->kc_pages && !kmem_grow(c))
+			return NULL;
+		pp = c->kc_pages;
+		c->kc_pages = pp->pp_link;
+		c->kc_npages--;
+		pp->pp_link = NULL;
+		return page2kva(pp);
+	}
+
+	if (!c->kc_partial && !kmem_grow(c))
+		return NULL;
+	s = c->kc_partial;
+	if (s->ks_nfree == c->kc_perslab)
+		c->kc_nempty--;
+	i = s->ks_freeidx[--s->ks_nfree];
+	c->kc_nslabfree--;
+	if (s->ks_nfree == 0) {
+		slab_remove(&c->kc_partial, s);
+		slab_insert(&c->kc_full, s);
+	}
+	return slab_obj(c, s, i);
+}
+
+// Put a free object back into its slab.  A slab whose objects are all
+// free goes back to page_free, unless it's the only such slab.
+// Called with c->kc_lock held.
+static void
+kmem_put(struct kmem_cache *c, void *obj)
+{
+	struct PageInfo *pp;
+	struct kmem_slab *s;
+	size_t off;
+
+	if (c->kc_size == PGSIZE) {
+		pp = pa2page(PADDR(obj));
+		if (c->kc_npages < KMEM_PAGE_RESERVE) {
+			pp->pp_link = c->kc_pages;
+			c->kc_pages = pp;
+			c->kc_npages++;
+		} else {
+			page_free(pp);
+			c->kc_nslabs--;
+			c->kc_nshrink++;
+		}
+		return;
+	}
+
+	s = ROUNDDOWN(obj, PGSIZE);
+	off = (char *) obj - (char *) s - c->kc_offset;
+	if (s->ks_cache != c || off % c->kc_size != 0 || off / c->kc_size >= c->kc_perslab)
+		panic("kmem_cache_free %s: bad object %08x", c->kc_name, obj);
+	if (s->ks_nfree == 0) {
+		slab_remove(&c->kc_full, s);
+		slab_insert(&c->kc_partial, s);
+	}
+	s->ks_freeidx[s->ks_nfree++] = off / c->kc_size;
+	c->kc_nslabfree++;
+	if (s->ks_nfree < c->kc_perslab)
+		return;
+	if (c->kc_nempty == 0) {
+		c->kc_nempty++;
+		return;
+	}
+	slab_remove(&c->kc_partial, s);
+	c->kc_nslabfree -= c->kc_perslab;
+	c->kc_nslabs--;
+	c->kc_nshrink++;
+	page_free(pa2page(PADDR(s)));
+}
+
+//
+// Create a cache of objects of 'size' bytes, aligned to 'align' bytes
+// (at least pointer alignment).  If ctor isn't NULL, it is called on
+// every object before its first allocation, and objects must be freed
+// in the state it leaves them in.  size must be at most KMALLOC_MAX,
+// or exactly PGSIZE.  'name' must stay around; it is shown by kmemstat
+// and lockstat.
+//
+// Returns NULL if out of memory.
+//
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *))
+{
+	struct kmem_cache *c;
+
+	if ((c = kmem_cache_alloc(&cache_cache)) == NULL)
+		return NULL;
+	kmem_cache_setup(c, name, size, align, ctor);
+	return c;
+}
+
+//
+// Allocate an object from c.  It comes constructed, not zeroed.
+// Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+	struct kmem_magazine *m = &c->kc_cpu[cpunum()];
+	void *obj;
+
+	// 本CPU的弹匣空了，才加锁从slab里批量取。
+	if (m->km_n == 0) {
+		spin_lock(&c->kc_lock);
+		while (m->km_n < KMEM_BATCH && (obj = kmem_take(c)) != NULL)
+			m->km_objs[m->km_n++] = obj;
+		spin_unlock(&c->kc_lock);
+		if (m->km_n == 0)
+			return NULL;
+	}
+	m->km_nalloc++;
+	return m->km_objs[--m->km_n];
+}
+
+//
+// Return an object to the cache it came from, in its constructed state.
+//
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+	struct kmem_magazine *m = &c->kc_cpu[cpunum()];
+
+	if (m->km_n == KMEM_MAG) {
+		spin_lock(&c->kc_lock);
+		while (m->km_n > KMEM_BATCH)
+			kmem_put(c, m->km_objs[--m->km_n]);
+		spin_unlock(&c->kc_lock);
+	}
+	m->km_objs[m->km_n++] = obj;
+	m->km_nfree++;
+}
+
+//
+// Allocate 'size' bytes, for size up to KMALLOC_MAX.  The memory isn't
+// zeroed.  Returns NULL if out of memory or size is too big.
+//
+void *
+kmalloc(size_t size)
+{
+	int i;
+
+	if (size > KMALLOC_MAX)
+		return NULL;
+	for (i = 0; (KMALLOC_MIN << i) < size; i++)
+		;
+	return kmem_cache_alloc(kmalloc_caches[i]);
+}
+
+// Free memory returned by kmalloc.  kfree(NULL) does nothing.
+void
+kfree(void *obj)
+{
+	struct kmem_slab *s;
+
+	if (obj == NULL)
+		return;
+	s = ROUNDDOWN(obj, PGSIZE);
+	kmem_cache_free(s->ks_cache, obj);
+}
+
+// Set up the cache of caches and the kmalloc caches.  Called by
+// mem_init once page_alloc works.
+void
+kmem_init(void)
+{
+	int i;
+
+	static_assert(KMALLOC_MIN << (KMALLOC_NCACHES - 1) == KMALLOC_MAX);
+	kmem_cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), 0, NULL);
+	for (i = 0; i < KMALLOC_NCACHES; i++)
+		if ((kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i],
+							   KMALLOC_MIN << i, 0, NULL)) == NULL)
+			panic("kmem_init: out of memory");
+}
+
+// Print the usage of every cache.  The numbers are read without the
+// cache locks, so they're only a snapshot; this is for the monitor.
+void
+kmem_stat_print(void)
+{
+	struct kmem_cache *c;
+	uint64_t nalloc, nfree;
+	unsigned nobjs, nidle;
+	int i;
+
+	cprintf("%-14s %6s %6s %8s %8s %12s %12s %8s\n", "cache", "size",
+		"pages", "objects", "in use", "allocs", "frees", "grow");
+	for (c = kmem_list; c; c = c->kc_link) {
+		nalloc = nfree = 0;
+		nidle = c->kc_nslabfree + c->kc_npages;
+		for (i = 0; i < NCPU; i++) {
+			nalloc += c->kc_cpu[i].km_nalloc;
+			nfree += c->kc_cpu[i].km_nfree;
+			nidle += c->kc_cpu[i].km_n;
+		}
+		nobjs = c->kc_nslabs * c->kc_perslab;
+		cprintf("%-14s %6u %6u %8u %8u %12llu %12llu %8llu\n", c->kc_name,
+			c->kc_size, c->kc_nslabs, nobjs, nobjs - nidle,
+			nalloc, nfree, c->kc_ngrow);
+	}
+}
+
+// Checks for check_kmem.
+
+#define CHECK_MAGIC	0x6b6d656d
+
+struct check_obj {
+	uint32_t co_magic;
+	uint32_t co_data[15];
+};
+
+static unsigned check_nctor;
+
+static void
+check_ctor(void *obj)
+{
+	struct check_obj *o = obj;
+
+	o->co_magic = CHECK_MAGIC;
+	memset(o->co_data, 0, sizeof(o->co_data));
+	check_nctor++;
+}
+
+// Put this CPU's magazine for c back into the slabs, so that the slab
+// counts say where every free object is.
+static void
+check_drain(struct kmem_cache *c)
+{
+	struct kmem_magazine *m = &c->kc_cpu[cpunum()];
+
+	spin_lock(&c->kc_lock);
+	while (m->km_n > 0)
+		kmem_put(c, m->km_objs[--m->km_n]);
+	spin_unlock(&c->kc_lock);
+}
+
+// Is c down to the one empty slab it keeps?
+static bool
+check_one_empty_slab(struct kmem_cache *c)
+{
+	return c->kc_nslabs == 1 && c->kc_nempty == 1 && !c->kc_full
+		&& c->kc_partial && !c->kc_partial->ks_next
+		&& c->kc_partial->ks_nfree == c->kc_perslab
+		&& c->kc_nslabfree == c->kc_perslab;
+}
+
+//
+// Check the slab allocator: kmalloc and kfree in every size class, over
+// several slabs and back to one empty slab, and the constructed state
+// of a cache with a constructor.  Called by mem_init after kmem_init,
+// before anything else allocates from the caches.
+//
+void
+check_kmem(void)
+{
+	struct PageInfo *pp;
+	struct kmem_cache *c;
+	struct check_obj *o;
+	void **objs;
+	size_t size;
+	unsigned i, j, n, nctor;
+	char *p;
+
+	// Room for the objects we hold at once.
+	assert((pp = page_alloc(ALLOC_ZERO)));
+	objs = page2kva(pp);
+
+	for (i = 0; i < KMALLOC_NCACHES; i++) {
+		c = kmalloc_caches[i];
+		size = KMALLOC_MIN << i;
+		assert(c->kc_size == size && c->kc_nslabs == 0);
+		n = 3 * c->kc_perslab + 1;
+		assert(n <= PGSIZE / sizeof(void *));
+		for (j = 0; j < n; j++) {
+			// Anything from just above the class below up to size
+			// comes from this class.
+			assert((objs[j] = kmalloc(j % 2 ? size : size / 2 + 1)));
+			assert((uintptr_t) objs[j] % sizeof(void *) == 0);
+			assert(((struct kmem_slab *) ROUNDDOWN(objs[j], PGSIZE))->ks_cache == c);
+			memset(objs[j], j, size);
+		}
+		assert(c->kc_nslabs >= 4);
+		// No two objects overlap.
+		for (j = 0; j < n; j++)
+			for (p = objs[j]; p < (char *) objs[j] + size; p++)
+				assert(*p == (char) j);
+		for (j = 0; j < n; j++)
+			kfree(objs[j]);
+		check_drain(c);
+		assert(check_one_empty_slab(c));
+	}
+	assert(kmalloc(KMALLOC_MAX + 1) == NULL);
+	kfree(NULL);
+
+	// Objects come constructed, the constructor runs once per object
+	// when its slab is allocated, and a freed object comes back as the
+	// caller left it.
+	check_nctor = 0;
+	assert((c = kmem_cache_create("check", sizeof(struct check_obj), 0, check_ctor)));
+	n = 2 * c->kc_perslab + 1;
+	for (j = 0; j < n; j++) {
+		assert((o = objs[j] = kmem_cache_alloc(c)));
+		assert(o->co_magic == CHECK_MAGIC && o->co_data[0] == 0);
+	}
+	assert(c->kc_nslabs >= 3 && check_nctor == c->kc_ngrow * c->kc_perslab);
+	for (j = 0; j < n; j++)
+		kmem_cache_free(c, objs[j]);
+	check_drain(c);
+	assert(check_one_empty_slab(c));
+	nctor = check_nctor;
+	for (j = 0; j < KMEM_BATCH; j++) {
+		assert((o = objs[j] = kmem_cache_alloc(c)));
+		assert(o->co_magic == CHECK_MAGIC && o->co_data[0] == 0);
+	}
+	assert(check_nctor == nctor && c->kc_nslabs == 1);
+	for (j = 0; j < KMEM_BATCH; j++)
+		kmem_cache_free(c, objs[j]);
+	check_drain(c);
+	assert(check_one_empty_slab(c));
+
+	// There is no kmem_cache_destroy; take the check cache apart by hand.
+	spin_lock(&kmem_lock);
+	assert(kmem_list == c);
+	kmem_list = c->kc_link;
+	spin_unlock(&kmem_lock);
+	page_free(pa2page(PADDR(c->kc_partial)));
+	kmem_cache_free(&cache_cache, c);
+
+	page_free(pp);
+	cprintf("check_kmem() succeeded!\n");
+}
@@ -0,0 +1,64 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KMEM_H
+#define JOS_KERN_KMEM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+// Objects each CPU keeps for a cache
+#define KMEM_MAG	16
+
+// Largest object kmalloc hands out
+#define KMALLOC_MAX	2048
+
+struct kmem_slab;
+
+// A CPU's magazine of free objects.  Only that CPU touches it, so it
+// needs no lock; the counters live here so they aren't shared either.
+struct kmem_magazine {
+	void *km_objs[KMEM_MAG];
+	int km_n;			// Objects in km_objs
+	uint64_t km_nalloc;		// kmem_cache_alloc calls served
+	uint64_t km_nfree;		// kmem_cache_free calls
+};
+
+// A cache of objects of one size, kept constructed while free.
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			// Object size, a multiple of kc_align
+	size_t kc_align;
+	void (*kc_ctor)(void *);	// Constructor, or NULL
+	unsigned kc_perslab;		// Objects per slab
+	size_t kc_offset;		// Offset of the first object in a slab
+
+	struct spinlock kc_lock;	// Protects the rest
+	struct kmem_slab *kc_partial;	// Slabs with free objects
+	struct kmem_slab *kc_full;	// Slabs without
+	unsigned kc_nempty;		// Slabs with all objects free
+	struct PageInfo *kc_pages;	// Free page-sized objects
+	unsigned kc_npages;		// Pages on kc_pages
+	unsigned kc_nslabs;		// Pages the cache holds
+	unsigned kc_nslabfree;		// Free objects in slabs
+	uint64_t kc_ngrow;		// Slabs allocated
+	uint64_t kc_nshrink;		// Slabs given back
+
+	struct kmem_cache *kc_link;	// Next cache on the kmemstat list
+	struct kmem_magazine kc_cpu[NCPU];
+};
+
+void	kmem_init(void);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+				     void (*ctor)(void *));
+void *	kmem_cache_alloc(struct kmem_cache *c);
+void	kmem_cache_free(struct kmem_cache *c, void *obj);
+void *	kmalloc(size_t size);
+void	kfree(void *obj);
+void	kmem_stat_print(void);
+void	check_kmem(void);
+
+#endif	// !JOS_KERN_KMEM_H
@@ -11,6 +11,9 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/spinlock.h>
+#include <kern/pmap.h>
+#include <kern/kmem.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -22,12 +25,15 @@ struct Command {
 	int (*func)(int argc, char** argv, struct Trapframe* tf);
 };
 
-static struct Command commands[5] = {
+static struct Command commands[8] = {
 	{ "help", "Display this list of commands", mon_help },
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
 	{ "backtrace", "Backtrace", mon_backtrace },
     { "continue", "Continue execute program", mon_continue },
     { "stepi", "Execute the next instruction", mon_stepi },
+    { "lockstat", "Display spinlock contention statistics ('lockstat reset' clears them)", mon_lockstat },
+    { "kmemstat", "Display kernel object cache usage", mon_kmemstat },
+    { "zerostat", "Display pre-zeroed page pool statistics", mon_zerostat },
 };
 
 /***** Implementations of basic kernel monitor commands *****/
@@ -110,6 +116,31 @@ int mon_stepi(int argc, char **argv, struct Trapframe *tf) {
     return -1;
 }
 
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+		spin_stat_reset();
+		return 0;
+	}
+	spin_stat_print();
+	return 0;
+}
+
+int
+mon_kmemstat(int argc, char **argv, struct Trapframe *tf)
+{
+	kmem_stat_print();
+	return 0;
+}
+
+int
+mon_zerostat(int argc, char **argv, struct Trapframe *tf)
+{
+	page_zero_stat_print();
+	return 0;
+}
+
 
 /***** Kernel monitor command interpreter *****/
 
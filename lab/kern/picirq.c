@@ -84,3 +84,12 @@ irq_setmask_8259A(uint16_t mask)
 	cprintf("\n");
 }
 
+// Acknowledge IRQ 'irq'.  The master runs in automatic EOI mode, but
+// the slave does not, so an IRQ from the slave blocks every lower
+// priority slave IRQ until it gets a non-specific EOI.
+void
+irq_eoi_8259A(int irq)
+{
+	if (irq >= 8)
+		outb(IO_PIC2, 0x20);
+}
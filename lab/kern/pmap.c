@@ -10,15 +10,29 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/kmem.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
 static size_t npages_basemem;	// Amount of base memory (in pages)（base memory也就是lab1内存图中的1MB内存中的640KB的low memory）
 
+// Feature flags in CPUID.1:EDX
+#define CPUID_PSE	(1 << 3)	// 4MB pages
+#define CPUID_PGE	(1 << 13)	// Global pages
+
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+static struct PageInfo *page_free_area[PAGE_MAXORDER + 1];	// Buddy free lists
+static size_t page_nfree_buddy;	// Pages on the buddy free lists
+static struct spinlock page_lock = { .name = "page_lock" };	// Protects the buddy lists
+static struct kmem_cache *pgtable_cache;	// Free page tables, zeroed
+static struct PageInfo *page_zero_list;	// Free pages zeroed by idle CPUs
+static size_t page_nzeroed;		// Pages on page_zero_list
+static struct spinlock page_zero_lock = { .name = "page_zero_lock" };	// Protects page_zero_list
+static bool pse_enabled;		// Does the CPU support 4MB pages?
+static bool pge_enabled;		// ...and global pages?
 
 
 // --------------------------------------------------------------
@@ -64,7 +78,10 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void mem_init_mp(void);
+static bool cpu_has(uint32_t feature);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static void page_init_high(void);
+static void pgtable_ctor(void *pt);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
 static void check_kern_pgdir(void);
@@ -83,7 +100,7 @@ static void check_page_installed_pgdir(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the page allocator has been set up.
 // Note that when this function is called, we are still using entry_pgdir,
 // which only maps the first 4MB of physical memory.
 static void *
@@ -193,9 +210,21 @@ mem_init(void)
 	check_page_alloc();
 	check_page();
 
+	// From here on page tables come from pgtable_cache.
+	kmem_init();
+	check_kmem();
+	if ((pgtable_cache = kmem_cache_create("pgtable", PGSIZE, PGSIZE,
+					       pgtable_ctor)) == NULL)
+		panic("mem_init: can't create the page table cache");
+
 	//////////////////////////////////////////////////////////////////////
 	// Now we set up virtual memory
 
+	// Map big aligned ranges with 4MB pages, and make the kernel's
+	// mappings global, if the CPU can.
+	pse_enabled = cpu_has(CPUID_PSE);
+	pge_enabled = cpu_has(CPUID_PGE);
+
 	//////////////////////////////////////////////////////////////////////
 	// Map 'pages' read-only by the user at linear address UPAGES
 	// Permissions:
@@ -247,14 +276,18 @@ mem_init(void)
 	check_kern_pgdir();
 
 	// Switch from the minimal entry page directory to the full kern_pgdir
-	// page table we just created.	Our instruction pointer should be
+	// page table we just created, which needs the CR4 flags it was
+	// built for.	Our instruction pointer should be
 	// somewhere between KERNBASE and KERNBASE+4MB right now, which is
 	// mapped the same way by both page tables.
 	//
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
+	pmap_init_percpu();
 	lcr3(PADDR(kern_pgdir));
 
+	// All of physical memory is mapped now.
+	page_init_high();
 	check_page_free_list(0);
 
 	// entry.S set the really important flags in cr0 (including enabling
@@ -268,6 +301,32 @@ mem_init(void)
 	check_page_installed_pgdir();
 }
 
+// Does this CPU have the CPUID.1:EDX feature?
+static bool
+cpu_has(uint32_t feature)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	return (edx & feature) != 0;
+}
+
+// Set up the paging features kern_pgdir relies on.  Every CPU calls
+// this before it loads kern_pgdir.
+//
+// With CR4.PGE, the TLB keeps the kernel's mappings (PTE_G, see
+// boot_map_region) when env_run switches address spaces; only an
+// invlpg of the address drops them.  That's safe because they are the
+// same in every address space and never change once mem_init is done.
+void
+pmap_init_percpu(void)
+{
+	if (pse_enabled)
+		lcr4(rcr4() | CR4_PSE);
+	if (pge_enabled)
+		lcr4(rcr4() | CR4_PGE);
+}
+
 // Modify mappings in kern_pgdir to support SMP
 //   - Map the per-CPU stacks in the region [KSTACKTOP-PTSIZE, KSTACKTOP)
 //
@@ -305,14 +364,170 @@ mem_init_mp(void)
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct PageInfo' entry per physical page.
-// Pages are reference counted, and free pages are kept on a linked list.
+// Pages are reference counted.
+//
+// Free memory is kept by a binary buddy allocator: page_free_area[o]
+// lists the free blocks of 2^o pages, each aligned to its size, linked
+// through the pp_link and pp_prev of their first page, which has
+// PP_BUDDY set and the order in pp_order.  A block is split in halves
+// to satisfy a smaller request, and a freed block is merged with its
+// buddy (the other half of the block of twice the size) for as long as
+// the buddy is free too.  page_lock protects the lists.
+//
+// Single pages, which is what nearly everything asks for, come from a
+// magazine of free pages each CPU keeps in front of the buddy allocator
+// (cpu_pcache).  The kernel isn't preemptible, so page_alloc and
+// page_free use the current CPU's magazine without any lock; only when
+// it runs empty or full do they move PCACHE_BATCH pages from or to the
+// buddy lists, under page_lock once for the whole batch.
 // --------------------------------------------------------------
 
+#define PCACHE_BATCH	(PCACHE_MAX / 2)
+
+// Idle CPUs zero free pages ahead of time (page_zero_idle), up to
+// PAGE_ZERO_MAX of them, so that page_alloc(ALLOC_ZERO) can usually
+// skip the memset.  They zero at most PAGE_ZERO_BATCH pages each time
+// they run out of work, and leave at least PAGE_ZERO_MAX pages on the
+// buddy lists.  page_alloc_order takes the pool back when it can't find
+// a block otherwise.
+#define PAGE_ZERO_MAX	512
+#define PAGE_ZERO_BATCH	32
+
+// Put the free block of 2^order pages at pp on its list.
+static void
+buddy_insert(struct PageInfo *pp, unsigned order)
+{
+	pp->pp_order = order;
+	pp->pp_flags = PP_FREE | PP_BUDDY;
+	pp->pp_prev = NULL;
+	pp->pp_link = page_free_area[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp;
+	page_free_area[order] = pp;
+}
+
+// Take the free block headed by pp off its list.
+static void
+buddy_remove(struct PageInfo *pp)
+{
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		page_free_area[pp->pp_order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	pp->pp_link = pp->pp_prev = NULL;
+	pp->pp_flags &= ~PP_BUDDY;
+}
+
+// Allocate a block of 2^order pages, splitting a bigger one if need
+// be.  Returns NULL if there is none.  Called with page_lock held.
+static struct PageInfo *
+buddy_alloc(unsigned order)
+{
+	struct PageInfo *pp;
+	unsigned o;
+
+	for (o = order; o <= PAGE_MAXORDER && !page_free_area[o]; o++)
+		;
+	if (o > PAGE_MAXORDER)
+		return NULL;
+	pp = page_free_area[o];
+	buddy_remove(pp);
+	// 大块拆成两半，后一半放回小一级的链表，直到大小合适。
+	while (o > order) {
+		o--;
+		buddy_insert(pp + (1 << o), o);
+	}
+	page_nfree_buddy -= 1 << order;
+	return pp;
+}
+
+// Free the block of 2^order pages at pp, merging it with its buddies.
+// Called with page_lock held.
+static void
+buddy_free(struct PageInfo *pp, unsigned order)
+{
+	size_t i = pp - pages, b;
+
+	for (b = 0; b < (1 << order); b++)
+		pp[b].pp_flags |= PP_FREE;
+	page_nfree_buddy += 1 << order;
+	for (; order < PAGE_MAXORDER; order++) {
+		b = i ^ (1 << order);
+		if (b >= npages || !(pages[b].pp_flags & PP_BUDDY)
+		    || pages[b].pp_order != order)
+			break;
+		buddy_remove(&pages[b]);
+		i &= ~(1 << order);
+	}
+	buddy_insert(&pages[i], order);
+}
+
+// Take a page off page_zero_list, if there is one.
+static struct PageInfo *
+page_zero_take(void)
+{
+	struct PageInfo *pp;
+
+	// Peek without the lock so an empty pool costs nothing.
+	if (!page_zero_list)
+		return NULL;
+	spin_lock(&page_zero_lock);
+	if ((pp = page_zero_list) != NULL) {
+		page_zero_list = pp->pp_link;
+		page_nzeroed--;
+	}
+	spin_unlock(&page_zero_lock);
+	if (pp)
+		pp->pp_link = NULL;
+	return pp;
+}
+
+// Give the buddy allocator back the pages of this CPU's magazine, so
+// that they can be merged into bigger blocks.
+static void
+pcache_drain(void)
+{
+	struct CpuInfo *c = thiscpu;
+
+	spin_lock(&page_lock);
+	while (c->cpu_npcache > 0)
+		buddy_free(c->cpu_pcache[--c->cpu_npcache], 0);
+	spin_unlock(&page_lock);
+}
+
+// Give the buddy allocator back the pre-zeroed pool, so that its pages
+// can be merged into bigger blocks again.
+static void
+page_zero_drain(void)
+{
+	struct PageInfo *pp, *next;
+
+	spin_lock(&page_zero_lock);
+	pp = page_zero_list;
+	page_zero_list = NULL;
+	page_nzeroed = 0;
+	spin_unlock(&page_zero_lock);
+	spin_lock(&page_lock);
+	for (; pp; pp = next) {
+		next = pp->pp_link;
+		pp->pp_link = NULL;
+		buddy_free(pp, 0);
+	}
+	spin_unlock(&page_lock);
+}
+
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory.
+//
+// Only the memory that entry_pgdir maps (the first 4MB) is freed here:
+// the page tables mem_init allocates before it switches to kern_pgdir
+// must be reachable through it.  page_init_high frees the rest after
+// the switch.
 //
 void
 page_init(void)
@@ -339,28 +554,33 @@ page_init(void)
 	// NB: DO NOT actually touch the physical memory corresponding to
 	// free pages!
 	size_t i;
+
+	spin_lock(&page_lock);
 	for (i = 1; i < npages_basemem; i++) {
-        if (i == MPENTRY_PADDR/PGSIZE)
-            continue;
-        pages[i].pp_ref = 0;
-        pages[i].pp_link = page_free_list; // page_free_list初值为NULL。
-        page_free_list = &pages[i];
+		if (i == MPENTRY_PADDR/PGSIZE)
+			continue;
+		buddy_free(&pages[i], 0);
 	}
-    // IO hole的page因为不会被分配，所以对应的PageInfo对象仍保持全0即可。
-    // EXTPHYSMEM是内核被加载的地方，也就是从EXTPHYSMEM到PADDR(end)这段物理内存也不会被分配。
-    // 但注意到boot_alloc在end后面分配多个page来存放内核数据结构（页目录、pages等），
-    // 所以可用的内存其实是boot_alloc(0)到PGSIZE*npages。
-    for (i = PGNUM(PADDR(boot_alloc(0))); i < npages; i++) {
-        pages[i].pp_ref = 0;
-        pages[i].pp_link = page_free_list;
-        page_free_list = &pages[i];
-    }
-    // 反转链表使得page_alloc函数从低内存地址处的page开始分配，尽量避免在
-    // 建立256MB映射前，分配的page的地址不超出4MB。也可以在上面组织page_free_list时就维护好使得page_free_list指向pages[0]。
-    // 当然如果不做这一步，mem_init中调用的check_page_free_list(1)也会帮我们做这一步。
-    //
-    // code: 反转链表
-    //
+	// IO hole的page因为不会被分配，所以对应的PageInfo对象仍保持全0即可。
+	// EXTPHYSMEM是内核被加载的地方，也就是从EXTPHYSMEM到PADDR(end)这段物理内存也不会被分配。
+	// 但注意到boot_alloc在end后面分配多个page来存放内核数据结构（页目录、pages等），
+	// 所以可用的内存其实是boot_alloc(0)到PGSIZE*npages。
+	for (i = PGNUM(PADDR(boot_alloc(0))); i < MIN(npages, NPTENTRIES); i++) {
+		buddy_free(&pages[i], 0);
+	}
+	spin_unlock(&page_lock);
+}
+
+// Free the memory above 4MB, once kern_pgdir maps it all.
+static void
+page_init_high(void)
+{
+	size_t i;
+
+	spin_lock(&page_lock);
+	for (i = MAX(NPTENTRIES, PGNUM(PADDR(boot_alloc(0)))); i < npages; i++)
+		buddy_free(&pages[i], 0);
+	spin_unlock(&page_lock);
 }
 
 //
@@ -379,13 +599,30 @@ struct PageInfo *
 page_alloc(int alloc_flags)
 {
 	// Fill this function in
-    if (page_free_list == NULL) {
-        return NULL; // out of memory
+    struct CpuInfo *c = thiscpu;
+    struct PageInfo *p;
+
+    // 先看有没有空闲CPU提前清零好的页。
+    if (alloc_flags & ALLOC_ZERO) {
+        if ((p = page_zero_take()) != NULL) {
+            c->cpu_zero_hit++;
+            return p;
+        }
+        c->cpu_zero_miss++;
+    }
+    // 本CPU的缓存空了，才去全局的伙伴系统批量取一次。
+    if (c->cpu_npcache == 0) {
+        spin_lock(&page_lock);
+        while (c->cpu_npcache < PCACHE_BATCH && (p = buddy_alloc(0)) != NULL)
+            c->cpu_pcache[c->cpu_npcache++] = p;
+        spin_unlock(&page_lock);
+        if (c->cpu_npcache == 0)
+            return page_zero_take(); // the last free pages may be zeroed ones
     }
-    // 总是删除头结点。
-    struct PageInfo *p = page_free_list;
-    page_free_list = page_free_list->pp_link;
+    p = c->cpu_pcache[--c->cpu_npcache];
     p->pp_link = NULL;
+    p->pp_flags = 0;
+    // Nobody else can reach the page yet.
     if (alloc_flags & ALLOC_ZERO) {
         // 注意，由于使用了page2kva来获取PgaeInfo对象对应物理页的内核虚拟地址来访问内存，
         // 所以调用该函数时，外部必须已经映射好了整个0~256MB物理内存到KERNBASE处，而不是还在用
@@ -405,12 +642,178 @@ page_free(struct PageInfo *pp)
 	// Fill this function in
 	// Hint: You may want to panic if pp->pp_ref is nonzero or
 	// pp->pp_link is not NULL.
-    if (pp->pp_ref != 0 || pp->pp_link != NULL) {
-        panic("page_free: pp->pp_ref != 0 || pp->pp_link != NULL\n");
+    struct CpuInfo *c = thiscpu;
+
+    if (pp->pp_ref != 0 || pp->pp_link != NULL || (pp->pp_flags & (PP_FREE|PP_LARGE))) {
+        panic("page_free: pp->pp_ref != 0 || pp->pp_link != NULL || already free or large\n");
+    }
+    // 缓存满了，把一半还给伙伴系统。
+    if (c->cpu_npcache == PCACHE_MAX) {
+        spin_lock(&page_lock);
+        while (c->cpu_npcache > PCACHE_BATCH)
+            buddy_free(c->cpu_pcache[--c->cpu_npcache], 0);
+        spin_unlock(&page_lock);
     }
-    // 总是插入头部。
-    pp->pp_link = page_free_list; // 注意，free list是不带头结点（哨兵结点）的链表。
-    page_free_list = pp;
+    pp->pp_flags = PP_FREE;
+    c->cpu_pcache[c->cpu_npcache++] = pp;
+}
+
+//
+// Allocate 2^order physically contiguous pages, aligned to their total
+// size, and return the first one's PageInfo (the others follow it in
+// 'pages').  If (alloc_flags & ALLOC_ZERO), the pages are zeroed.  As
+// for page_alloc, the reference counts are left alone.
+//
+// Returns NULL if there is no free block that big.
+//
+struct PageInfo *
+page_alloc_order(unsigned order, int alloc_flags)
+{
+	struct PageInfo *pp;
+	size_t i;
+
+	if (order > PAGE_MAXORDER)
+		return NULL;
+	spin_lock(&page_lock);
+	pp = buddy_alloc(order);
+	spin_unlock(&page_lock);
+	if (pp == NULL && (thiscpu->cpu_npcache > 0 || page_zero_list)) {
+		// The pages our magazine and the zeroed pool hold may
+		// complete a block.
+		pcache_drain();
+		page_zero_drain();
+		spin_lock(&page_lock);
+		pp = buddy_alloc(order);
+		spin_unlock(&page_lock);
+	}
+	if (pp == NULL)
+		return NULL;
+	for (i = 0; i < (1 << order); i++) {
+		pp[i].pp_link = NULL;
+		pp[i].pp_flags = 0;
+	}
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), 0, PGSIZE << order);
+	return pp;
+}
+
+//
+// Free a block allocated with page_alloc_order(order).  Every page in
+// it must have pp_ref 0.
+//
+void
+page_free_order(struct PageInfo *pp, unsigned order)
+{
+	size_t i;
+
+	assert(order <= PAGE_MAXORDER && (pp - pages) % (1 << order) == 0);
+	for (i = 0; i < (1 << order); i++)
+		if (pp[i].pp_ref != 0 || pp[i].pp_link != NULL || (pp[i].pp_flags & PP_FREE))
+			panic("page_free_order: page %d of the block is in use or free", i);
+	spin_lock(&page_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_lock);
+}
+
+//
+// Allocate a 4MB page, for mapping with PTE_PS: 2^PAGE_LARGE_ORDER
+// contiguous pages, 4MB-aligned.  The first page's PageInfo stands for
+// the whole of it; its pp_ref counts the mappings, and page_decref
+// frees the whole 4MB page with the last one.  ALLOC_ZERO zeroes it.
+// Returns NULL if out of memory.
+//
+struct PageInfo *
+page_alloc_large(int alloc_flags)
+{
+	struct PageInfo *pp;
+
+	static_assert(PAGE_LARGE_ORDER <= PAGE_MAXORDER);
+	if ((pp = page_alloc_order(PAGE_LARGE_ORDER, alloc_flags)) != NULL)
+		pp->pp_flags |= PP_LARGE;
+	return pp;
+}
+
+// Free a 4MB page from page_alloc_large that has no mappings left.
+void
+page_free_large(struct PageInfo *pp)
+{
+	assert(pp->pp_flags & PP_LARGE);
+	pp->pp_flags &= ~PP_LARGE;
+	page_free_order(pp, PAGE_LARGE_ORDER);
+}
+
+// Return the number of free pages, including those in the CPUs'
+// magazines and the zeroed ones.  Just an estimate while other CPUs
+// are allocating.
+size_t
+page_nfree(void)
+{
+	size_t n = page_nfree_buddy + page_nzeroed;
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		n += cpus[i].cpu_npcache;
+	return n;
+}
+
+//
+// Zero free pages for page_alloc(ALLOC_ZERO) while this CPU has
+// nothing else to do.  Called by sched_halt with no locks held.
+// Stops after PAGE_ZERO_BATCH pages, when the pool is full, or as soon
+// as stop() returns true.  Returns the number of pages zeroed.
+//
+int
+page_zero_idle(bool (*stop)(void))
+{
+	struct PageInfo *pp;
+	int n;
+
+	for (n = 0; n < PAGE_ZERO_BATCH && page_nzeroed < PAGE_ZERO_MAX
+		     && page_nfree_buddy > PAGE_ZERO_MAX && !stop(); n++) {
+		if ((pp = page_alloc(0)) == NULL)
+			break;
+		memset(page2kva(pp), 0, PGSIZE);
+		spin_lock(&page_zero_lock);
+		pp->pp_link = page_zero_list;
+		page_zero_list = pp;
+		page_nzeroed++;
+		spin_unlock(&page_zero_lock);
+		thiscpu->cpu_zero_fill++;
+	}
+	return n;
+}
+
+// Print how well the pre-zeroed pool serves page_alloc(ALLOC_ZERO).
+void
+page_zero_stat_print(void)
+{
+	uint64_t hit = 0, miss = 0, fill = 0;
+	int i;
+
+	for (i = 0; i < NCPU; i++) {
+		hit += cpus[i].cpu_zero_hit;
+		miss += cpus[i].cpu_zero_miss;
+		fill += cpus[i].cpu_zero_fill;
+	}
+	cprintf("free pages %u, zeroed %u\n", page_nfree(), page_nzeroed);
+	cprintf("ALLOC_ZERO: %llu from the zeroed pool, %llu zeroed inline (%llu%% hits)\n",
+		hit, miss, hit + miss ? hit * 100 / (hit + miss) : 0ULL);
+	cprintf("zeroed by idle CPUs: %llu\n", fill);
+}
+
+// Drop a reference to pp and return whether it was the last one.
+// The decrement is atomic since several CPUs may drop
+// references to the same shared page concurrently.
+static bool
+page_decref_test(struct PageInfo *pp)
+{
+	uint8_t zero;
+
+	asm volatile("lock; decw %0; sete %1"
+		     : "+m" (pp->pp_ref), "=q" (zero)
+		     :
+		     : "cc", "memory");
+	return zero;
 }
 
 //
@@ -420,10 +823,64 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	if (!page_decref_test(pp))
+		return;
+	if (pp->pp_flags & PP_LARGE)
+		page_free_large(pp);
+	else
 		page_free(pp);
 }
 
+//
+// Page tables are kept zeroed while they are free in pgtable_cache:
+// the constructor clears a page once, when the cache takes it from
+// page_alloc, and pgtable_decref clears a table's entries as it drops
+// the pages they map.  So pgdir_walk gets a clean table without a
+// memset of its own.
+//
+static void
+pgtable_ctor(void *pt)
+{
+	memset(pt, 0, PGSIZE);
+}
+
+// Allocate a zeroed page table.  Returns NULL if out of memory.
+static pte_t *
+pgtable_alloc(void)
+{
+	struct PageInfo *pp;
+
+	if (pgtable_cache)
+		return kmem_cache_alloc(pgtable_cache);
+	// check_page runs before kmem_init.
+	if ((pp = page_alloc(ALLOC_ZERO)) == NULL)
+		return NULL;
+	return page2kva(pp);
+}
+
+//
+// Drop a reference to the page table page pp.  The last reference
+// takes the pages the table maps with it.  A page table shared by
+// several environments (VM_COPY_SHARE_PT) holds their common mappings,
+// so those go only when the last of them lets go of it.
+//
+void
+pgtable_decref(struct PageInfo *pp)
+{
+	pte_t *pt = page2kva(pp);
+	uint32_t pteno;
+
+	if (!page_decref_test(pp))
+		return;
+	for (pteno = 0; pteno < NPTENTRIES; pteno++)
+		if (pt[pteno]) {
+			if (pt[pteno] & PTE_P)
+				page_decref(pa2page(PTE_ADDR(pt[pteno])));
+			pt[pteno] = 0;
+		}
+	kmem_cache_free(pgtable_cache, pt);
+}
+
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
 // a pointer to the page table entry (PTE) for linear address 'va'.
 // This requires walking the two-level page table structure.
@@ -436,6 +893,10 @@ page_decref(struct PageInfo* pp)
 //	the page is cleared,
 //	and pgdir_walk returns a pointer into the new page table page.
 //
+// If va is mapped by a 4MB page (PTE_PS), there is no page table:
+// pgdir_walk returns a pointer to the page directory entry, which maps
+// va itself.
+//
 // Hint 1: you can turn a PageInfo * into the physical address of the
 // page it refers to with page2pa() from kern/pmap.h.
 //
@@ -452,16 +913,16 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 	// Fill this function in
     pde_t *pde;
     pte_t *pgtab;
-    struct PageInfo *pgtab_page;
 
     pde = &pgdir[PDX(va)];
-    if(*pde & PTE_P){
+    if ((*pde & (PTE_P|PTE_PS)) == (PTE_P|PTE_PS)) {
+        return pde; // 4MB大页：页目录项本身就是va的“pte”。
+    } else if(*pde & PTE_P){
         pgtab = (pte_t*)KADDR(PTE_ADDR(*pde));
     } else {
-        if(!create || (pgtab_page=page_alloc(ALLOC_ZERO)) == NULL)
+        if(!create || (pgtab=pgtable_alloc()) == NULL)
             return NULL;
-        pgtab_page->pp_ref++;
-        pgtab = page2kva(pgtab_page);
+        page_incref(pa2page(PADDR(pgtab)));
         *pde = PADDR(pgtab) | PTE_P | PTE_W | PTE_U;
     }
     return &pgtab[PTX(va)];
@@ -475,7 +936,8 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 //
 // This function is only intended to set up the ``static'' mappings
 // above UTOP. As such, it should *not* change the pp_ref field on the
-// mapped pages.
+// mapped pages.  Being the same in every address space, they are made
+// global (PTE_G) if the CPU supports it.
 //
 // Hint: the TA solution uses pgdir_walk
 static void
@@ -484,7 +946,18 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 	// Fill this function in
     // 注意到该函数要求va和pa是PGSIZE对齐的，而且size是PGSIZE的整数倍，所以函数内就不必调整这些参数了。
     pte_t *pte;
+    if (pge_enabled)
+        perm |= PTE_G;
     while (size > 0) {
+        // 4MB对齐而且剩下的不少于4MB时，用一个4MB大页直接在页目录项里映射，不需要页表。
+        if (pse_enabled && va%PTSIZE == 0 && pa%PTSIZE == 0 && size >= PTSIZE) {
+            assert(!(pgdir[PDX(va)] & PTE_P));
+            pgdir[PDX(va)] = pa | perm | PTE_P | PTE_PS;
+            va += PTSIZE;
+            pa += PTSIZE;
+            size -= PTSIZE;
+            continue;
+        }
         assert((pte=pgdir_walk(pgdir, (void*)va, 1)) != NULL);
         *pte = pa | perm | PTE_P; // 因为pa是4KB对齐的，所以这里不需要先将其低12位清零。
         va += PGSIZE;
@@ -511,9 +984,14 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 // frequently leads to subtle bugs; there's an elegant way to handle
 // everything in one code path.
 //
+// With PTE_PS in perm, pp must come from page_alloc_large and va be
+// 4MB-aligned; the 4MB page is mapped by the page directory entry.
+//
 // RETURNS:
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
+//   -E_INVAL, if a 4MB page is in the way of a 4KB one, or the other
+//     way around, or va isn't 4MB-aligned for a 4MB page
 //
 // Hint: The TA solution is implemented using pgdir_walk, page_remove,
 // and page2pa.
@@ -523,11 +1001,19 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
 	// Fill this function in
     assert(pp->pp_link == NULL); // pp必须对应已分配的page。
-    pte_t *pte = pgdir_walk(pgdir, va, 1);
-    if (pte == NULL) {
+    pte_t *pte;
+    if (perm & PTE_PS) {
+        // A 4MB page is mapped by the page directory entry itself.
+        assert(pp->pp_flags & PP_LARGE);
+        pte = &pgdir[PDX(va)];
+        if ((uintptr_t)va%PTSIZE != 0 || (*pte & (PTE_P|PTE_PS)) == PTE_P)
+            return -E_INVAL;
+    } else if ((pgdir[PDX(va)] & PTE_PS)) {
+        return -E_INVAL;
+    } else if ((pte = pgdir_walk(pgdir, va, 1)) == NULL) {
         return -E_NO_MEM;
     }
-    pp->pp_ref++; // 注意要先自增引用，否则下面删除的时候，就可能把pp释放掉（如果va已经映射到pp对应的page的话），并入page_free_list中，然而*pp对应的page却正在被使用。
+    page_incref(pp); // 注意要先自增引用，否则下面删除的时候，就可能把pp释放掉（如果va已经映射到pp对应的page的话），放回空闲页中，然而*pp对应的page却正在被使用。
     if (*pte & PTE_P) {
         // If there is already a page mapped at 'va', it should be page_remove()d.
         page_remove(pgdir, va);
@@ -561,6 +1047,17 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 	return pa2page(PTE_ADDR(*pte));
 }
 
+//
+// Is the page table that maps user address va in pgdir shared with
+// another environment (see VM_COPY_SHARE_PT)?
+//
+static bool
+pgtable_shared(pde_t *pgdir, const void *va)
+{
+	return (uintptr_t) va < UTOP && (pgdir[PDX(va)] & (PTE_P|PTE_PS)) == PTE_P
+		&& pa2page(PTE_ADDR(pgdir[PDX(va)]))->pp_ref > 1;
+}
+
 //
 // Unmaps the physical page at virtual address 'va'.
 // If there is no physical page at that address, silently does nothing.
@@ -572,6 +1069,7 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 //     (if such a PTE exists)
 //   - The TLB must be invalidated if you remove an entry from
 //     the page table.
+//   - If va is in a 4MB page, the whole 4MB page is unmapped.
 //
 // Hint: The TA solution is implemented using page_lookup,
 // 	tlb_invalidate, and page_decref.
@@ -593,7 +1091,13 @@ page_remove(pde_t *pgdir, void *va)
         // 上面是有bug的代码，要知道，一个物理page被映射到一个进程的多个虚拟地址处，
         // 那么这些虚拟地址查表翻译时找到的是同一个pte吗？根据翻译过程，我们知道显然不是，
         // 只是这些不同的pte的PPN是一样的。
-        page_decref(p);
+        if (pgtable_shared(pgdir, va) && p->pp_ref == 1) {
+            // Another CPU may still reach p through its TLB until
+            // tlb_shootdown, so p can't be reused before that.
+            p->pp_link = thiscpu->cpu_tlb_deferred;
+            thiscpu->cpu_tlb_deferred = p;
+        } else
+            page_decref(p);
         *pte = 0; // 注意这一步无论--p->pp_ref是否为0，都要做。
         tlb_invalidate(pgdir, va);
     }
@@ -609,6 +1113,57 @@ tlb_invalidate(pde_t *pgdir, void *va)
 	// Flush the entry only if we're modifying the current address space.
 	if (!curenv || curenv->env_pgdir == pgdir)
 		invlpg(va);
+	// Environments sharing the page table may be running on other
+	// CPUs; they are told at the end of the trap (tlb_shootdown).
+	if (pgtable_shared(pgdir, va))
+		thiscpu->cpu_tlb_pending = true;
+}
+
+//
+// Make every other CPU flush its TLB, and wait until they all have.
+// Then free the pages whose last mapping this CPU removed from a shared
+// page table (see page_remove).
+//
+// The other CPUs only see the request when they take the interrupt,
+// which a CPU spinning for a lock in the kernel never does, so this
+// must be called with no locks held.  trap() and sched_yield() call it
+// once a system call that changed a shared page table is over.
+//
+void
+tlb_shootdown(void)
+{
+	struct PageInfo *pp;
+	int i;
+
+	thiscpu->cpu_tlb_pending = false;
+	if (ncpu > 1) {
+		for (i = 0; i < ncpu; i++)
+			if (&cpus[i] != thiscpu)
+				cpus[i].cpu_tlb_flush = true;
+		lapic_ipi(IRQ_OFFSET + IRQ_TLB);
+		for (i = 0; i < ncpu; i++)
+			while (cpus[i].cpu_tlb_flush) {
+				// Another CPU may be waiting for us, here.
+				if (thiscpu->cpu_tlb_flush)
+					tlb_flush_ack();
+				asm volatile("pause");
+			}
+	}
+	while ((pp = thiscpu->cpu_tlb_deferred) != NULL) {
+		thiscpu->cpu_tlb_deferred = pp->pp_link;
+		pp->pp_link = NULL;
+		page_decref(pp);
+	}
+}
+
+//
+// Answer a tlb_shootdown request.
+//
+void
+tlb_flush_ack(void)
+{
+	lcr3(rcr3());
+	thiscpu->cpu_tlb_flush = false;
 }
 
 //
@@ -721,62 +1276,71 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // Checking functions.
 // --------------------------------------------------------------
 
+// Check one free page, and make sure that if it shouldn't be free, it
+// eventually causes trouble.
+static void
+check_free_page(struct PageInfo *pp, bool only_low_memory,
+		int *nfree_basemem, int *nfree_extmem)
+{
+	// check that we didn't corrupt the free lists themselves
+	assert(pp >= pages);
+	assert(pp < pages + npages);
+	assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
+	assert(pp->pp_flags & PP_FREE);
+	assert(pp->pp_ref == 0);
+
+	// entry_pgdir maps only the first 4MB, and only that is free yet
+	if (only_low_memory)
+		assert(PDX(page2pa(pp)) < 1);
+	memset(page2kva(pp), 0x97, 128);
+
+	// check a few pages that shouldn't be on the free list
+	assert(page2pa(pp) != 0);
+	assert(page2pa(pp) != IOPHYSMEM);
+	assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+	assert(page2pa(pp) != EXTPHYSMEM);
+	assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= (char *) boot_alloc(0));
+	// (new test for lab 4)
+	assert(page2pa(pp) != MPENTRY_PADDR);
+
+	if (page2pa(pp) < EXTPHYSMEM)
+		++*nfree_basemem;
+	else
+		++*nfree_extmem;
+}
+
 //
-// Check that the pages on the page_free_list are reasonable.
+// Check that the pages on the buddy free lists and in the per-CPU
+// magazines are reasonable.
 //
 static void
 check_page_free_list(bool only_low_memory)
 {
 	struct PageInfo *pp;
-	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
-	char *first_free_page;
-
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
-
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp; // 第一次，pp1=pp或pp2=pp
-			tp[pagetype] = &pp->pp_link; // 这样下一次对*tp[pagetype]的赋值就是修改pp->pp_link了。
-		}
-		*tp[1] = 0; // 高地址free page链表结尾，赋值一个结束符
-		*tp[0] = pp2; // 低地址free page链表结尾，接上高地址free page链表
-		page_free_list = pp1;
-	}
+	size_t nbuddy = 0, k;
+	unsigned o;
+	int i;
 
-	// if there's a page that shouldn't be on the free list,
-	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
-
-	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-		// (new test for lab 4)
-		assert(page2pa(pp) != MPENTRY_PADDR);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
-	}
+	for (o = 0; o <= PAGE_MAXORDER; o++)
+		for (pp = page_free_area[o]; pp; pp = pp->pp_link) {
+			assert(pp->pp_flags & PP_BUDDY);
+			assert(pp->pp_order == o);
+			assert(pp->pp_link == NULL || pp->pp_link->pp_prev == pp);
+			assert((pp - pages) % (1 << o) == 0);
+			for (k = 0; k < (1 << o); k++)
+				check_free_page(pp + k, only_low_memory,
+						&nfree_basemem, &nfree_extmem);
+			nbuddy += 1 << o;
+		}
+	assert(nbuddy == page_nfree_buddy);
+	for (i = 0; i < NCPU; i++)
+		for (k = 0; k < cpus[i].cpu_npcache; k++) {
+			pp = cpus[i].cpu_pcache[k];
+			assert(!(pp->pp_flags & PP_BUDDY));
+			check_free_page(pp, only_low_memory,
+					&nfree_basemem, &nfree_extmem);
+		}
 
 	assert(nfree_basemem > 0);
 	assert(nfree_extmem > 0);
@@ -784,16 +1348,69 @@ check_page_free_list(bool only_low_memory)
 	cprintf("check_page_free_list() succeeded!\n");
 }
 
+// Where page_stash keeps the free pages while a check runs dry.
+static struct PageInfo *stash_area[PAGE_MAXORDER + 1];
+static size_t stash_nbuddy;
+static struct PageInfo *stash_pcache[PCACHE_MAX];
+static int stash_npcache;
+
+// Set or clear PP_BUDDY on the blocks page_stash holds.  While they
+// are stashed, buddy_free must not see them as free buddies: merging
+// with one would unlink it from a list that isn't installed.
+static void
+stash_mark_buddy(bool on)
+{
+	struct PageInfo *pp;
+	unsigned o;
+
+	for (o = 0; o <= PAGE_MAXORDER; o++) {
+		for (pp = stash_area[o]; pp; pp = pp->pp_link) {
+			if (on)
+				pp->pp_flags |= PP_BUDDY;
+			else
+				pp->pp_flags &= ~PP_BUDDY;
+		}
+	}
+}
+
+// Temporarily steal all the free pages: the buddy lists and this
+// CPU's magazine (the only one in use this early).
+static void
+page_stash(void)
+{
+	memmove(stash_area, page_free_area, sizeof(page_free_area));
+	stash_mark_buddy(0);
+	memset(page_free_area, 0, sizeof(page_free_area));
+	stash_nbuddy = page_nfree_buddy;
+	page_nfree_buddy = 0;
+	memmove(stash_pcache, thiscpu->cpu_pcache, sizeof(stash_pcache));
+	stash_npcache = thiscpu->cpu_npcache;
+	thiscpu->cpu_npcache = 0;
+}
+
+// Give the stolen pages back.  Every page the check freed must have
+// been allocated again.
+static void
+page_unstash(void)
+{
+	assert(page_nfree_buddy == 0 && thiscpu->cpu_npcache == 0);
+	stash_mark_buddy(1);
+	memmove(page_free_area, stash_area, sizeof(page_free_area));
+	page_nfree_buddy = stash_nbuddy;
+	memmove(thiscpu->cpu_pcache, stash_pcache, sizeof(stash_pcache));
+	thiscpu->cpu_npcache = stash_npcache;
+}
+
 //
 // Check the physical page allocator (page_alloc(), page_free(),
-// and page_init()).
+// page_alloc_order(), page_free_order() and page_init()).
 //
 static void
 check_page_alloc(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
-	int nfree;
-	struct PageInfo *fl;
+	size_t nfree, narea[PAGE_MAXORDER + 1];
+	unsigned o;
 	char *c;
 	int i;
 
@@ -801,8 +1418,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = page_nfree();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -816,13 +1432,14 @@ check_page_alloc(void)
 	assert(page2pa(pp0) < npages*PGSIZE);
 	assert(page2pa(pp1) < npages*PGSIZE);
 	assert(page2pa(pp2) < npages*PGSIZE);
+	assert(page_nfree() == nfree - 3);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	page_stash();
 
 	// should be no free memory
 	assert(!page_alloc(0));
+	assert(!page_alloc_order(0, 0));
 
 	// free and re-allocate?
 	page_free(pp0);
@@ -847,7 +1464,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	page_unstash();
 
 	// free the pages we took
 	page_free(pp0);
@@ -855,9 +1472,42 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(page_nfree() == nfree);
+
+	// contiguous blocks: aligned, distinct, zeroed on request
+	for (o = 0; o <= PAGE_MAXORDER; o++)
+		for (narea[o] = 0, pp = page_free_area[o]; pp; pp = pp->pp_link)
+			++narea[o];
+	assert((pp0 = page_alloc_order(4, 0)));
+	assert((pp0 - pages) % 16 == 0);
+	assert((pp1 = page_alloc_order(4, ALLOC_ZERO)));
+	assert((pp1 - pages) % 16 == 0);
+	assert(pp1 + 16 <= pp0 || pp0 + 16 <= pp1);
+	c = page2kva(pp1);
+	for (i = 0; i < 16 * PGSIZE; i++)
+		assert(c[i] == 0);
+	assert(page_nfree() == nfree - 32);
+	assert(!page_alloc_order(PAGE_MAXORDER + 1, 0));
+
+	// freed blocks should merge back into what they were split from
+	page_free_order(pp1, 4);
+	page_free_order(pp0, 4);
+	assert(page_nfree() == nfree);
+	for (o = 0; o <= PAGE_MAXORDER; o++)
+		for (pp = page_free_area[o]; pp; pp = pp->pp_link)
+			--narea[o];
+	for (o = 0; o <= PAGE_MAXORDER; o++)
+		assert(narea[o] == 0);
+
+	// a drained magazine page should reach the buddy lists
+	page_stash();
+	page_free(pp2);
+	pcache_drain();
+	assert(page_free_area[0] == pp2);
+	assert((pp = page_alloc_order(0, 0)) && pp == pp2);
+	page_unstash();
+	page_free_order(pp2, 0);
+	assert(page_nfree() == nfree);
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
@@ -938,6 +1588,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PTE_ADDR(*pgdir) + PTX(va) * PGSIZE;
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -950,7 +1602,6 @@ static void
 check_page(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
-	struct PageInfo *fl;
 	pte_t *ptep, *ptep1;
 	void *va;
 	uintptr_t mm1, mm2;
@@ -968,8 +1619,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	page_stash();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1089,7 +1739,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	page_unstash();
 
 	// free the pages we took
 	page_free(pp0);
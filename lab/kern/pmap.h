@@ -52,16 +52,39 @@ enum {
 };
 
 void	mem_init(void);
+void	pmap_init_percpu(void);
+
+// Largest block page_alloc_order hands out: 2^PAGE_MAXORDER pages (4MB)
+#define PAGE_MAXORDER	10
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_order(unsigned order, int alloc_flags);
+void	page_free_order(struct PageInfo *pp, unsigned order);
+size_t	page_nfree(void);
+// Order of the blocks behind 4MB (PTE_PS) pages
+#define PAGE_LARGE_ORDER	(PDXSHIFT - PGSHIFT)
+struct PageInfo *page_alloc_large(int alloc_flags);
+void	page_free_large(struct PageInfo *pp);
+int	page_zero_idle(bool (*stop)(void));
+void	page_zero_stat_print(void);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
+void	pgtable_decref(struct PageInfo *pp);
+
+// Atomically take another reference on pp.
+static inline void
+page_incref(struct PageInfo *pp)
+{
+	asm volatile("lock; incw %0" : "+m" (pp->pp_ref) : : "cc", "memory");
+}
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_shootdown(void);
+void	tlb_flush_ack(void);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
@@ -5,6 +5,11 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/spinlock.h>
+
+// Serializes cprintf() calls from different CPUs so their output
+// isn't interleaved character by character.
+static struct spinlock printf_lock = { .name = "printf_lock" };
 
 static void
 putch(int ch, int *cnt)
@@ -16,9 +21,16 @@ putch(int ch, int *cnt)
 int
 vcprintf(const char *fmt, va_list ap)
 {
+	extern const char *panicstr;
 	int cnt = 0;
+	// Don't lock after a panic: the panicking CPU may already hold it.
+	bool locking = !panicstr;
 
+	if (locking)
+		spin_lock(&printf_lock);
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	if (locking)
+		spin_unlock(&printf_lock);
 	return cnt;
 }
 
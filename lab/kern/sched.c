@@ -7,33 +7,297 @@
 
 void sched_halt(void);
 
+// Per-CPU run queues.
+//
+// Every ENV_RUNNABLE environment that no CPU currently owns is linked
+// on the run queue of the CPU named by its env_cpunum (the CPU it last
+// ran on, or the one env_alloc assigned it to), in FIFO order through
+// env_rq_next/env_rq_prev.  Blocked, running and free environments are
+// never on a queue, so picking the next environment costs O(1) no
+// matter how many environments exist.
+//
+// A CPU owns an environment from the moment it picks it until it
+// switches away from it in sched_release(): while owned, the
+// environment is either ENV_RUNNING or is still curenv on that CPU.
+// An environment woken while it is still owned (e.g. an IPC sender
+// beat the receiver's CPU out of sched_yield) becomes ENV_RUNNABLE
+// but is queued only when its owner lets go of it.
+//
+// rq_lock protects the queue and, for every environment whose
+// env_cpunum names this CPU, its env_status and env_cpunum.
+struct RunQueue {
+	struct spinlock rq_lock;
+	struct Env *rq_head;
+	struct Env *rq_tail;
+	uint32_t rq_len;
+};
+
+static struct RunQueue runqs[NCPU];
+
+void
+sched_init(void)
+{
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		__spin_initlock(&runqs[i].rq_lock, "rq_lock");
+}
+
+// Lock the run queue that e currently belongs to.  e->env_cpunum only
+// changes under the lock of its old queue, so recheck it once we hold
+// the lock.
+static struct RunQueue *
+runq_lock(struct Env *e)
+{
+	struct RunQueue *rq;
+
+	for (;;) {
+		rq = &runqs[e->env_cpunum];
+		spin_lock(&rq->rq_lock);
+		if (rq == &runqs[e->env_cpunum])
+			return rq;
+		spin_unlock(&rq->rq_lock);
+	}
+}
+
+// Is some CPU still running (or about to switch away from) e?
+static bool
+owned(struct Env *e)
+{
+	return e->env_status == ENV_RUNNING ||
+		cpus[e->env_cpunum].cpu_env == e;
+}
+
+// Append e to the tail of rq.  Called with rq->rq_lock held.
+static void
+runq_append(struct RunQueue *rq, struct Env *e)
+{
+	e->env_rq_next = NULL;
+	e->env_rq_prev = rq->rq_tail;
+	if (rq->rq_tail)
+		rq->rq_tail->env_rq_next = e;
+	else
+		rq->rq_head = e;
+	rq->rq_tail = e;
+	rq->rq_len++;
+}
+
+// Unlink e from rq.  Called with rq->rq_lock held.
+static void
+runq_unlink(struct RunQueue *rq, struct Env *e)
+{
+	if (e->env_rq_prev)
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	else
+		rq->rq_head = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	else
+		rq->rq_tail = e->env_rq_prev;
+	e->env_rq_next = e->env_rq_prev = NULL;
+	rq->rq_len--;
+}
+
+// Make a blocked environment runnable.
+void
+sched_wakeup(struct Env *e)
+{
+	struct RunQueue *rq = runq_lock(e);
+
+	if (e->env_status == ENV_NOT_RUNNABLE) {
+		e->env_status = ENV_RUNNABLE;
+		if (!owned(e))
+			runq_append(rq, e);
+	}
+	spin_unlock(&rq->rq_lock);
+}
+
+// Stop scheduling e until somebody calls sched_wakeup() on it.
+// If e is running on some CPU it keeps running until it next
+// enters the kernel.
+void
+sched_block(struct Env *e)
+{
+	struct RunQueue *rq = runq_lock(e);
+
+	if (e->env_status == ENV_RUNNABLE) {
+		if (!owned(e))
+			runq_unlink(rq, e);
+		e->env_status = ENV_NOT_RUNNABLE;
+	} else if (e->env_status == ENV_RUNNING)
+		e->env_status = ENV_NOT_RUNNABLE;
+	spin_unlock(&rq->rq_lock);
+}
+
+// Mark e as dying.  Returns 1 if the caller must free e now, or 0 if
+// e is already dying or another CPU owns it, in which case that CPU
+// frees it the next time e enters the kernel or is switched away from.
+int
+sched_kill(struct Env *e)
+{
+	struct RunQueue *rq = runq_lock(e);
+	int r = 1;
+
+	if (e->env_status == ENV_DYING || e->env_status == ENV_FREE)
+		r = 0;
+	else if (owned(e)) {
+		if (e != curenv)
+			r = 0;
+	} else if (e->env_status == ENV_RUNNABLE)
+		runq_unlink(rq, e);
+	if (e->env_status != ENV_FREE)
+		e->env_status = ENV_DYING;
+	spin_unlock(&rq->rq_lock);
+	return r;
+}
+
+// Keep e from running: if it is blocked and no CPU owns it, return 1
+// with its run queue locked, so that nobody can sched_wakeup() or
+// sched_claim() it until sched_unhold(e).  Otherwise return 0 with
+// nothing locked.
+int
+sched_hold(struct Env *e)
+{
+	struct RunQueue *rq = runq_lock(e);
+
+	if (e->env_status == ENV_NOT_RUNNABLE && !owned(e))
+		return 1;
+	spin_unlock(&rq->rq_lock);
+	return 0;
+}
+
+// Let a held environment run again.  e->env_cpunum can't have changed,
+// since that takes the lock we hold.
+void
+sched_unhold(struct Env *e)
+{
+	spin_unlock(&runqs[e->env_cpunum].rq_lock);
+}
+
+// Claim e for this CPU right away, bypassing the run queues, if no CPU
+// owns it and it is blocked or waiting on a run queue.  Used to switch
+// directly to the partner of an IPC call or reply.  Returns 1 if the
+// caller now owns e and should env_run() it.
+int
+sched_claim(struct Env *e)
+{
+	struct RunQueue *rq = runq_lock(e);
+	int r = 0;
+
+	if (!owned(e) && (e->env_status == ENV_NOT_RUNNABLE ||
+			  e->env_status == ENV_RUNNABLE)) {
+		if (e->env_status == ENV_RUNNABLE)
+			runq_unlink(rq, e);
+		e->env_status = ENV_RUNNING;
+		e->env_cpunum = cpunum();
+		r = 1;
+	}
+	spin_unlock(&rq->rq_lock);
+	return r;
+}
+
+// Give up this CPU's claim on curenv, queueing it again if it is still
+// runnable, and set curenv to NULL.  The caller must already have
+// switched away from curenv's page directory.
+void
+sched_release(void)
+{
+	struct Env *e = curenv;
+	struct RunQueue *rq;
+	bool dying;
+
+	if (!e)
+		return;
+	rq = runq_lock(e);
+	if (e->env_status == ENV_RUNNING)
+		e->env_status = ENV_RUNNABLE;
+	curenv = NULL;
+	// Decide under the lock: once e is back on a queue and the lock is
+	// dropped, another CPU may run it, and a third may kill it.
+	dying = e->env_status == ENV_DYING;
+	if (!dying && e->env_status == ENV_RUNNABLE)
+		runq_append(rq, e);	// 放到本CPU运行队列的队尾，实现round-robin。
+	spin_unlock(&rq->rq_lock);
+
+	// Somebody killed e while we owned it; we are the one to free it.
+	if (dying)
+		env_free(e);
+}
+
+// Take the environment at the head of CPU i's run queue, if any,
+// and claim it for this CPU.
+static struct Env *
+runq_pop(int i)
+{
+	struct RunQueue *rq = &runqs[i];
+	struct Env *e;
+
+	// Peek without the lock so idle CPUs don't hammer busy queues.
+	if (!rq->rq_head)
+		return NULL;
+	spin_lock(&rq->rq_lock);
+	if ((e = rq->rq_head) != NULL) {
+		runq_unlink(rq, e);
+		e->env_status = ENV_RUNNING;
+		e->env_cpunum = cpunum();
+	}
+	spin_unlock(&rq->rq_lock);
+	return e;
+}
+
+// Keep running curenv if it is still runnable.
+static bool
+sched_resume(struct Env *e)
+{
+	struct RunQueue *rq = runq_lock(e);
+	bool r = false;
+
+	if (e->env_status == ENV_RUNNING || e->env_status == ENV_RUNNABLE) {
+		e->env_status = ENV_RUNNING;
+		r = true;
+	}
+	spin_unlock(&rq->rq_lock);
+	return r;
+}
+
+// Is any environment waiting on a run queue?  Read without the locks;
+// it's only a hint for the idle loop.
+static bool
+runq_pending(void)
+{
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+		if (runqs[i].rq_head)
+			return true;
+	return false;
+}
+
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	struct Env *idle;
-    struct Env *p;
+	struct Env *e;
+	int i, me = cpunum();
 
 	// Implement simple round-robin scheduling.
 	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
+	// Take the environment at the head of this CPU's run queue.
+	// sched_release() puts the environment we were running at the tail,
+	// so environments on one CPU take turns.
+	//
+	// If our queue is empty, steal the head of another CPU's queue,
+	// so no CPU idles while there is runnable work elsewhere.
 	//
-	// If no envs are runnable, but the environment previously
+	// If nothing is runnable, but the environment previously
 	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment. Make sure curenv is not null before
-	// dereferencing it.
+	// choose that environment.  Otherwise halt this CPU.
 	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
+	// Environments running on other CPUs are never on a run queue,
+	// and runq_pop() claims an environment under its queue's lock,
+	// so two CPUs can never choose the same environment.
 
-	// LAB 4: Your code here.
     // JOS中，每个CPU只有一个内核栈，进程有自己的用户栈，但共有内核栈。
-    // 因为同一个时刻，只允许一个CPU上的一个进程进入内核态，所以同一时刻，只能有
-    // 一个CPU的sched_yield执行，这避免了不同CPU同时调度同一个进程执行。
     // 在内核态的进程，其必然通过中断（无论是系统调用还是时钟中断）进入内核态，
     // 必然通过中断处理函数，必然进入kern/trapentry.S:_alltraps，配合INT指令在当前CPU的内核栈中
     // 建立Trapframe。当然，这个Trapframe马上就会被复制到当前进程对应的Env对象的Trapframe成员中，
@@ -42,21 +306,19 @@ sched_yield(void)
     // sched_yield会对ENV_RUNNABLE的进程调用env_run，env_run会调用env_pop_tf，恢复目标进程
     // 对应的数据结构Env中的Trapframe（不是内核栈中的），从而使目标进程返回用户态继续执行。
     // env_run不会返回。
-    idle = (curenv==NULL)? envs: ((curenv+1==envs+NENV)? envs: curenv+1);
-    p = idle;
-    do {
-        if (p->env_status == ENV_RUNNABLE)
-            env_run(p);
-        p++;
-        if (p == envs+NENV)
-            p = envs;
-    } while(p != idle);
-
-    if (p == idle) {
-        // no envs are runnable
-        if (curenv != NULL && curenv->env_status == ENV_RUNNING)
-            env_run(curenv);
-    }
+	// Finish what the system call that got us here left (see trap()).
+	if (thiscpu->cpu_tlb_pending)
+		tlb_shootdown();
+
+	if ((e = runq_pop(me)) != NULL)
+		env_run(e);
+	for (i = (me + 1) % ncpu; i != me; i = (i + 1) % ncpu)
+		if ((e = runq_pop(i)) != NULL)
+			env_run(e);
+
+	// no envs are runnable
+	if (curenv != NULL && sched_resume(curenv))
+		env_run(curenv);
 
 	// sched_halt never returns
 	sched_halt();
@@ -68,34 +330,57 @@ sched_yield(void)
 void
 sched_halt(void)
 {
+	struct Env *e;
 	int i;
 
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NENV; i++) {
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
+	// Runnable environments are almost always on the run queues, and
+	// running or dying ones are some CPU's current environment, so
+	// usually this only has to look at each CPU.  An environment that
+	// another CPU is in the middle of picking or releasing is on
+	// neither, so fall back to scanning envs[] before giving up.
+	for (i = 0; i < ncpu; i++) {
+		e = cpus[i].cpu_env;
+		if (runqs[i].rq_len > 0 ||
+		    (e && (e->env_status == ENV_RUNNING ||
+			   e->env_status == ENV_RUNNABLE ||
+			   e->env_status == ENV_DYING)))
 			break;
 	}
-	if (i == NENV) {
-		cprintf("No runnable environments in the system!\n");
-		while (1)
-			monitor(NULL);
+	if (i == ncpu) {
+		for (i = 0; i < NENV; i++) {
+			if (envs[i].env_status == ENV_RUNNABLE ||
+			    envs[i].env_status == ENV_RUNNING ||
+			    envs[i].env_status == ENV_DYING)
+				break;
+		}
+		if (i == NENV) {
+			cprintf("No runnable environments in the system!\n");
+			while (1)
+				monitor(NULL);
+		}
 	}
 
 	// Mark that no environment is running on this CPU
-	curenv = NULL;
 	lcr3(PADDR(kern_pgdir));
+	sched_release();
+
+	// Use the idle time to zero free pages.  If something became
+	// runnable meanwhile, go back to the scheduler on a fresh stack
+	// instead of halting until the next timer interrupt.
+	if (page_zero_idle(runq_pending) > 0 && runq_pending())
+		asm volatile (
+			"movl $0, %%ebp\n"
+			"movl %0, %%esp\n"
+			"call sched_yield\n"
+		: : "a" (thiscpu->cpu_ts.ts_esp0));
 
 	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
+	// timer interupts come in, we know we should re-enter
+	// the scheduler
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
-
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
 		"movl $0, %%ebp\n"
@@ -6,7 +6,21 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+struct Env;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+void sched_init(void);
+
+// Environment state transitions.  These keep the per-CPU run queues
+// consistent with env_status and are safe to call from any CPU.
+void sched_wakeup(struct Env *e);
+void sched_block(struct Env *e);
+int sched_kill(struct Env *e);
+int sched_claim(struct Env *e);
+int sched_hold(struct Env *e);
+void sched_unhold(struct Env *e);
+void sched_release(void);
+
 #endif	// !JOS_KERN_SCHED_H
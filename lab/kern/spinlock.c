@@ -9,12 +9,36 @@
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
 
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
-#endif
-};
+// All locks that have ever been acquired, for lockstat.  Locks are
+// added on their first acquisition and never removed.
+static struct spinlock *lock_list;
+
+// Atomically replace *addr with new if it still holds old.
+// Returns the previous value of *addr.
+static inline struct spinlock *
+cmpxchg(struct spinlock **addr, struct spinlock *old, struct spinlock *new)
+{
+	struct spinlock *prev;
+
+	asm volatile("lock; cmpxchgl %2, %1"
+		     : "=a" (prev), "+m" (*addr)
+		     : "r" (new), "0" (old)
+		     : "cc", "memory");
+	return prev;
+}
+
+// Atomically take a ticket.
+static inline unsigned
+fetch_and_inc(volatile unsigned *addr)
+{
+	unsigned v = 1;
+
+	asm volatile("lock; xaddl %0, %1"
+		     : "+r" (v), "+m" (*addr)
+		     :
+		     : "cc", "memory");
+	return v;
+}
 
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
@@ -34,23 +58,20 @@ get_caller_pcs(uint32_t pcs[])
 	for (; i < 10; i++)
 		pcs[i] = 0;
 }
+#endif
 
 // Check whether this CPU is holding the lock.
 static int
 holding(struct spinlock *lock)
 {
-	return lock->locked && lock->cpu == thiscpu;
+	return lock->next != lock->owner && lock->cpu == thiscpu;
 }
-#endif
 
 void
 __spin_initlock(struct spinlock *lk, char *name)
 {
-	lk->locked = 0;
-#ifdef DEBUG_SPINLOCK
+	memset(lk, 0, sizeof(*lk));
 	lk->name = name;
-	lk->cpu = 0;
-#endif
 }
 
 // Acquire the lock.
@@ -60,20 +81,41 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
-#ifdef DEBUG_SPINLOCK
+	unsigned ticket;
+	uint64_t start, spun = 0;
+
 	if (holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
-#endif
 
-	// The xchg is atomic.
+	// The locked xadd is atomic.
 	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	// reordered before it.
+	ticket = fetch_and_inc(&lk->next);
+	if (lk->owner != ticket) {
+		start = read_tsc();
+		while (lk->owner != ticket)
+			asm volatile ("pause");
+		spun = read_tsc() - start;
+	}
+
+	lk->cpu = thiscpu;
+
+	// Account for the acquisition; we hold the lock, so plain
+	// increments are safe.
+	lk->nacquire++;
+	if (spun) {
+		lk->ncontended++;
+		lk->spin_cycles += spun;
+	}
+	if (!lk->registered) {
+		lk->registered = 1;
+		do
+			lk->link = lock_list;
+		while (cmpxchg(&lock_list, lk->link, lk) != lk->link);
+	}
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
-	lk->cpu = thiscpu;
 	get_caller_pcs(lk->pcs);
 #endif
 }
@@ -82,14 +124,15 @@ spin_lock(struct spinlock *lk)
 void
 spin_unlock(struct spinlock *lk)
 {
-#ifdef DEBUG_SPINLOCK
 	if (!holding(lk)) {
+		cprintf("CPU %d cannot release %s: held by CPU %d\n",
+			cpunum(), lk->name, lk->cpu ? lk->cpu->cpu_id : -1);
+#ifdef DEBUG_SPINLOCK
 		int i;
 		uint32_t pcs[10];
 		// Nab the acquiring EIP chain before it gets released
 		memmove(pcs, lk->pcs, sizeof pcs);
-		cprintf("CPU %d cannot release %s: held by CPU %d\nAcquired at:", 
-			cpunum(), lk->name, lk->cpu->cpu_id);
+		cprintf("Acquired at:");
 		for (i = 0; i < 10 && pcs[i]; i++) {
 			struct Eipdebuginfo info;
 			if (debuginfo_eip(pcs[i], &info) >= 0)
@@ -100,17 +143,63 @@ spin_unlock(struct spinlock *lk)
 			else
 				cprintf("  %08x\n", pcs[i]);
 		}
+#endif
 		panic("spin_unlock");
 	}
 
+#ifdef DEBUG_SPINLOCK
 	lk->pcs[0] = 0;
-	lk->cpu = 0;
 #endif
+	lk->cpu = 0;
+
+	// Hand the lock to the next ticket.  Only the holder writes
+	// lk->owner, and x86 does not reorder a store with earlier loads
+	// or stores (vol 3, 8.2.2), so a plain store releases the lock
+	// once the compiler barrier keeps gcc from sinking the critical
+	// section below it.
+	asm volatile("" : : : "memory");
+	lk->owner = lk->owner + 1;
+}
+
+// Print the contention statistics of every lock that has been
+// acquired, summing locks that share a name (e.g. the per-Env locks).
+void
+spin_stat_print(void)
+{
+	struct spinlock *lk, *p;
+	uint64_t nacq, ncont, cycles;
+
+	cprintf("%-16s %12s %12s %14s %10s\n",
+		"lock", "acquire", "contended", "spin kcycles", "cyc/cont");
+	for (lk = lock_list; lk; lk = lk->link) {
+		// Print each name once, at its first lock on the list.
+		for (p = lock_list; p != lk; p = p->link)
+			if (strcmp(p->name, lk->name) == 0)
+				break;
+		if (p != lk)
+			continue;
+		nacq = ncont = cycles = 0;
+		for (p = lk; p; p = p->link) {
+			if (strcmp(p->name, lk->name) != 0)
+				continue;
+			nacq += p->nacquire;
+			ncont += p->ncontended;
+			cycles += p->spin_cycles;
+		}
+		cprintf("%-16s %12llu %12llu %14llu %10llu\n", lk->name,
+			nacq, ncont, cycles / 1000,
+			ncont ? cycles / ncont : 0ULL);
+	}
+}
+
+// Zero the statistics of every lock.  The counters are only updated
+// by lock holders, so this is racy against other CPUs, but it's only
+// meant for the monitor.
+void
+spin_stat_reset(void)
+{
+	struct spinlock *lk;
 
-	// The xchg instruction is atomic (i.e. uses the "lock" prefix) with
-	// respect to any other instruction which references the same memory.
-	// x86 CPUs will not reorder loads/stores across locked instructions
-	// (vol 3, 8.2.2). Because xchg() is implemented using asm volatile,
-	// gcc will not reorder C statements across the xchg.
-	xchg(&lk->locked, 0);
+	for (lk = lock_list; lk; lk = lk->link)
+		lk->nacquire = lk->ncontended = lk->spin_cycles = 0;
 }
@@ -3,17 +3,31 @@
 
 #include <inc/types.h>
 
-// Comment this to disable spinlock debugging
-#define DEBUG_SPINLOCK
+// Uncomment this to record the acquiring call stack of every lock
+// (expensive: it walks 10 frames on every acquire)
+// #define DEBUG_SPINLOCK
 
 // Mutual exclusion lock.
+//
+// A ticket lock: each acquirer takes the next ticket and spins until
+// the owner counter reaches it, so CPUs get the lock in FIFO order and
+// the spinning is all reads of one cache line until it is handed over.
 struct spinlock {
-	unsigned locked;       // Is the lock held?
+	volatile unsigned next;	// Next ticket to hand out
+	volatile unsigned owner;// Ticket currently holding the lock
 
-#ifdef DEBUG_SPINLOCK
-	// For debugging:
 	char *name;            // Name of lock.
 	struct CpuInfo *cpu;   // The CPU holding the lock.
+
+	// Contention statistics, updated by the holder (see lockstat).
+	uint64_t nacquire;     // Number of acquisitions
+	uint64_t ncontended;   // Acquisitions that had to wait
+	uint64_t spin_cycles;  // Total TSC cycles spent waiting
+	struct spinlock *link; // Next lock on the statistics list
+	bool registered;       // Is the lock on the statistics list?
+
+#ifdef DEBUG_SPINLOCK
+	// For debugging:
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
 #endif
@@ -22,27 +36,9 @@ struct spinlock {
 void __spin_initlock(struct spinlock *lk, char *name);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+void spin_stat_print(void);
+void spin_stat_reset(void);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
 
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
-
-static inline void
-unlock_kernel(void)
-{
-	spin_unlock(&kernel_lock);
-
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
-}
-
 #endif
@@ -12,6 +12,58 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 
+// Lock the environment that envid2env() returned for envid, then make
+// sure it wasn't freed (and possibly reallocated) in the meantime.
+// Returns 0 with e locked, or -E_BAD_ENV with nothing locked.
+static int
+lock_env(struct Env *e, envid_t envid)
+{
+	env_lock(e);
+	if (e->env_status == ENV_FREE || (envid != 0 && e->env_id != envid)) {
+		env_unlock(e);
+		return -E_BAD_ENV;
+	}
+	return 0;
+}
+
+// Lock two environments (which may be the same one) and re-validate
+// both as lock_env does.
+static int
+lock_env_pair(struct Env *a, envid_t aid, struct Env *b, envid_t bid)
+{
+	env_lock_pair(a, b);
+	if (a->env_status == ENV_FREE || (aid != 0 && a->env_id != aid)
+	    || b->env_status == ENV_FREE || (bid != 0 && b->env_id != bid)) {
+		env_unlock_pair(a, b);
+		return -E_BAD_ENV;
+	}
+	return 0;
+}
+
+// Lock e as lock_env does and, unless e is the caller, hold it (see
+// sched_hold): no CPU may run e, and so enter or leave the kernel with
+// its trap frame, until unlock_stopped_env(e).  Returns 0, -E_BAD_ENV as
+// lock_env does, or -E_INVAL with nothing locked if e may be running.
+static int
+lock_stopped_env(struct Env *e, envid_t envid)
+{
+	if (lock_env(e, envid) != 0)
+		return -E_BAD_ENV;
+	if (e != curenv && !sched_hold(e)) {
+		env_unlock(e);
+		return -E_INVAL;
+	}
+	return 0;
+}
+
+static void
+unlock_stopped_env(struct Env *e)
+{
+	if (e != curenv)
+		sched_unhold(e);
+	env_unlock(e);
+}
+
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
 // Destroys the environment on memory errors.
@@ -86,9 +138,11 @@ sys_exofork(void)
     int err;
     if ((err=env_alloc(&e, curenv->env_id)) != 0)
         return err;
-    e->env_status = ENV_NOT_RUNNABLE;
+    // env_alloc已经把e设为ENV_NOT_RUNNABLE。
     e->env_tf = curenv->env_tf;
     e->env_tf.tf_regs.reg_eax = 0; // 子进程返回0
+    // 子进程是普通进程，不继承父进程的I/O权限；要的话见sys_env_set_type。
+    e->env_tf.tf_eflags &= ~FL_IOPL_MASK;
     return e->env_id; // 父进程返回子进程id
 }
 
@@ -115,7 +169,11 @@ sys_env_set_status(envid_t envid, int status)
         return -E_INVAL;
     if (envid2env(envid, &e, 1) != 0)
         return -E_BAD_ENV;
-    e->env_status = status;
+    // 运行队列由sched_wakeup/sched_block维护。
+    if (status == ENV_RUNNABLE)
+        sched_wakeup(e);
+    else
+        sched_block(e);
     return 0;
 }
 
@@ -126,6 +184,8 @@ sys_env_set_status(envid_t envid, int status)
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
+//	-E_INVAL if envid is not the caller and may be running: it must
+//		be ENV_NOT_RUNNABLE.
 static int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 {
@@ -137,7 +197,44 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
     struct Env *e;
     if (envid2env(envid, &e, 1) != 0)
         return -E_BAD_ENV;
+    int r;
+    if ((r = lock_stopped_env(e, envid)) != 0)
+        return r;
     e->env_tf = *tf;
+    // CPL 3、开中断、IOPL 0：I/O权限只能来自env_create或sys_env_set_type。
+    e->env_tf.tf_cs = GD_UT | 3;
+    e->env_tf.tf_eflags |= FL_IF;
+    e->env_tf.tf_eflags &= ~FL_IOPL_MASK;
+    unlock_stopped_env(e);
+    return 0;
+}
+
+// Give envid the caller's own type, so a server can make its threads
+// (see sfork) servers too, with the I/O privilege that goes with
+// ENV_TYPE_FS.  Any environment may be made ENV_TYPE_USER again.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if type is neither ENV_TYPE_USER nor the caller's type.
+//	-E_INVAL if envid is not the caller and may be running: it must
+//		be ENV_NOT_RUNNABLE.
+static int
+sys_env_set_type(envid_t envid, int type)
+{
+    struct Env *e;
+    int r;
+    if (type != ENV_TYPE_USER && type != curenv->env_type)
+        return -E_INVAL;
+    if (envid2env(envid, &e, 1) != 0)
+        return -E_BAD_ENV;
+    if ((r = lock_stopped_env(e, envid)) != 0)
+        return r;
+    e->env_type = type;
+    e->env_tf.tf_eflags &= ~FL_IOPL_MASK;
+    if (type == ENV_TYPE_FS)
+        e->env_tf.tf_eflags |= FL_IOPL_3;
+    unlock_stopped_env(e);
     return 0;
 }
 
@@ -149,15 +246,21 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
+//	-E_INVAL if envid is not the caller and may be running: it must
+//		be ENV_NOT_RUNNABLE.
 static int
 sys_env_set_pgfault_upcall(envid_t envid, void *func)
 {
 	// LAB 4: Your code here.
 	// panic("sys_env_set_pgfault_upcall not implemented");
     struct Env *e;
+    int r;
     if (envid2env(envid, &e, 1) != 0)
         return -E_BAD_ENV;
+    if ((r = lock_stopped_env(e, envid)) != 0)
+        return r;
     e->env_pgfault_upcall = func;
+    unlock_stopped_env(e);
     return 0;
 }
 
@@ -169,12 +272,18 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 //
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
+//         PTE_PS may be set too (but not PTE_COW), for a 4MB page at
+//         a 4MB-aligned va, which takes the place of a whole page
+//         table.  fork copies such pages right away instead of
+//         copy-on-write, and IPC can't send them.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
 //	-E_INVAL if perm is inappropriate (see above).
+//	-E_INVAL for a 4MB page, if va isn't 4MB-aligned or there are
+//		4KB pages mapped there; for a 4KB page, if it's in a 4MB one.
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
 static int
@@ -193,17 +302,30 @@ sys_page_alloc(envid_t envid, void *va, int perm)
     // XXX 注意使用我们之前构建好的基础设施，不要自己重新实现了。
     if ((uint32_t)va >= UTOP || (uint32_t)va%PGSIZE != 0)
         return -E_INVAL;
-    if ((perm&(PTE_P|PTE_U)) != (PTE_P|PTE_U) || (perm&(~PTE_SYSCALL)) != 0) // 短路操作
+    if ((perm&(PTE_P|PTE_U)) != (PTE_P|PTE_U) || (perm&(~(PTE_SYSCALL|PTE_PS))) != 0) // 短路操作
+        return -E_INVAL;
+    if ((perm&PTE_PS) && ((uint32_t)va%PTSIZE != 0 || (perm&PTE_COW)))
         return -E_INVAL;
     struct Env *e;
     if (envid2env(envid, &e, 1) != 0)
         return -E_BAD_ENV;
-    struct PageInfo *p = page_alloc(ALLOC_ZERO);
+    struct PageInfo *p = (perm&PTE_PS) ? page_alloc_large(ALLOC_ZERO) : page_alloc(ALLOC_ZERO);
+    int r;
     if (!p)
         return -E_NO_MEM;
-    if (page_insert(e->env_pgdir, p, va, perm) != 0)
-        return -E_NO_MEM;
-    return 0;
+    if (lock_env(e, envid) != 0)
+        r = -E_BAD_ENV;
+    else {
+        r = page_insert(e->env_pgdir, p, va, perm);
+        env_unlock(e);
+    }
+    if (r != 0) {
+        if (perm&PTE_PS)
+            page_free_large(p);
+        else
+            page_free(p);
+    }
+    return r;
 }
 
 // Map the page of memory at 'srcva' in srcenvid's address space
@@ -221,6 +343,9 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
+//	-E_INVAL if srcva is in a 4MB page and perm lacks PTE_PS, or the
+//		other way around.  A 4MB page is mapped whole: srcva and
+//		dstva must be 4MB-aligned.
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables.
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
@@ -237,24 +362,33 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	// panic("sys_page_map not implemented");
     if ((uint32_t)srcva >= UTOP || (uint32_t)srcva%PGSIZE != 0 || (uint32_t)dstva >= UTOP || (uint32_t)dstva%PGSIZE != 0)
         return -E_INVAL;
-    if ((perm&(PTE_P|PTE_U)) != (PTE_P|PTE_U) || (perm&(~PTE_SYSCALL)) != 0)
+    if ((perm&(PTE_P|PTE_U)) != (PTE_P|PTE_U) || (perm&(~(PTE_SYSCALL|PTE_PS))) != 0)
+        return -E_INVAL;
+    if ((perm&PTE_PS) && ((uint32_t)srcva%PTSIZE != 0 || (uint32_t)dstva%PTSIZE != 0 || (perm&PTE_COW)))
         return -E_INVAL;
     struct Env *srce, *dste;
     if (envid2env(srcenvid, &srce, 1) != 0 || envid2env(dstenvid, &dste, 1) != 0)
         return -E_BAD_ENV;
     pte_t *pte;
     struct PageInfo *p;
+    int r = 0;
+    if (lock_env_pair(srce, srcenvid, dste, dstenvid) != 0)
+        return -E_BAD_ENV;
     if ((p=page_lookup(srce->env_pgdir, srcva, &pte)) == NULL)
-        return -E_INVAL;
-    if (((*pte)&PTE_W) == 0 && (perm&PTE_W) != 0)
-        return -E_INVAL;
-    if (page_insert(dste->env_pgdir, p, dstva, perm) != 0)
-        return -E_NO_MEM;
-    return 0;
+        r = -E_INVAL;
+    else if (((*pte)&PTE_W) == 0 && (perm&PTE_W) != 0)
+        r = -E_INVAL;
+    else if (((*pte)&PTE_PS) != (perm&PTE_PS))
+        r = -E_INVAL;
+    else
+        r = page_insert(dste->env_pgdir, p, dstva, perm);
+    env_unlock_pair(srce, dste);
+    return r;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
-// If no page is mapped, the function silently succeeds.
+// If no page is mapped, the function silently succeeds.  If va is in a
+// 4MB page, the whole 4MB page is unmapped.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
@@ -272,10 +406,399 @@ sys_page_unmap(envid_t envid, void *va)
     struct Env *e;
     if (envid2env(envid, &e, 1) != 0)
         return -E_BAD_ENV;
+    if (lock_env(e, envid) != 0)
+        return -E_BAD_ENV;
     page_remove(e->env_pgdir, va);
+    env_unlock(e);
+    return 0;
+}
+
+// Clear 'bits', some of PTE_W, PTE_A and PTE_D, in the entry that maps
+// 'va' in envid's address space.  Unlike a remap with sys_page_map,
+// which rewrites the entry and so always loses PTE_A and PTE_D, this
+// keeps the bits not being cleared, and reports the ones cleared: a
+// write that lands just before write access is taken away shows up in
+// the result instead of being forgotten.
+//
+// Returns the entry's PTE_A and PTE_D bits from just before the clear
+// on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va >= UTOP, or va is not page-aligned, or va is not
+//		mapped, or bits has anything but PTE_W, PTE_A and PTE_D.
+static int
+sys_page_clear(envid_t envid, void *va, int bits)
+{
+    if ((uint32_t)va >= UTOP || (uint32_t)va%PGSIZE != 0 || (bits&~(PTE_W|PTE_A|PTE_D)) != 0)
+        return -E_INVAL;
+    struct Env *e;
+    if (envid2env(envid, &e, 1) != 0)
+        return -E_BAD_ENV;
+    if (lock_env(e, envid) != 0)
+        return -E_BAD_ENV;
+    pte_t *pte = pgdir_walk(e->env_pgdir, va, 0);
+    int r;
+    if (pte == NULL || !(*pte & PTE_P)) {
+        r = -E_INVAL;
+    } else {
+        // 其它CPU可能正通过共享页表访问这一页，硬件会随时置位PTE_A/PTE_D，
+        // 所以要原子地读出旧值并清除。
+        r = __sync_fetch_and_and(pte, ~(uint32_t)bits) & (PTE_A|PTE_D);
+        tlb_invalidate(e->env_pgdir, va);
+    }
+    env_unlock(e);
+    return r;
+}
+
+// VM_COPY_SHARE_PT for sys_vm_copy: point dstpgdir's entries for
+// [start, end) at pgdir's page tables.
+static int
+vm_share_pgtables(pde_t *pgdir, pde_t *dstpgdir, uintptr_t start, uintptr_t end)
+{
+    uintptr_t va;
+
+    for (va = start; va < end; va += PTSIZE)
+        if ((dstpgdir[PDX(va)] & PTE_P) && dstpgdir[PDX(va)] != pgdir[PDX(va)])
+            return -E_INVAL;
+    for (va = start; va < end; va += PTSIZE) {
+        if (pgdir_walk(pgdir, (void*)va, 1) == NULL)
+            return -E_NO_MEM;
+        if (dstpgdir[PDX(va)] == pgdir[PDX(va)])
+            continue;
+        // 两个页目录项指向同一个页表，页表的引用计数就是共享它的进程数。
+        page_incref(pa2page(PTE_ADDR(pgdir[PDX(va)])));
+        dstpgdir[PDX(va)] = pgdir[PDX(va)];
+    }
+    return 0;
+}
+
+// sys_vm_copy for the 4MB page that pde maps at va (4MB-aligned).
+// 4MB pages aren't copy-on-write: VM_COPY_COW copies a writable one
+// that isn't PTE_SHARE right away.  Otherwise they are shared, or for
+// VM_COPY_SHARED skipped, like 4KB pages.
+static int
+vm_copy_large(pde_t pde, pde_t *dstpgdir, uintptr_t va, int mode)
+{
+    struct PageInfo *p = pa2page(PTE_ADDR(pde));
+    int perm = pde & (PTE_SYSCALL|PTE_PS), r;
+
+    if (!(perm & PTE_SHARE)) {
+        if (mode == VM_COPY_SHARED)
+            return 0;
+        if (mode == VM_COPY_COW && (perm & PTE_W)) {
+            // 大页不做写时复制，直接复制4MB。
+            struct PageInfo *np = page_alloc_large(0);
+            if (np == NULL)
+                return -E_NO_MEM;
+            memcpy(page2kva(np), page2kva(p), PTSIZE);
+            if ((r = page_insert(dstpgdir, np, (void*)va, perm)) != 0)
+                page_free_large(np);
+            return r;
+        }
+    }
+    return page_insert(dstpgdir, p, (void*)va, perm);
+}
+
+// Map the current environment's pages in [start, end) into dstenvid's
+// address space at the same addresses, all in one system call.
+// Page tables that aren't present are skipped 4MB at a time.
+//
+// In VM_COPY_COW mode (used by fork), PTE_SHARE pages are mapped with
+// the same permissions, writable or copy-on-write pages are mapped
+// copy-on-write in both environments, and other pages are mapped
+// read-only.  In VM_COPY_SHARED mode (used by spawn), only PTE_SHARE
+// pages are mapped.  In VM_COPY_SHARE_ALL mode (used by sfork), every
+// page is mapped with the same permissions, after replacing each
+// copy-on-write page of the caller with a private writable copy so
+// that writes through either mapping are seen by both environments.
+// Page tables the two environments share already are left alone.
+// 4MB pages (see sys_page_alloc) are copied whole if any part of them
+// is in [start, end), as vm_copy_large describes.
+//
+// In VM_COPY_SHARE_PT mode (used by sfork for the regions registered
+// with sfork_share), start and end must be PTSIZE-aligned, and
+// dstenvid gets the caller's page tables themselves for [start, end),
+// so that pages either of them maps there later are seen by both.
+// The caller's missing page tables are allocated first.  dstenvid must
+// not have page tables of its own there.  The environments sharing a
+// page table must serialize their changes to it themselves.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if dstenvid doesn't currently exist,
+//		or the caller doesn't have permission to change it.
+//	-E_INVAL if start or end is not page-aligned, start > end,
+//		end > UTOP, mode is invalid, or dstenvid is the caller;
+//		for VM_COPY_SHARE_PT, if start or end is not PTSIZE-aligned
+//		or dstenvid has a page table of its own in the range.
+//	-E_NO_MEM if there's no memory to allocate any necessary page tables.
+static int
+sys_vm_copy(envid_t dstenvid, uintptr_t start, uintptr_t end, int mode)
+{
+    struct Env *dste;
+    pde_t *pgdir = curenv->env_pgdir;
+    pte_t *pte;
+    uintptr_t va;
+    bool flush = false;
+    int perm, r = 0;
+
+    if (start%PGSIZE != 0 || end%PGSIZE != 0 || start > end || end > UTOP)
+        return -E_INVAL;
+    if (mode != VM_COPY_COW && mode != VM_COPY_SHARED && mode != VM_COPY_SHARE_ALL
+        && mode != VM_COPY_SHARE_PT)
+        return -E_INVAL;
+    if (mode == VM_COPY_SHARE_PT && (start%PTSIZE != 0 || end%PTSIZE != 0))
+        return -E_INVAL;
+    if (envid2env(dstenvid, &dste, 1) != 0)
+        return -E_BAD_ENV;
+    if (dste == curenv)
+        return -E_INVAL;
+    if (lock_env_pair(curenv, 0, dste, dstenvid) != 0)
+        return -E_BAD_ENV;
+
+    if (mode == VM_COPY_SHARE_PT) {
+        r = vm_share_pgtables(pgdir, dste->env_pgdir, start, end);
+        env_unlock_pair(curenv, dste);
+        return r;
+    }
+
+    for (va = start; va < end; va += PGSIZE) {
+        if (!(pgdir[PDX(va)] & PTE_P) || dste->env_pgdir[PDX(va)] == pgdir[PDX(va)]) {
+            // 整个页表都不存在（或者本来就是共享的），直接跳到下一个页表。
+            va = ROUNDDOWN(va, PTSIZE) + PTSIZE - PGSIZE;
+            continue;
+        }
+        if (pgdir[PDX(va)] & PTE_PS) {
+            if ((r = vm_copy_large(pgdir[PDX(va)], dste->env_pgdir, ROUNDDOWN(va, PTSIZE), mode)) != 0)
+                break;
+            va = ROUNDDOWN(va, PTSIZE) + PTSIZE - PGSIZE;
+            continue;
+        }
+        pte = (pte_t*)KADDR(PTE_ADDR(pgdir[PDX(va)])) + PTX(va);
+        if (!(*pte & PTE_P))
+            continue;
+        perm = *pte & PTE_SYSCALL;
+        if (mode == VM_COPY_SHARE_ALL) {
+            if (perm & PTE_COW) {
+                // 先替父进程完成写时复制，之后父子共享这个可写的副本。
+                struct PageInfo *p = page_alloc(0);
+                if (p == NULL) {
+                    r = -E_NO_MEM;
+                    break;
+                }
+                memcpy(page2kva(p), page2kva(pa2page(PTE_ADDR(*pte))), PGSIZE);
+                perm = (perm & ~PTE_COW) | PTE_W;
+                if (page_insert(pgdir, p, (void*)va, perm) != 0) {
+                    page_free(p);
+                    r = -E_NO_MEM;
+                    break;
+                }
+            }
+        } else if (!(perm & PTE_SHARE)) {
+            if (mode == VM_COPY_SHARED)
+                continue;
+            if (perm & (PTE_W|PTE_COW)) {
+                perm = (perm & ~PTE_W) | PTE_COW;
+                // 父进程自己的映射也要改为COW，最后统一刷新TLB。
+                if (*pte & PTE_W) {
+                    *pte = (*pte & ~PTE_W) | PTE_COW;
+                    flush = true;
+                }
+            }
+        }
+        if (page_insert(dste->env_pgdir, pa2page(PTE_ADDR(*pte)), (void*)va, perm) != 0) {
+            r = -E_NO_MEM;
+            break;
+        }
+    }
+
+    // One full flush is much cheaper than an invlpg per page for a
+    // large address space, and curenv's page directory is loaded.
+    if (flush)
+        lcr3(PADDR(pgdir));
+    env_unlock_pair(curenv, dste);
+    return r;
+}
+
+// Check the srcva and perm arguments of an IPC send and record the
+// pages to send in curenv's env_ipc_send_* fields.  Without IPC_VEC in
+// perm, srcva is a single page; with it, srcva points to a struct
+// IpcVec in the caller's memory.
+static int
+ipc_load_msg(void *srcva, unsigned perm)
+{
+    struct IpcSeg *segs = curenv->env_ipc_send_segs;
+    uint32_t i, nsegs, total;
+
+    nsegs = 0;
+    if (perm & IPC_VEC) {
+        // 先把描述符复制到内核中再检查，免得用户（例如另一个线程）在检查之后修改它。
+        if (user_mem_check(curenv, srcva, sizeof(struct IpcVec), PTE_U) < 0)
+            return -E_INVAL;
+        nsegs = ((struct IpcVec *) srcva)->iv_nsegs;
+        if (nsegs > IPC_MAXSEGS)
+            return -E_INVAL;
+        memmove(segs, ((struct IpcVec *) srcva)->iv_segs, nsegs * sizeof(segs[0]));
+        for (i = total = 0; i < nsegs; i++) {
+            if ((uint32_t)segs[i].seg_va >= UTOP || (uint32_t)segs[i].seg_va%PGSIZE != 0
+                || segs[i].seg_npages > IPC_MAXPAGES - total
+                || segs[i].seg_npages > (UTOP - (uint32_t)segs[i].seg_va) / PGSIZE)
+                return -E_INVAL;
+            total += segs[i].seg_npages;
+        }
+    } else if ((uint32_t)srcva < UTOP) {
+        // 调用约定，srcva>=UTOP表示sender不想发送一个页映射。
+        if ((uint32_t)srcva%PGSIZE != 0)
+            return -E_INVAL;
+        segs[0].seg_va = srcva;
+        segs[0].seg_npages = 1;
+        nsegs = 1;
+    }
+    perm &= ~IPC_VEC;
+    if (nsegs > 0 && ((perm&(PTE_P|PTE_U)) != (PTE_P|PTE_U) || (perm&(~PTE_SYSCALL)) != 0))
+        return -E_INVAL;
+    curenv->env_ipc_send_nsegs = nsegs;
+    curenv->env_ipc_send_perm = perm;
+    return 0;
+}
+
+// Hand src's message (its env_ipc_send_* fields and 'value') to dst,
+// which must be blocked in sys_ipc_recv.  Called with both locked; the
+// caller makes dst runnable (or switches to it) while still holding
+// dst's lock, so it can't be freed and reused in between.
+//
+// The pages of the message are mapped at consecutive pages from dst's
+// env_ipc_dstva; pages beyond dst's receive window are not transferred,
+// which is not an error.
+static int
+ipc_deliver(struct Env *src, struct Env *dst, uint32_t value)
+{
+    struct IpcSeg *seg;
+    struct PageInfo *p;
+    pte_t *pte;
+    unsigned perm = src->env_ipc_send_perm;
+    uintptr_t dstva = (uintptr_t) dst->env_ipc_dstva;
+    uint32_t i, j, n, npages;
+
+    // 注意要在检查完sender的所有页之后才能设置dst->env_ipc_recving为0，
+    // 并且先检查完再映射，这样出错时不会只传递了一部分页。
+    for (i = 0; i < src->env_ipc_send_nsegs; i++) {
+        seg = &src->env_ipc_send_segs[i];
+        for (j = 0; j < seg->seg_npages; j++) {
+            p = page_lookup(src->env_pgdir, (void *) ((uintptr_t)seg->seg_va + j*PGSIZE), &pte);
+            if (p == NULL || !(*pte & PTE_P) || (*pte & PTE_PS))
+                return -E_INVAL;
+            if ((perm&PTE_W)!=0 && ((*pte)&PTE_W)==0)
+                return -E_INVAL;
+        }
+    }
+
+    npages = 0;
+    if (dstva < UTOP)
+        npages = MIN(dst->env_ipc_rcvwin, (UTOP - dstva) / PGSIZE);
+    n = 0;
+    for (i = 0; i < src->env_ipc_send_nsegs && n < npages; i++) {
+        seg = &src->env_ipc_send_segs[i];
+        for (j = 0; j < seg->seg_npages && n < npages; j++, n++) {
+            p = page_lookup(src->env_pgdir, (void *) ((uintptr_t)seg->seg_va + j*PGSIZE), NULL);
+            if (page_insert(dst->env_pgdir, p, (void *) (dstva + n*PGSIZE), perm) != 0) {
+                while (n-- > 0)
+                    page_remove(dst->env_pgdir, (void *) (dstva + n*PGSIZE));
+                return -E_NO_MEM;
+            }
+        }
+    }
+
+    // the send succeeds
+    dst->env_ipc_recving = 0;
+    dst->env_ipc_calling = 0;
+    dst->env_ipc_from = src->env_id;
+    dst->env_ipc_value = value;
+    dst->env_ipc_npages = n;
+    dst->env_ipc_perm = n > 0? perm: 0;
+
+    // sched_yield并不会使得返回dst的sys_ipc_recv函数，而会运行env_run，然后进入env_pop_tf，直接恢复dst的Trapframe，
+    // 直接返回用户态库函数继续执行。所以想让dst的sys_ipc_recv返回0，只需设置dst的Trapframe的reg_eax即可。
+    // 然后调用sys_ipc_recv系统调用的用户态库函数就会从%eax中获取返回值。
+    dst->env_tf.tf_regs.reg_eax = 0;
     return 0;
 }
 
+// Hand dst, which is locked and receiving, its pending notifications.
+static void
+ipc_deliver_notify(struct Env *dst)
+{
+    dst->env_ipc_recving = 0;
+    dst->env_ipc_from = 0;
+    dst->env_ipc_value = dst->env_ipc_notify;
+    dst->env_ipc_npages = 0;
+    dst->env_ipc_perm = 0;
+    dst->env_ipc_notify = 0;
+    dst->env_tf.tf_regs.reg_eax = 0;
+}
+
+// Take a pending notification (see sys_ipc_notify), or else the
+// message of the first blocked sender queued on curenv that can be
+// delivered.  Called with curenv locked and marked receiving; returns
+// with curenv still locked.  Returns true if a message was taken.
+//
+// A sender blocked in sys_ipc_call is not woken: it goes straight on
+// to wait for our reply, as if it had called sys_ipc_recv itself.
+static bool
+ipc_recv_queued(void)
+{
+    struct Env *s;
+    int r;
+
+    if (curenv->env_ipc_notify) {
+        ipc_deliver_notify(curenv);
+        return true;
+    }
+    while ((s = curenv->env_ipc_waithead) != NULL) {
+        // 需要同时持有发送者的锁（按地址顺序加锁），然后确认它还在队首。
+        env_unlock(curenv);
+        env_lock_pair(curenv, s);
+        if (curenv->env_ipc_waithead != s) {
+            env_unlock(s);
+            continue;
+        }
+        curenv->env_ipc_waithead = s->env_ipc_waitnext;
+        if (curenv->env_ipc_waittail == s)
+            curenv->env_ipc_waittail = NULL;
+        s->env_ipc_waitingfor = NULL;
+        r = ipc_deliver(s, curenv, s->env_ipc_send_value);
+        if (r == 0 && s->env_ipc_calling) {
+            s->env_ipc_recving = 1;
+            s->env_ipc_dstva = s->env_ipc_call_dstva;
+        } else {
+            // 发送者的sys_ipc_send（或sys_ipc_call）返回r。
+            s->env_ipc_calling = 0;
+            s->env_tf.tf_regs.reg_eax = r;
+            sched_wakeup(s);
+        }
+        env_unlock(s);
+        if (r == 0)
+            return true;
+        // The send failed (e.g. -E_NO_MEM); try the next sender.
+    }
+    return false;
+}
+
+// Park curenv's message (already loaded by ipc_load_msg) at the tail
+// of dst's queue of blocked senders.  Called with both locked; the
+// caller then blocks curenv.
+static void
+ipc_enqueue_sender(struct Env *dst, uint32_t value)
+{
+    curenv->env_ipc_send_value = value;
+    curenv->env_ipc_waitingfor = dst;
+    curenv->env_ipc_waitnext = NULL;
+    if (dst->env_ipc_waittail)
+        dst->env_ipc_waittail->env_ipc_waitnext = curenv;
+    else
+        dst->env_ipc_waithead = curenv;
+    dst->env_ipc_waittail = curenv;
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -297,6 +820,11 @@ sys_page_unmap(envid_t envid, void *va)
 //
 // If the sender wants to send a page but the receiver isn't asking for one,
 // then no page mapping is transferred, but no error occurs.
+//
+// If perm includes IPC_VEC, srcva instead points to a struct IpcVec
+// describing up to IPC_MAXSEGS page ranges, IPC_MAXPAGES pages in all,
+// which are mapped with 'perm' into the receiver's window in order (as
+// much of them as fits), and env_ipc_npages says how many were mapped.
 // The ipc only happens when no errors occur.
 //
 // Returns 0 on success, < 0 on error.
@@ -312,51 +840,174 @@ sys_page_unmap(envid_t envid, void *va)
 //		address space.
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
 //		current environment's address space.
+//	-E_INVAL if a struct IpcVec is bad, or one of its pages is
+//		unmapped or (with PTE_W) read-only.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
 //		address space.
+//
+// The receiver's env lock is the rendezvous point: it orders this send
+// against sys_ipc_recv and against other senders.
 static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	// LAB 4: Your code here.
 	// panic("sys_ipc_try_send not implemented");
     struct Env *dste;
-    struct PageInfo *p;
-    pte_t *pte;
+    int r;
     // 第三个参数为0，即不要求curenv就是dste，也不要求curenv是dste的父Env。
     if (envid2env(envid, &dste, 0) != 0)
         return -E_BAD_ENV;
+    if ((r = ipc_load_msg(srcva, perm)) < 0)
+        return r;
+    if (lock_env_pair(curenv, 0, dste, envid) != 0)
+        return -E_BAD_ENV;
     if (dste->env_ipc_recving == 0)
-        return -E_IPC_NOT_RECV;
-    // 注意不能在这里就设置dste->env_ipc_recving为0，因为下面还要检查sender是否合法。
-    // 调用约定，srcva>=UTOP表示sender不想发送一个页映射。
-    if ((uint32_t)srcva < UTOP) {
-        if ((uint32_t)srcva%PGSIZE != 0)
-            return -E_INVAL;
-        if ((perm&(PTE_P|PTE_U)) != (PTE_P|PTE_U) || (perm&(~PTE_SYSCALL)) != 0)
-            return -E_INVAL;
-        if ((p=page_lookup(curenv->env_pgdir, srcva, &pte)) == NULL)
-            return -E_INVAL;
-        if ((perm&PTE_W)!=0 && ((*pte)&PTE_W)==0)
-            return -E_INVAL;
-        if ((uint32_t)(dste->env_ipc_dstva) < UTOP) {
-            if (page_insert(dste->env_pgdir, p, dste->env_ipc_dstva, perm) != 0)
-                return -E_NO_MEM;
-        }
+        r = -E_IPC_NOT_RECV;
+    else if ((r = ipc_deliver(curenv, dste, value)) == 0)
+        sched_wakeup(dste); // 这样sched_yield就会在某一时刻调度dste运行。
+    env_unlock_pair(curenv, dste);
+    return r;
+}
+
+// Send 'value' (and the page at 'srcva', as for sys_ipc_try_send) to
+// envid, blocking until it is received.  If envid isn't waiting in
+// sys_ipc_recv, the caller is put at the tail of envid's queue of
+// blocked senders and sys_ipc_recv hands the message over directly,
+// so senders are served in FIFO order and don't spin.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_try_send, except -E_IPC_NOT_RECV, plus:
+//	-E_BAD_ENV if envid is destroyed while we are waiting.
+//	-E_INVAL if envid is the caller.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+    struct Env *dste;
+    int r;
+
+    if (envid2env(envid, &dste, 0) != 0)
+        return -E_BAD_ENV;
+    if (dste == curenv)
+        return -E_INVAL; // 给自己发送将永远阻塞。
+    if ((r = ipc_load_msg(srcva, perm)) < 0)
+        return r;
+    if (lock_env_pair(curenv, 0, dste, envid) != 0)
+        return -E_BAD_ENV;
+    if (dste->env_ipc_recving) {
+        if ((r = ipc_deliver(curenv, dste, value)) == 0)
+            sched_wakeup(dste);
+        env_unlock_pair(curenv, dste);
+        return r;
     }
 
-    // the send succeeds
-    dste->env_ipc_recving = 0;
-    dste->env_ipc_from = curenv->env_id;
-    dste->env_ipc_value = value;
-    dste->env_ipc_perm = (uint32_t)srcva<UTOP? perm: 0;
+    // 接收者还没有准备好：把自己挂到接收者的等待队列尾部，然后阻塞。
+    // The receiver sets our return value when it takes the message.
+    ipc_enqueue_sender(dste, value);
+    sched_block(curenv);
+    env_unlock_pair(curenv, dste);
+    sched_yield();
+}
 
-    // sched_yield并不会使得返回dste的sys_ipc_recv函数，而会运行env_run，然后进入env_pop_tf，直接恢复dste的Trapframe，
-    // 直接返回用户态库函数继续执行。所以想让dste的sys_ipc_recv返回0，只需设置dste的Trapframe的reg_eax即可。
-    // 然后调用sys_ipc_recv系统调用的用户态库函数就会从%eax中获取返回值。
-    dste->env_tf.tf_regs.reg_eax = 0;
-    dste->env_status = ENV_RUNNABLE; // 这样sched_yield就会在某一时刻调度dste运行。
+// Send 'value' (and the page at 'srcva') to envid as sys_ipc_send
+// does, then wait for the reply as sys_ipc_recv(dstva) does, in one
+// system call.  If envid was waiting for us, switch straight to it on
+// this CPU instead of going through the run queues, so a client/server
+// round trip costs two system calls and two context switches.
+//
+// Like sys_ipc_recv, the reply may come from any environment, but
+// notifications stay pending until the next plain receive.
+//
+// Returns 0 once a reply has arrived, < 0 on error.  Errors are those
+// of sys_ipc_send and sys_ipc_recv; if the send fails nothing is
+// received.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm, void *dstva)
+{
+    struct Env *dste;
+    int r, handoff;
 
-    return 0;
+    if (envid2env(envid, &dste, 0) != 0)
+        return -E_BAD_ENV;
+    if (dste == curenv)
+        return -E_INVAL;
+    if ((r = ipc_load_msg(srcva, perm)) < 0)
+        return r;
+    if ((uint32_t)dstva<UTOP && (uint32_t)dstva%PGSIZE!=0)
+        return -E_INVAL;
+    if (lock_env_pair(curenv, 0, dste, envid) != 0)
+        return -E_BAD_ENV;
+    if (!dste->env_ipc_recving) {
+        // 服务端正忙：排队，等它在sys_ipc_recv中取走消息后直接进入接收状态。
+        ipc_enqueue_sender(dste, value);
+        curenv->env_ipc_calling = 1;
+        curenv->env_ipc_call_dstva = dstva;
+        sched_block(curenv);
+        env_unlock_pair(curenv, dste);
+        sched_yield();
+    }
+
+    if ((r = ipc_deliver(curenv, dste, value)) < 0) {
+        env_unlock_pair(curenv, dste);
+        return r;
+    }
+    curenv->env_ipc_recving = 1;
+    curenv->env_ipc_calling = 1;
+    curenv->env_ipc_dstva = dstva;
+    if (!(handoff = sched_claim(dste)))
+        sched_wakeup(dste);
+    sched_block(curenv);
+    env_unlock_pair(curenv, dste);
+    if (handoff)
+        env_run(dste);
+    sched_yield();
+}
+
+// Reply to envid with 'value' (and the page at 'srcva'), then wait for
+// the next message as sys_ipc_recv(dstva) does.  This is the server
+// half of sys_ipc_call.
+//
+// The reply never blocks: if envid no longer exists or isn't waiting
+// for a message, it is silently dropped.  If no other sender is
+// queued on us, switch straight to envid on this CPU.
+//
+// Returns 0 once the next message has arrived, < 0 on error.  Errors:
+//	-E_INVAL if srcva < UTOP and srcva or perm is bad (as for
+//		sys_ipc_try_send), or dstva < UTOP but not page-aligned.
+static int
+sys_ipc_reply_recv(envid_t envid, uint32_t value, void *srcva, unsigned perm, void *dstva)
+{
+    struct Env *cli;
+    int r, handoff = 0;
+
+    if ((r = ipc_load_msg(srcva, perm)) < 0)
+        return r;
+    if ((uint32_t)dstva<UTOP && (uint32_t)dstva%PGSIZE!=0)
+        return -E_INVAL;
+
+    if (envid2env(envid, &cli, 0) == 0 && cli != curenv
+        && lock_env_pair(curenv, 0, cli, envid) == 0) {
+        if (cli->env_ipc_recving
+            && ipc_deliver(curenv, cli, value) == 0) {
+            // 还有别的客户端在排队（或有通知未取）时，不能直接切换过去，否则它们要多等一轮。
+            if (curenv->env_ipc_waithead || curenv->env_ipc_notify
+                || !(handoff = sched_claim(cli)))
+                sched_wakeup(cli);
+        }
+        env_unlock(cli);
+    } else
+        env_lock(curenv);
+
+    curenv->env_ipc_recving = 1;
+    curenv->env_ipc_dstva = dstva;
+    if (!handoff && ipc_recv_queued()) {
+        env_unlock(curenv);
+        return 0;
+    }
+    sched_block(curenv);
+    env_unlock(curenv);
+    if (handoff)
+        env_run(cli);
+    sched_yield();
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -366,7 +1017,11 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
-// This function only returns on error, but the system call will eventually
+// If a sender is already blocked in sys_ipc_send, take its message
+// and return right away instead.
+//
+// This function only returns on error, or if a blocked sender's
+// message was taken, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
@@ -375,17 +1030,99 @@ sys_ipc_recv(void *dstva)
 {
 	// LAB 4: Your code here.
 	// panic("sys_ipc_recv not implemented");
+
     // 调用约定，如果dstva>=UTOP，表示receiver不想接受一个页映射。
     if ((uint32_t)dstva<UTOP && (uint32_t)dstva%PGSIZE!=0)
         return -E_INVAL;
 
+    env_lock(curenv);
     curenv->env_ipc_recving = 1;
     curenv->env_ipc_dstva = dstva; // datva可能<UTOP也可能>=UTOP，表示receiver想或不想接受一个页映射。
-    curenv->env_status = ENV_NOT_RUNNABLE; // 让sched_yield不要调度当前receiver执行，除非sender将receiver标记为ENV_RUNNABLE。
+    if (ipc_recv_queued()) {
+        env_unlock(curenv);
+        return 0;
+    }
+    sched_block(curenv); // 让sched_yield不要调度当前receiver执行，除非sender将receiver标记为ENV_RUNNABLE。
+    env_unlock(curenv);
     sched_yield(); // 不会直接返回到这里。
 	// return 0;
 }
 
+// Send the notification 'bits' to envid.  Notifications never block
+// and carry no page: if envid is waiting in sys_ipc_recv (but not for
+// the reply to a sys_ipc_call), it receives 'bits' as the value with
+// env_ipc_from set to 0, which no environment has.  Otherwise the bits
+// are or'ed into its pending notifications, and its next receive
+// takes them all at once, before any queued sender.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//	-E_INVAL if bits is 0.
+//
+// Also used by the kernel itself to forward hardware interrupts
+// (see sys_irq_notify).
+int
+ipc_notify(envid_t envid, uint32_t bits)
+{
+    struct Env *e;
+
+    if (bits == 0)
+        return -E_INVAL;
+    if (envid2env(envid, &e, 0) != 0 || lock_env(e, envid) != 0)
+        return -E_BAD_ENV;
+    e->env_ipc_notify |= bits;
+    if (e->env_ipc_recving && !e->env_ipc_calling) {
+        ipc_deliver_notify(e);
+        sched_wakeup(e);
+    }
+    env_unlock(e);
+    return 0;
+}
+
+static int
+sys_ipc_notify(envid_t envid, uint32_t bits)
+{
+    return ipc_notify(envid, bits);
+}
+
+// Ask for the notification 'bits' (see sys_ipc_notify) every time
+// hardware interrupt 'irq' fires, so a user-level driver can sleep in
+// sys_ipc_recv instead of polling its device.  IRQ_TIMER means every
+// tick of CPU 0's timer.  The kernel acknowledges
+// the interrupt controller; clearing the device's own interrupt is the
+// driver's job.  bits == 0 stops the notifications and masks the IRQ
+// again.  Only one environment listens to an IRQ at a time, and the
+// listener goes away with it.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if irq is out of range or handled by the kernel.
+//	-E_BAD_ENV if the caller has no I/O privilege, or another
+//		environment is listening to irq.
+static int
+sys_irq_notify(uint32_t irq, uint32_t bits)
+{
+    // 只有拥有I/O权限的进程（即文件系统进程）才能驱动设备。
+    if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3)
+        return -E_BAD_ENV;
+    return irq_set_listener(irq, curenv->env_id, bits);
+}
+
+// Make each subsequent receive accept up to 'npages' pages, mapped at
+// consecutive addresses starting from its dstva.  The window is one
+// page by default.
+//
+// Returns 0 on success, -E_INVAL if npages is 0 or above IPC_MAXPAGES.
+static int
+sys_ipc_set_rcvwin(uint32_t npages)
+{
+    if (npages == 0 || npages > IPC_MAXPAGES)
+        return -E_INVAL;
+    env_lock(curenv);
+    curenv->env_ipc_rcvwin = npages;
+    env_unlock(curenv);
+    return 0;
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -410,8 +1147,17 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
     case SYS_env_set_status: return sys_env_set_status(a1, a2);
     case SYS_env_set_pgfault_upcall: return sys_env_set_pgfault_upcall(a1, (void*)a2);
     case SYS_ipc_try_send: return sys_ipc_try_send(a1, a2, (void*)a3, a4);
-    case SYS_ipc_recv: sys_ipc_recv((void*)a1); // return 0;
+    case SYS_ipc_send: return sys_ipc_send(a1, a2, (void*)a3, a4);
+    case SYS_ipc_recv: return sys_ipc_recv((void*)a1);
+    case SYS_ipc_call: return sys_ipc_call(a1, a2, (void*)a3, a4, (void*)a5);
+    case SYS_ipc_reply_recv: return sys_ipc_reply_recv(a1, a2, (void*)a3, a4, (void*)a5);
+    case SYS_ipc_set_rcvwin: return sys_ipc_set_rcvwin(a1);
+    case SYS_ipc_notify: return sys_ipc_notify(a1, a2);
+    case SYS_irq_notify: return sys_irq_notify(a1, a2);
     case SYS_env_set_trapframe: return sys_env_set_trapframe(a1, (struct Trapframe*)a2);
+    case SYS_vm_copy: return sys_vm_copy(a1, a2, a3, a4);
+    case SYS_env_set_type: return sys_env_set_type(a1, a2);
+    case SYS_page_clear: return sys_page_clear(a1, (void*)a2, a3);
 	default:
 		return -E_INVAL;
 	}
@@ -1,6 +1,7 @@
 #include <inc/mmu.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/error.h>
 
 #include <kern/pmap.h>
 #include <kern/trap.h>
@@ -65,6 +66,66 @@ static const char *trapname(int trapno)
 	return "(unknown trap)";
 }
 
+// User-level drivers listening to hardware interrupts (sys_irq_notify).
+static struct {
+	envid_t envid;		// Listener, or 0
+	uint32_t bits;		// Notification to send it
+} irq_listeners[MAX_IRQS];
+static struct spinlock irq_lock = { .name = "irq_lock" };	// Protects irq_listeners
+
+// Mask or unmask irq at the 8259A.  IRQ_TIMER comes from CPU 0's LAPIC
+// timer instead, which always runs.
+static void
+irq_mask(uint32_t irq, bool masked)
+{
+	if (irq == IRQ_TIMER)
+		return;
+	if (masked)
+		irq_setmask_8259A(irq_mask_8259A | (1 << irq));
+	else
+		irq_setmask_8259A(irq_mask_8259A & ~(1 << irq) & ~(1 << IRQ_SLAVE));
+}
+
+// Make envid the listener of irq, or remove the listener if bits is 0.
+int
+irq_set_listener(uint32_t irq, envid_t envid, uint32_t bits)
+{
+	struct Env *e;
+	int r = 0;
+
+	if (irq >= MAX_IRQS || irq == IRQ_KBD || irq == IRQ_SLAVE
+	    || irq == IRQ_SERIAL || irq == IRQ_SPURIOUS)
+		return -E_INVAL;
+	spin_lock(&irq_lock);
+	if (irq_listeners[irq].envid && irq_listeners[irq].envid != envid
+	    && envid2env(irq_listeners[irq].envid, &e, 0) == 0)
+		r = -E_BAD_ENV;
+	else if (bits) {
+		irq_listeners[irq].envid = envid;
+		irq_listeners[irq].bits = bits;
+		irq_mask(irq, 0);
+	} else {
+		irq_listeners[irq].envid = 0;
+		irq_mask(irq, 1);
+	}
+	spin_unlock(&irq_lock);
+	return r;
+}
+
+// Forward irq to its listener.  A listener that has exited is dropped
+// and the IRQ masked again.
+static void
+irq_deliver(int irq)
+{
+	irq_eoi_8259A(irq);
+	spin_lock(&irq_lock);
+	if (irq_listeners[irq].envid
+	    && ipc_notify(irq_listeners[irq].envid, irq_listeners[irq].bits) < 0) {
+		irq_listeners[irq].envid = 0;
+		irq_mask(irq, 1);
+	}
+	spin_unlock(&irq_lock);
+}
 
 void
 trap_init(void)
@@ -219,6 +280,9 @@ trap_dispatch(struct Trapframe *tf)
 	// LAB 4: Your code here.
     if (tf->tf_trapno == IRQ_OFFSET+IRQ_TIMER) {
         lapic_eoi();
+        // 每个CPU都有自己的时钟中断，只转发CPU 0的。
+        if (cpunum() == 0)
+            irq_deliver(IRQ_TIMER);
         sched_yield();
         // return;
         // sched_yield不会返回这里，当下一次该进程被调度执行时，不会返回这里，而是恢复env->env_tf，然后到用户态继续执行。
@@ -235,6 +299,22 @@ trap_dispatch(struct Trapframe *tf)
         return;
     }
 
+	// Another CPU changed a page table we may have cached entries of.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB) {
+		lapic_eoi();
+		tlb_flush_ack();
+		return;
+	}
+
+	// Hand any other device interrupt to the user-level driver
+	// listening to it.  There is nothing to return to if curenv was
+	// not running; trap() then picks something to run, which may be
+	// the driver just woken.
+	if (tf->tf_trapno >= IRQ_OFFSET && tf->tf_trapno < IRQ_OFFSET + MAX_IRQS) {
+		irq_deliver(tf->tf_trapno - IRQ_OFFSET);
+		return;
+	}
+
 	// Unexpected trap: The user process or the kernel has a bug.
 	print_trapframe(tf);
 	if (tf->tf_cs == GD_KT)
@@ -257,10 +337,8 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+	// Note that we are no longer halted in sched_yield()
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -268,16 +346,14 @@ trap(struct Trapframe *tf)
 
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// LAB 4: Your code here.
+		// There is no big kernel lock: the kernel data structures
+		// this trap touches are protected by their own locks.
 		assert(curenv);
-        lock_kernel();
 
 		// Garbage collect if current enviroment is a zombie
+		// (env_free also clears curenv)
 		if (curenv->env_status == ENV_DYING) {
 			env_free(curenv);
-			curenv = NULL;
 			sched_yield();
 		}
 
@@ -296,6 +372,11 @@ trap(struct Trapframe *tf)
 	// Dispatch based on what type of trap occurred
 	trap_dispatch(tf);
 
+	// A system call that changed a page table shared with environments
+	// on other CPUs isn't over until their TLBs are flushed.
+	if (thiscpu->cpu_tlb_pending)
+		tlb_shootdown();
+
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
 	// if doing so makes sense.
@@ -55,7 +55,7 @@ fd_alloc(struct Fd **fd_store)
 
 	for (i = 0; i < MAXFD; i++) {
 		fd = INDEX2FD(i);
-		if ((uvpd[PDX(fd)] & PTE_P) == 0 || (uvpt[PGNUM(fd)] & PTE_P) == 0) {
+		if ((get_pte(fd) & PTE_P) == 0) {
 			*fd_store = fd;
 			return 0;
 		}
@@ -81,7 +81,7 @@ fd_lookup(int fdnum, struct Fd **fd_store)
 		return -E_INVAL;
 	}
 	fd = INDEX2FD(fdnum);
-	if (!(uvpd[PDX(fd)] & PTE_P) || !(uvpt[PGNUM(fd)] & PTE_P)) {
+	if (!(get_pte(fd) & PTE_P)) {
 		if (debug)
 			cprintf("[%08x] closed fd %d\n", thisenv->env_id, fdnum);
 		return -E_INVAL;
@@ -186,10 +186,10 @@ dup(int oldfdnum, int newfdnum)
 	ova = fd2data(oldfd);
 	nva = fd2data(newfd);
 
-	if ((uvpd[PDX(ova)] & PTE_P) && (uvpt[PGNUM(ova)] & PTE_P))
-		if ((r = sys_page_map(0, ova, 0, nva, uvpt[PGNUM(ova)] & PTE_SYSCALL)) < 0)
+	if (get_pte(ova) & PTE_P)
+		if ((r = sys_page_map(0, ova, 0, nva, get_pte(ova) & PTE_SYSCALL)) < 0)
 			goto err;
-	if ((r = sys_page_map(0, oldfd, 0, newfd, uvpt[PGNUM(oldfd)] & PTE_SYSCALL)) < 0)
+	if ((r = sys_page_map(0, oldfd, 0, newfd, get_pte(oldfd) & PTE_SYSCALL)) < 0)
 		goto err;
 
 	return newfdnum;
@@ -9,6 +9,37 @@
 // server可能将返回数据写入这个页中，由于参数携带的信息已经使用完了，可以随意覆盖参数。
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+static envid_t fsenv;
+static envid_t fsenv_client;	// Whom fsenv was picked for
+
+// The file server runs as several worker environments (fs/serv.c), all
+// of type ENV_TYPE_FS.  Each client sticks to one of them, picked by its
+// own envid, so that clients spread over the workers.  A forked child
+// picks again.
+static envid_t
+fsenv_pick(void)
+{
+	int i, n = 0;
+
+	if (fsenv != 0 && fsenv_client == thisenv->env_id)
+		return fsenv;
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_type == ENV_TYPE_FS && envs[i].env_status != ENV_FREE)
+			n++;
+	if (n == 0)
+		return 0;
+	n = ENVX(thisenv->env_id) % n;
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_type == ENV_TYPE_FS && envs[i].env_status != ENV_FREE
+		    && n-- == 0) {
+			fsenv = envs[i].env_id;
+			fsenv_client = thisenv->env_id;
+			return fsenv;
+		}
+	// A worker went away while we looked.
+	return ipc_find_env(ENV_TYPE_FS);
+}
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
@@ -18,17 +49,33 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
-	if (fsenv == 0)
-		fsenv = ipc_find_env(ENV_TYPE_FS);
-
 	static_assert(sizeof(fsipcbuf) == PGSIZE);
 
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL); // sender可能发送一个页映射，第二个参数指定该页映射要写入那个va对应的pte。
+	// 一次系统调用完成发送请求和等待回复，内核会直接切换到文件系统进程。
+	// The server may reply with a page mapping, which goes at dstva.
+	return ipc_call(fsenv_pick(), type, &fsipcbuf, PTE_P | PTE_W | PTE_U,
+			dstva, NULL);
+}
+
+// Like fsipc, but also lend the file server the pages holding
+// buf[0, n), which it finds right after the request page, mapped with
+// 'perm'.  The buffer's offset into its first page goes in *bufoff.
+static int
+fsipc_buf(unsigned type, const void *buf, size_t n, int perm, size_t *bufoff)
+{
+	struct IpcVec iv;
+	uintptr_t va = ROUNDDOWN((uintptr_t) buf, PGSIZE);
+
+	*bufoff = (uintptr_t) buf - va;
+	iv.iv_nsegs = 2;
+	iv.iv_segs[0].seg_va = &fsipcbuf;
+	iv.iv_segs[0].seg_npages = 1;
+	iv.iv_segs[1].seg_va = (void *) va;
+	iv.iv_segs[1].seg_npages = (ROUNDUP((uintptr_t) buf + n, PGSIZE) - va) / PGSIZE;
+	return ipc_call(fsenv_pick(), type, &iv, perm | IPC_VEC, NULL, NULL);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -106,6 +153,69 @@ devfile_flush(struct Fd *fd)
 	return fsipc(FSREQ_FLUSH, NULL);
 }
 
+// mmap's page fault handler sends its requests from here rather than
+// from fsipcbuf, which the faulting code may be in the middle of
+// filling in.
+static union Fsipc fsipcmapbuf __attribute__((aligned(PGSIZE)));
+
+// Send FSREQ_READMAP, with 'req' as the request page: the file server
+// maps its block cache pages holding [offset, offset + n) of file
+// 'fileid' over [dstva, dstva + n), copy-on-write, so that the first
+// write to one of them gets us a private copy.  dstva, offset and n are
+// page-aligned.  Returns the number of bytes of the file mapped.
+static int
+fsipc_readmap(union Fsipc *req, int fileid, off_t offset, void *dstva, size_t n)
+{
+	int r;
+
+	set_cow_handler();
+	req->readmap.req_fileid = fileid;
+	req->readmap.req_n = n;
+	req->readmap.req_offset = offset;
+	// 回复的页映射在dstva开始的连续页上。
+	if ((r = sys_ipc_set_rcvwin(n / PGSIZE)) < 0)
+		return r;
+	r = ipc_call(fsenv_pick(), FSREQ_READMAP, req, PTE_P | PTE_W | PTE_U,
+		     dstva, NULL);
+	sys_ipc_set_rcvwin(1);
+	return r;
+}
+
+// Map the file server's copy of [offset, offset + n) of the file open
+// as fdnum at dstva, copy-on-write, without moving the seek position.
+// dstva, offset and n must be page-aligned; at most FSIPC_MAXIO bytes
+// are mapped.  This is how mmap reads files.
+// Returns the number of bytes of the file mapped (pages past its end
+// are left alone), or < 0 on error.
+int
+file_readmap(int fdnum, off_t offset, void *dstva, size_t n)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	if ((uintptr_t) dstva % PGSIZE != 0 || offset % PGSIZE != 0 || n % PGSIZE != 0)
+		return -E_INVAL;
+	return fsipc_readmap(&fsipcmapbuf, fd->fd_file.id, offset, dstva,
+			     MIN(n, FSIPC_MAXIO));
+}
+
+// Does [buf, buf + n) take in any page shared with other environments?
+// Reads into those must keep going to the shared page.
+static bool
+buf_is_shared(const void *buf, size_t n)
+{
+	uintptr_t va;
+
+	for (va = ROUNDDOWN((uintptr_t) buf, PGSIZE); va < (uintptr_t) buf + n; va += PGSIZE)
+		if ((get_pte((void *) va) & (PTE_P|PTE_SHARE)) == (PTE_P|PTE_SHARE))
+			return 1;
+	return 0;
+}
+
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
 //
 // Returns:
@@ -118,10 +228,37 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// filling fsipcbuf.read with the request arguments.  The
 	// bytes read will be written back to fsipcbuf by the file
 	// system server.
+	//
+	// Reads bigger than a page lend the server buf itself instead,
+	// so up to FSIPC_MAXIO bytes take one round trip and one copy.
+	// Whole pages at a block boundary of the file take no copy at
+	// all: the server maps its block cache pages over them.
 	int r;
+	uintptr_t va;
 
+	n = MIN(n, FSIPC_MAXIO);
+	if (n >= PGSIZE && (uintptr_t) buf % PGSIZE == 0 && fd->fd_offset % BLKSIZE == 0
+	    && !buf_is_shared(buf, ROUNDDOWN(n, PGSIZE))) {
+		if ((r = fsipc_readmap(&fsipcbuf, fd->fd_file.id, fd->fd_offset,
+				       buf, ROUNDDOWN(n, PGSIZE))) > 0)
+			fd->fd_offset += r;
+		return r;
+	}
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
+	if (n > PGSIZE) {
+		// 服务端要写这些页，先让它们在我们这里可写（例如触发COW）。
+		for (va = ROUNDDOWN((uintptr_t) buf, PGSIZE); va < (uintptr_t) buf + n; va += PGSIZE)
+			if ((get_pte((void *) va) & (PTE_P|PTE_W)) != (PTE_P|PTE_W)) {
+				volatile char *p = (char *) MAX(va, (uintptr_t) buf);
+				*p = *p;
+			}
+		if ((r = fsipc_buf(FSREQ_READ, buf, n, PTE_P | PTE_W | PTE_U,
+				   &fsipcbuf.read.req_bufoff)) < 0)
+			return r;
+		assert(r <= n);
+		return r;
+	}
 	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
 		return r;
 	assert(r <= n);
@@ -145,14 +282,30 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// bytes than requested.
 	// LAB 5: Your code here
 	// panic("devfile_write not implemented");
+	//
+	// Writes that don't fit in req_buf lend the server buf itself
+	// (read-only), up to FSIPC_MAXIO bytes per round trip.
+    int r;
+	uintptr_t va;
+
+	n = MIN(n, FSIPC_MAXIO);
 	fsipcbuf.write.req_fileid = fd->fd_file.id;
 	fsipcbuf.write.req_n = n;
-    memcpy(fsipcbuf.write.req_buf, buf, n);
-    int r;
-	if ((r = fsipc(FSREQ_WRITE, NULL)) < 0)
+	if (n > sizeof(fsipcbuf.write.req_buf)) {
+		// Lent pages must be mapped: fault in any that aren't yet
+		// (those of a mapped file, say).
+		for (va = ROUNDDOWN((uintptr_t) buf, PGSIZE); va < (uintptr_t) buf + n; va += PGSIZE)
+			if (!(get_pte((void *) va) & PTE_P))
+				(void) *(volatile const char *) MAX(va, (uintptr_t) buf);
+		r = fsipc_buf(FSREQ_WRITE, buf, n, PTE_P | PTE_U,
+			      &fsipcbuf.write.req_bufoff);
+	} else {
+		memmove(fsipcbuf.write.req_buf, buf, n);
+		r = fsipc(FSREQ_WRITE, NULL);
+	}
+	if (r < 0)
 		return r;
 	assert(r <= n);
-	assert(r <= PGSIZE);
 	return r;
 }
 
@@ -180,6 +333,18 @@ devfile_trunc(struct Fd *fd, off_t newsize)
 }
 
 
+// Fetch the file server's counters.
+int
+fs_stats(struct FsStats *st)
+{
+	int r;
+
+	if ((r = fsipc(FSREQ_STATS, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.statsRet;
+	return 0;
+}
+
 // Synchronize disk with buffer cache
 int
 sync(void)
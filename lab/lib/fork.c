@@ -3,35 +3,17 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
+// PTE_COW (inc/mmu.h) marks copy-on-write page table entries.
 // It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
 
 extern void _pgfault_upcall(void);
 
-// 由于只需读（且只能读）pte，所以不需要返回指针。
-static pte_t get_pte(void *va) {
-    uint32_t a = (uint32_t)va;
-    if ((uvpd[PDX(a)]&PTE_P) == 0)
-        // XXX 这里要注意一个点，不能返回-1，-1的补码表示为全1，这样的话caller将返回的pte and 任何标志如PTE_P都会得到非0。
-        // 更重要的一个点是，pte_t被定义为无符号数，这样的话-1会被转换为很大的无符号数，会逃过caller的`pte<0`的检查。
-        // 返回0符合逻辑，因为PTE_P位被复位了，表示该pte不存在。
-        return 0;
-    return uvpt[PGNUM(a)];
-    // 在JOS中，V设置为0x3BD。
-    // PDX=V, PTX!=V，这样的地址通过翻译可以form 4MB的物理地址空间。
-    // uvpt, PDX=V, PTX=0，这样uvpt通过翻译得到第0个页表的物理起始地址。
-    // uvpt[x]，等价于*(pte_t*)(uvpt+x<<2)。
-    // 若x<1024，则uvpt[x]可以索引第0个页表中的pte。
-    // 若x>=1024，则权大于等于1024的位会加到uvpt的PTX部分，从而从页目录中选中不同的页表，权小于1024的位则索引选中的页表中的pte。
-    // 也就是可以认为，uvpt构成了“连续”的1024个页表的数组，此时我们只需要用VPN直接索引即可得到va对应的pte。
-}
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
-// map in our own private writable copy.
+// map in our own private writable copy.  Other faults are passed on to
+// the next handler in the chain (see add_pgfault_handler).
 //
-static void
+static int
 pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
@@ -47,10 +29,8 @@ pgfault(struct UTrapframe *utf)
 	// LAB 4: Your code here.
     pte_t pte = get_pte(addr);
     // pgfault() checks that the fault is a write (check for FEC_WR in the error code) and that the PTE for the page is marked PTE_COW. If not, panic.
-    if(!(err&FEC_WR) || !(pte&PTE_COW)) {
-        cprintf("[%08x] user fault va %08x ip %08x\n", sys_getenvid(), addr, utf->utf_eip);
-        panic("!(err&FEC_WR) || !(pte&PTE_COW)");
-    }
+    if(!(err&FEC_WR) || !(pte&PTE_COW))
+        return 0;
 
 	// Allocate a new page, map it at a temporary location (PFTEMP),
 	// copy the data from the old page to the new page, then move the new
@@ -72,6 +52,19 @@ pgfault(struct UTrapframe *utf)
 		panic("sys_page_unmap: %e", r);
 
 	// panic("pgfault not implemented");
+	return 1;
+}
+
+// Install pgfault in front of any other handlers, which keep getting
+// the other faults.  Anyone who maps PTE_COW pages calls this, not
+// just fork.
+void
+set_cow_handler(void)
+{
+	int r;
+
+	if ((r = add_pgfault_handler(pgfault)) < 0)
+		panic("add_pgfault_handler: %e", r);
 }
 
 //
@@ -85,7 +78,7 @@ pgfault(struct UTrapframe *utf)
 // Returns: 0 on success, < 0 on error.
 // It is also OK to panic on error.
 //
-int
+static int
 duppage(envid_t envid, unsigned vpn)
 {
 	int r;
@@ -99,7 +92,11 @@ duppage(envid_t envid, unsigned vpn)
     if (pte==0 || !(pte&PTE_P))
 	    // panic("pte does not exist");
         return -E_INVAL;
-    if ((pte&(PTE_W|PTE_COW)) != 0) {
+    if (pte&PTE_SHARE) {
+        // 共享页：直接以相同权限映射到子进程中。
+        if ((r=sys_page_map(0, va, envid, va, pte&PTE_SYSCALL)) != 0)
+	        panic("sys_page_map fails: %e", r);
+    } else if ((pte&(PTE_W|PTE_COW)) != 0) {
         if ((r=sys_page_map(0, va, envid, va, PTE_U|PTE_P|PTE_COW)) != 0)
 	        panic("sys_page_map fails: %e", r);
         if ((r=sys_page_map(0, va, 0, va, PTE_U|PTE_P|PTE_COW)) != 0)
@@ -138,7 +135,7 @@ fork(void)
 	extern unsigned char end[];
 
     // Set up our page fault handler appropriately.
-    set_pgfault_handler(pgfault);
+    set_cow_handler();
 
 	envid = sys_exofork();
 	if (envid < 0)
@@ -166,14 +163,12 @@ fork(void)
     // 看得到自己的_pgfault_handler已经被设置和父进程一样了。所以这里只需要设置子进程独立的Env结构体的env_pgfault_upcall成员即可。
     sys_env_set_pgfault_upcall(envid, _pgfault_upcall);
 
-    // 从0到UTOP之间的页，若父进程有映射的话，就复制给子进程。复制的细节由duppage考虑和实现。
-    for(int i=0; i<PGNUM(UTOP); i++) {
-        // 跳过用户异常栈
-        if(i == PGNUM(UXSTACKTOP-PGSIZE))
-            continue;
-        duppage(envid, i);
-    }
+    // 从0到UTOP之间的页，若父进程有映射的话，就复制给子进程。
+    // 复制的细节与duppage相同，但由内核在一次系统调用中完成，而不是每页两次系统调用，
+    // 并且跳过不存在的页表。用户异常栈位于UXSTACKTOP-PGSIZE，不在复制范围内。
     // 用户栈也是copy on write的。
+    if ((r = sys_vm_copy(envid, 0, (void*)(UXSTACKTOP-PGSIZE), VM_COPY_COW)) < 0)
+	    panic("sys_vm_copy: %e", r);
 
 	// Start the child environment running
 	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
@@ -182,10 +177,94 @@ fork(void)
     return envid; // 父进程返回子进程id
 }
 
-// Challenge!
+// Regions whose page tables sfork() shares (see sfork_share).
+#define SFORK_NSHARE	8
+
+static struct {
+	uintptr_t start, end;
+} sfork_shared[SFORK_NSHARE];
+static int sfork_nshared;
+
+//
+// Have the threads made by later sfork()s share the page tables that
+// map [start, end), rounded out to PTSIZE, with us.  Then pages that we
+// or any of them map there later are seen by all, not just the ones
+// mapped at the time of the sfork.
+//
+// Returns 0 on success, -E_NO_MEM if SFORK_NSHARE regions are
+// registered already.
+//
 int
+sfork_share(void *start, void *end)
+{
+	if (sfork_nshared == SFORK_NSHARE)
+		return -E_NO_MEM;
+	sfork_shared[sfork_nshared].start = ROUNDDOWN((uintptr_t) start, PTSIZE);
+	sfork_shared[sfork_nshared].end = ROUNDUP((uintptr_t) end, PTSIZE);
+	sfork_nshared++;
+	return 0;
+}
+
+//
+// Shared-memory fork: create a thread that shares our whole address
+// space except
+//   - the stack (one page below USTACKTOP), which is copy-on-write,
+//   - the per-thread page (THREAD_LOCAL variables such as thisenv),
+//     which is copy-on-write, and
+//   - the user exception stack, which is freshly allocated.
+//
+// Pages that are copy-on-write in the parent are first turned into
+// private writable pages and then shared, so that a write from either
+// side is seen by both.  Only memory mapped at the time of the sfork
+// is shared: pages the parent or the child map later are private,
+// except in the regions registered with sfork_share.
+// Don't fork() after sfork(), since fork() marks the caller's writable
+// pages copy-on-write, which would break the sharing with its threads.
+// The thread gets our env_type, and with it the file server's I/O
+// privilege; children made by fork() or spawn() don't.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
 sfork(void)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+	extern unsigned char thread_start[], thread_end[];
+	envid_t envid;
+	int i, r;
+
+	set_cow_handler();
+
+	envid = sys_exofork();
+	if (envid < 0)
+		return envid;
+	if (envid == 0) {
+		// Our thisenv is on our own copy of the per-thread page.
+		thisenv = &envs[ENVX(sys_getenvid())];
+		return 0;
+	}
+
+	if ((r = sys_page_alloc(envid, (void *) (UXSTACKTOP - PGSIZE), PTE_P|PTE_U|PTE_W)) < 0)
+		goto error;
+	if ((r = sys_env_set_pgfault_upcall(envid, _pgfault_upcall)) < 0)
+		goto error;
+	for (i = 0; i < sfork_nshared; i++)
+		if ((r = sys_vm_copy(envid, (void *) sfork_shared[i].start,
+				     (void *) sfork_shared[i].end, VM_COPY_SHARE_PT)) < 0)
+			goto error;
+	if ((r = sys_vm_copy(envid, 0, thread_start, VM_COPY_SHARE_ALL)) < 0
+	    || (r = sys_vm_copy(envid, thread_start, thread_end, VM_COPY_COW)) < 0
+	    || (r = sys_vm_copy(envid, thread_end, (void *) (USTACKTOP - PGSIZE), VM_COPY_SHARE_ALL)) < 0
+	    || (r = sys_vm_copy(envid, (void *) (USTACKTOP - PGSIZE), (void *) USTACKTOP, VM_COPY_COW)) < 0)
+		goto error;
+	// A thread of a server is part of the server (fs/serv.c's workers).
+	if (thisenv->env_type != ENV_TYPE_USER
+	    && (r = sys_env_set_type(envid, thisenv->env_type)) < 0)
+		goto error;
+	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
+		goto error;
+	return envid;
+
+error:
+	sys_env_destroy(envid);
+	return r;
 }
@@ -0,0 +1,118 @@
+// Asynchronous file system requests on a ring shared with the file
+// server (see struct FsRing in inc/fs.h).
+//
+// Fill in requests with fsring_get_sqe() and fsring_prep(), hand them
+// to the server with fsring_submit(), and collect the results with
+// fsring_wait_cqe() and fsring_cqe_seen().  Data for reads and writes
+// lives in the ring's data area, FSRING_DATA(ring).
+
+#include <inc/lib.h>
+
+static envid_t fsenv;
+
+// Allocate a ring at 'ring' (page-aligned, FSRING_NPAGES pages of free
+// address space) and register it with the file server.
+int
+fsring_init(struct FsRing *ring)
+{
+	struct IpcVec iv;
+	int i, r;
+
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+	for (i = 0; i < FSRING_NPAGES; i++)
+		if ((r = sys_page_alloc(0, (char *) ring + i * PGSIZE,
+					PTE_P | PTE_U | PTE_W)) < 0)
+			return r;
+
+	// 环本身就是请求页：服务端在请求窗口中收到它，再映射到自己的地址空间里。
+	iv.iv_nsegs = 1;
+	iv.iv_segs[0].seg_va = ring;
+	iv.iv_segs[0].seg_npages = FSRING_NPAGES;
+	if ((r = ipc_call(fsenv, FSREQ_RING, &iv,
+			  PTE_P | PTE_U | PTE_W | IPC_VEC, NULL, NULL)) < 0)
+		return r;
+	ring->r_id = r;
+	return 0;
+}
+
+// Return the next free request slot, or NULL if FSRING_NENT requests
+// are already in flight.
+struct FsSqe *
+fsring_get_sqe(struct FsRing *ring)
+{
+	if (ring->sq_prepared - ring->cq_head >= FSRING_NENT)
+		return NULL;
+	return &ring->sq[ring->sq_prepared++ % FSRING_NENT];
+}
+
+// Fill in a request of the given type on file descriptor fdnum.
+// For reads and writes, 'offset' is the file offset and the data is
+// the n bytes at 'dataoff' in the data area; for FSREQ_SET_SIZE,
+// 'offset' is the new size.
+int
+fsring_prep(struct FsSqe *sqe, uint32_t type, int fdnum, off_t offset,
+	    uint32_t dataoff, size_t n, uint32_t tag)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	sqe->sqe_type = type;
+	sqe->sqe_fileid = fd->fd_file.id;
+	sqe->sqe_offset = offset;
+	sqe->sqe_n = n;
+	sqe->sqe_dataoff = dataoff;
+	sqe->sqe_tag = tag;
+	return 0;
+}
+
+// Hand every prepared request to the server with one notification.
+void
+fsring_submit(struct FsRing *ring)
+{
+	int r;
+
+	if (ring->sq_tail == ring->sq_prepared)
+		return;
+	// The requests must be visible before the new sq_tail.
+	__sync_synchronize();
+	ring->sq_tail = ring->sq_prepared;
+	if ((r = sys_ipc_notify(fsenv, 1 << ring->r_id)) < 0)
+		panic("fsring_submit: %e", r);
+}
+
+// Return the oldest completion not yet consumed, or NULL if there is
+// none.
+struct FsCqe *
+fsring_peek_cqe(struct FsRing *ring)
+{
+	if (ring->cq_head == ring->cq_tail)
+		return NULL;
+	__sync_synchronize();
+	return &ring->cq[ring->cq_head % FSRING_NENT];
+}
+
+// Return the oldest completion not yet consumed, waiting for the
+// server's notification if there is none.  Any other IPC message that
+// arrives meanwhile is lost, so only wait when nobody else sends to us.
+struct FsCqe *
+fsring_wait_cqe(struct FsRing *ring)
+{
+	struct FsCqe *cqe;
+
+	while ((cqe = fsring_peek_cqe(ring)) == NULL)
+		ipc_recv(NULL, NULL, NULL);
+	return cqe;
+}
+
+// Consume the completion returned by fsring_peek_cqe/fsring_wait_cqe,
+// freeing its request slot.
+void
+fsring_cqe_seen(struct FsRing *ring)
+{
+	ring->cq_head++;
+}
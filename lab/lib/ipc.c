@@ -12,7 +12,8 @@
 //	transferred to 'pg').
 // If the system call fails, then store 0 in *fromenv and *perm (if
 //	they're nonnull) and return the error.
-// Otherwise, return the value sent by the sender
+// Otherwise, return the value sent by the sender.  A notification from
+// sys_ipc_notify shows up with a sender of 0 and its bits as the value.
 //
 // Hint:
 //   Use 'thisenv' to discover the value and who sent it.
@@ -39,8 +40,8 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// This function blocks in the kernel until the message is received.
+// It should panic() on any error.
 //
 // Hint:
 //   Use sys_yield() to be CPU-friendly.
@@ -52,11 +53,44 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	// LAB 4: Your code here.
 	// panic("ipc_send not implemented");
     int r;
-    while ((r=sys_ipc_try_send(to_env, val, pg==NULL? (void*)UTOP: pg, perm)) != 0) {
-        if (r != -E_IPC_NOT_RECV)
-            panic("sys_ipc_try_send fails: %e", r);
-        sys_yield(); // CPU-friendly
-    }
+    // 由内核把我们挂到接收者的等待队列上，而不是反复sys_ipc_try_send+sys_yield。
+    if ((r=sys_ipc_send(to_env, val, pg==NULL? (void*)UTOP: pg, perm)) != 0)
+        panic("sys_ipc_send fails: %e", r);
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env'
+// and wait for its reply, which is returned as by ipc_recv (with any
+// page mapped at 'rcv_pg').  The kernel switches straight to 'to_env'
+// when it is waiting for us, so this is the fast way to make an RPC.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+    int r;
+
+    r = sys_ipc_call(to_env, val, pg==NULL? (void*)UTOP: pg, perm,
+                     rcv_pg==NULL? (void*)UTOP: rcv_pg);
+    if (perm_store)
+        *perm_store = r==0? thisenv->env_ipc_perm: 0;
+    return r==0? thisenv->env_ipc_value: r;
+}
+
+// Reply to 'to_env' (a client blocked in ipc_call) and receive the next
+// request, as ipc_recv does, in one system call.  The reply is dropped
+// if 'to_env' is no longer waiting for it.
+int32_t
+ipc_reply_recv(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+    int r;
+
+    r = sys_ipc_reply_recv(to_env, val, pg==NULL? (void*)UTOP: pg, perm,
+                           rcv_pg==NULL? (void*)UTOP: rcv_pg);
+    if (from_env_store)
+        *from_env_store = r==0? thisenv->env_ipc_from: 0;
+    if (perm_store)
+        *perm_store = r==0? thisenv->env_ipc_perm: 0;
+    return r==0? thisenv->env_ipc_value: r;
 }
 
 // Find the first environment of the given type.  We'll use this to
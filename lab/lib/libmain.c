@@ -5,7 +5,8 @@
 
 extern void umain(int argc, char **argv);
 
-const volatile struct Env *thisenv;
+// Per-thread: see sfork() in lib/fork.c.
+const volatile struct Env *thisenv THREAD_LOCAL;
 const char *binaryname = "<unknown>";
 
 void
@@ -0,0 +1,157 @@
+// Memory-mapped files.
+//
+// mmap() only sets aside a range of the address space.  Its pages are
+// brought in the first time they are touched, by mmap_pgfault, which
+// has the file server map the pages of its block cache there
+// (file_readmap), a few pages per fault.  Mappings are private: the
+// pages come copy-on-write, so writes (allowed with PROT_WRITE) never
+// reach the file or anyone else.  Pages nobody writes to stay shared
+// with the file server's cache, and so with everyone else who maps the
+// same blocks of the same file.
+
+#include <inc/lib.h>
+
+#define MMAP_NREGIONS	16
+#define MMAPBASE	0xE0000000	// Where mmap puts mappings...
+#define MMAPTOP		0xEE000000	// ...up to here
+#define MMAP_FAULTAROUND 8		// Most pages one fault brings in
+
+struct Mmap {
+	uintptr_t mm_start;	// Page-aligned
+	uintptr_t mm_end;	// Page-aligned, 0 if the slot is free
+	off_t mm_offset;	// File offset of mm_start
+	int mm_fdnum;		// Our own dup of the file descriptor
+	int mm_prot;		// PROT_*
+};
+
+static struct Mmap mmaps[MMAP_NREGIONS];
+static uintptr_t mmap_next = MMAPBASE;	// Where the next mapping goes
+
+static bool
+va_present(uintptr_t va)
+{
+	return get_pte((void *) va) & PTE_P;
+}
+
+static struct Mmap *
+mmap_lookup(uintptr_t va)
+{
+	int i;
+
+	for (i = 0; i < MMAP_NREGIONS; i++)
+		if (mmaps[i].mm_start <= va && va < mmaps[i].mm_end)
+			return &mmaps[i];
+	return NULL;
+}
+
+// Bring in the page of a mapping that the faulting access touched,
+// along with the pages after it that aren't there yet, up to
+// MMAP_FAULTAROUND pages.  A page past the end of the file is all zero.
+// Faults outside mappings, and on pages that are there (copy-on-write
+// ones, say), are passed on.
+static int
+mmap_pgfault(struct UTrapframe *utf)
+{
+	uintptr_t va = ROUNDDOWN(utf->utf_fault_va, PGSIZE);
+	struct Mmap *m;
+	uint32_t i, n;
+	int r;
+
+	if ((m = mmap_lookup(va)) == NULL || va_present(va))
+		return 0;
+	if ((utf->utf_err & FEC_WR) && !(m->mm_prot & PROT_WRITE))
+		return 0;
+
+	// 遇到已经存在的页就停下：它可能已经被写过，不能被覆盖。
+	for (n = 1; n < MMAP_FAULTAROUND && va + n * PGSIZE < m->mm_end
+		     && !va_present(va + n * PGSIZE); n++)
+		;
+	if ((r = file_readmap(m->mm_fdnum, m->mm_offset + (va - m->mm_start),
+			      (void *) va, n * PGSIZE)) < 0)
+		panic("mmap: file_readmap: %e", r);
+	if (r == 0 && (r = sys_page_alloc(0, (void *) va, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("mmap: sys_page_alloc: %e", r);
+	if (!(m->mm_prot & PROT_WRITE))
+		for (i = 0; i < n; i++)
+			if (va_present(va + i * PGSIZE)
+			    && (r = sys_page_map(0, (void *) (va + i * PGSIZE),
+						 0, (void *) (va + i * PGSIZE), PTE_P|PTE_U)) < 0)
+				panic("mmap: sys_page_map: %e", r);
+	return 1;
+}
+
+//
+// Map len bytes of the file open as fdnum, from offset on, into our
+// address space, and set *addr_store to where.  prot must include
+// PROT_READ; with PROT_WRITE the pages can be written to, privately.
+// offset must be page-aligned.  The mapping keeps the file open, so
+// fdnum can be closed right away.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if fdnum is not an open file, or an argument is bad.
+//	-E_NO_MEM if there is no room for the mapping.
+//
+int
+mmap(int fdnum, off_t offset, size_t len, int prot, void **addr_store)
+{
+	struct Fd *fd, *nfd;
+	struct Mmap *m;
+	int r;
+
+	if (len == 0 || offset < 0 || offset % PGSIZE != 0 || !(prot & PROT_READ))
+		return -E_INVAL;
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	len = ROUNDUP(len, PGSIZE);
+	if (len > MMAPTOP - mmap_next)
+		return -E_NO_MEM;
+	for (m = mmaps; m < mmaps + MMAP_NREGIONS && m->mm_end != 0; m++)
+		;
+	if (m == mmaps + MMAP_NREGIONS)
+		return -E_NO_MEM;
+	if ((r = add_pgfault_handler(mmap_pgfault)) < 0)
+		return r;
+	if ((r = fd_alloc(&nfd)) < 0 || (r = dup(fdnum, fd2num(nfd))) < 0)
+		return r;
+
+	m->mm_start = mmap_next;
+	m->mm_end = mmap_next + len;
+	m->mm_offset = offset;
+	m->mm_fdnum = r;
+	m->mm_prot = prot;
+	mmap_next += len;
+	*addr_store = (void *) m->mm_start;
+	return 0;
+}
+
+//
+// Remove a mapping made by mmap.  addr and len must cover exactly
+// one mapping.
+// Returns 0 on success, -E_INVAL if there is no such mapping.
+//
+int
+munmap(void *addr, size_t len)
+{
+	struct Mmap *m;
+	uintptr_t va;
+	int r;
+
+	if ((m = mmap_lookup((uintptr_t) addr)) == NULL || m->mm_start != (uintptr_t) addr
+	    || m->mm_end - m->mm_start != ROUNDUP(len, PGSIZE))
+		return -E_INVAL;
+	for (va = m->mm_start; va < m->mm_end; va += PGSIZE) {
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			va = ROUNDUP(va + 1, PTSIZE) - PGSIZE;
+			continue;
+		}
+		if ((get_pte((void *) va) & PTE_P) && (r = sys_page_unmap(0, (void *) va)) < 0)
+			panic("munmap: sys_page_unmap: %e", r);
+	}
+	close(m->mm_fdnum);
+	if (m->mm_end == mmap_next)
+		mmap_next = m->mm_start;
+	m->mm_end = 0;
+	return 0;
+}
@@ -0,0 +1,44 @@
+// Mutual exclusion for environments sharing memory (see sfork).
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// Spin this many times before giving up the CPU: the holder is
+// probably running on another CPU and about to release the lock.
+#define MUTEX_SPINS	100
+
+void
+mutex_init(struct mutex *m)
+{
+	m->locked = 0;
+}
+
+int
+mutex_trylock(struct mutex *m)
+{
+	return xchg(&m->locked, 1) == 0;
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+	int i;
+
+	while (!mutex_trylock(m)) {
+		// Wait with plain reads, so we don't bounce the cache line.
+		for (i = 0; m->locked && i < MUTEX_SPINS; i++)
+			asm volatile("pause");
+		// The holder may have been descheduled, or may be waiting
+		// for our CPU.
+		if (m->locked)
+			sys_yield();
+	}
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+	// xchg orders the critical section's loads and stores before the
+	// release.
+	xchg(&m->locked, 0);
+}
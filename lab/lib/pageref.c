@@ -1,13 +1,36 @@
 #include <inc/lib.h>
 
+// Return the entry that maps va in our address space, or 0 if there is
+// none.  For a 4MB page that is the page directory entry: uvpt[PGNUM(va)]
+// would read a word of the page's own data instead.
+// 由于只需读（且只能读）pte，所以不需要返回指针。
+pte_t
+get_pte(const void *va)
+{
+    uint32_t a = (uint32_t)va;
+    if ((uvpd[PDX(a)]&PTE_P) == 0)
+        // XXX 这里要注意一个点，不能返回-1，-1的补码表示为全1，这样的话caller将返回的pte and 任何标志如PTE_P都会得到非0。
+        // 更重要的一个点是，pte_t被定义为无符号数，这样的话-1会被转换为很大的无符号数，会逃过caller的`pte<0`的检查。
+        // 返回0符合逻辑，因为PTE_P位被复位了，表示该pte不存在。
+        return 0;
+    if (uvpd[PDX(a)]&PTE_PS)
+        return uvpd[PDX(a)]; // 4MB大页没有页表，页目录项就是它的pte。
+    return uvpt[PGNUM(a)];
+    // 在JOS中，V设置为0x3BD。
+    // PDX=V, PTX!=V，这样的地址通过翻译可以form 4MB的物理地址空间。
+    // uvpt, PDX=V, PTX=0，这样uvpt通过翻译得到第0个页表的物理起始地址。
+    // uvpt[x]，等价于*(pte_t*)(uvpt+x<<2)。
+    // 若x<1024，则uvpt[x]可以索引第0个页表中的pte。
+    // 若x>=1024，则权大于等于1024的位会加到uvpt的PTX部分，从而从页目录中选中不同的页表，权小于1024的位则索引选中的页表中的pte。
+    // 也就是可以认为，uvpt构成了“连续”的1024个页表的数组，此时我们只需要用VPN直接索引即可得到va对应的pte。
+}
+
 int
 pageref(void *v)
 {
 	pte_t pte;
 
-	if (!(uvpd[PDX(v)] & PTE_P))
-		return 0;
-	pte = uvpt[PGNUM(v)];
+	pte = get_pte(v);
 	if (!(pte & PTE_P))
 		return 0;
 	return pages[PGNUM(pte)].pp_ref;
@@ -14,19 +14,39 @@ extern void _pgfault_upcall(void);
 // 汇编入口函数lib/pfentry.S会调用这个函数指针指向的函数。
 void (*_pgfault_handler)(struct UTrapframe *utf);
 
-//
-// Set the page fault handler function.
-// If there isn't one yet, _pgfault_handler will be 0.
-// The first time we register a handler, we need to
-// allocate an exception stack (one page of memory with its top
-// at UXSTACKTOP), and tell the kernel to call the assembly-language
-// _pgfault_upcall routine when a page fault occurs.
-//
-void
-set_pgfault_handler(void (*handler)(struct UTrapframe *utf))
+// Handlers added with add_pgfault_handler, newest last.  Each returns 1
+// if it dealt with the fault and 0 to pass it on to the one added
+// before it, and in the end to the one set with set_pgfault_handler.
+#define PGFAULT_NCHAIN	4
+
+static int (*pgfault_chain[PGFAULT_NCHAIN])(struct UTrapframe *utf);
+static int pgfault_nchain;
+static void (*pgfault_last)(struct UTrapframe *utf);
+
+static void
+pgfault_dispatch(struct UTrapframe *utf)
 {
-	int r;
+	int i;
 
+	for (i = pgfault_nchain - 1; i >= 0; i--)
+		if (pgfault_chain[i](utf))
+			return;
+	if (pgfault_last) {
+		pgfault_last(utf);
+		return;
+	}
+	cprintf("[%08x] user fault va %08x ip %08x\n",
+		thisenv->env_id, utf->utf_fault_va, utf->utf_eip);
+	panic("unhandled page fault");
+}
+
+// The first time we register a handler, we need to allocate an
+// exception stack (one page of memory with its top at UXSTACKTOP), and
+// tell the kernel to call the assembly-language _pgfault_upcall
+// routine when a page fault occurs.
+static void
+pgfault_init(void)
+{
 	if (_pgfault_handler == 0) {
 		// First time through!
 		// LAB 4: Your code here.
@@ -38,5 +58,36 @@ set_pgfault_handler(void (*handler)(struct UTrapframe *utf))
 	}
 
 	// Save handler pointer for assembly to call.
-	_pgfault_handler = handler;
+	_pgfault_handler = pgfault_dispatch;
+}
+
+//
+// Set the page fault handler function, which gets the faults that no
+// handler added with add_pgfault_handler takes.
+//
+void
+set_pgfault_handler(void (*handler)(struct UTrapframe *utf))
+{
+	pgfault_init();
+	pgfault_last = handler;
+}
+
+//
+// Add a handler in front of the ones installed so far (see
+// pgfault_chain).  Adding one that is installed already does nothing.
+// Returns 0 on success, -E_NO_MEM if PGFAULT_NCHAIN are installed.
+//
+int
+add_pgfault_handler(int (*handler)(struct UTrapframe *utf))
+{
+	int i;
+
+	pgfault_init();
+	for (i = 0; i < pgfault_nchain; i++)
+		if (pgfault_chain[i] == handler)
+			return 0;
+	if (pgfault_nchain == PGFAULT_NCHAIN)
+		return -E_NO_MEM;
+	pgfault_chain[pgfault_nchain++] = handler;
+	return 0;
 }
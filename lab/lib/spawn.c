@@ -8,7 +8,8 @@
 // Helper functions for spawn.
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
 static int map_segment(envid_t child, uintptr_t va, size_t memsz,
-		       int fd, size_t filesz, off_t fileoffset, int perm);
+		       const char *img, size_t imgsize,
+		       size_t filesz, off_t fileoffset, int perm);
 static int copy_shared_pages(envid_t child);
 
 // Spawn a child process from a program image loaded from the file system.
@@ -19,7 +20,8 @@ static int copy_shared_pages(envid_t child);
 int
 spawn(const char *prog, const char **argv)
 {
-	unsigned char elf_buf[512];
+	char *img;
+	struct Stat st;
 	struct Trapframe child_tf;
 	envid_t child;
 
@@ -89,18 +91,37 @@ spawn(const char *prog, const char **argv)
 		return r;
 	fd = r;
 
-	// Read elf header
-	elf = (struct Elf*) elf_buf;
-	if (readn(fd, elf_buf, sizeof(elf_buf)) != sizeof(elf_buf)
-	    || elf->e_magic != ELF_MAGIC) {
+	// Map the whole program file (mmap keeps it open).  The pages of
+	// the read-only segments are then the file server's cached pages,
+	// which map_segment hands on to the child, so every process running
+	// the program shares them.
+	if ((r = fstat(fd, &st)) < 0) {
+		close(fd);
+		return r;
+	}
+	if (st.st_size < sizeof(struct Elf)) {
 		close(fd);
+		return -E_NOT_EXEC;
+	}
+	r = mmap(fd, 0, st.st_size, PROT_READ, (void **) &img);
+	close(fd);
+	if (r < 0)
+		return r;
+
+	// Read elf header
+	elf = (struct Elf*) img;
+	if (elf->e_magic != ELF_MAGIC
+	    || elf->e_phoff + elf->e_phnum * sizeof(struct Proghdr) > st.st_size) {
 		cprintf("elf magic %08x want %08x\n", elf->e_magic, ELF_MAGIC);
+		munmap(img, st.st_size);
 		return -E_NOT_EXEC;
 	}
 
 	// Create new child environment
-	if ((r = sys_exofork()) < 0)
+	if ((r = sys_exofork()) < 0) {
+		munmap(img, st.st_size);
 		return r;
+	}
 	child = r;
 
 	// Set up trap frame, including initial stack.
@@ -108,22 +129,21 @@ spawn(const char *prog, const char **argv)
 	child_tf.tf_eip = elf->e_entry;
 
 	if ((r = init_stack(child, argv, &child_tf.tf_esp)) < 0)
-		return r;
+		goto error;
 
 	// Set up program segments as defined in ELF header.
-	ph = (struct Proghdr*) (elf_buf + elf->e_phoff);
+	ph = (struct Proghdr*) (img + elf->e_phoff);
 	for (i = 0; i < elf->e_phnum; i++, ph++) {
 		if (ph->p_type != ELF_PROG_LOAD)
 			continue;
 		perm = PTE_P | PTE_U;
 		if (ph->p_flags & ELF_PROG_FLAG_WRITE)
 			perm |= PTE_W;
-		if ((r = map_segment(child, ph->p_va, ph->p_memsz,
-				     fd, ph->p_filesz, ph->p_offset, perm)) < 0)
+		if ((r = map_segment(child, ph->p_va, ph->p_memsz, img, st.st_size,
+				     ph->p_filesz, ph->p_offset, perm)) < 0)
 			goto error;
 	}
-	close(fd);
-	fd = -1;
+	munmap(img, st.st_size);
 
 	// Copy shared library state.
 	if ((r = copy_shared_pages(child)) < 0)
@@ -140,7 +160,7 @@ spawn(const char *prog, const char **argv)
 
 error:
 	sys_env_destroy(child);
-	close(fd);
+	munmap(img, st.st_size);
 	return r;
 }
 
@@ -260,12 +280,19 @@ error:
 	return r;
 }
 
+// Map a segment, whose file image is at img[fileoffset, fileoffset +
+// filesz), into the child.  Pages of read-only segments that hold only
+// file data are the mapped file's own pages.
 static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
-	int fd, size_t filesz, off_t fileoffset, int perm)
+	const char *img, size_t imgsize,
+	size_t filesz, off_t fileoffset, int perm)
 {
 	int i, r;
-	void *blk;
+	const char *blk;
+
+	if (fileoffset < 0 || filesz > memsz || fileoffset + filesz > imgsize)
+		return -E_NOT_EXEC;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -281,14 +308,18 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 			// allocate a blank page
 			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
 				return r;
+		} else if (!(perm & PTE_W) && (i + PGSIZE <= filesz || filesz == memsz)) {
+			// Shared text: what follows the segment on its last
+			// page (when there is no bss) is never looked at.
+			blk = img + fileoffset + i;
+			(void) *(volatile const char *) blk;	// Fault it in
+			if ((r = sys_page_map(0, (void *) blk, child, (void*) (va + i), perm)) < 0)
+				return r;
 		} else {
 			// from file
 			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
 				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
+			memmove(UTEMP, img + fileoffset + i, MIN(PGSIZE, filesz-i));
 			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
 				panic("spawn: sys_page_map data: %e", r);
 			sys_page_unmap(0, UTEMP);
@@ -302,6 +333,6 @@ static int
 copy_shared_pages(envid_t child)
 {
 	// LAB 5: Your code here.
-	return 0;
+	return sys_vm_copy(child, 0, (void *) UTOP, VM_COPY_SHARED);
 }
 
@@ -85,6 +85,12 @@ sys_page_unmap(envid_t envid, void *va)
 	return syscall(SYS_page_unmap, 1, envid, (uint32_t) va, 0, 0, 0);
 }
 
+int
+sys_page_clear(envid_t envid, void *va, int bits)
+{
+	return syscall(SYS_page_clear, 0, envid, (uint32_t) va, bits, 0, 0);
+}
+
 // sys_exofork is inlined in lib.h
 
 int
@@ -111,9 +117,57 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
 }
 
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 1, envid, value, (uint32_t) srcva, perm, 0);
+}
+
 int
 sys_ipc_recv(void *dstva)
 {
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_recv(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_reply_recv, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_set_rcvwin(uint32_t npages)
+{
+	return syscall(SYS_ipc_set_rcvwin, 0, npages, 0, 0, 0, 0);
+}
+
+int
+sys_ipc_notify(envid_t envid, uint32_t bits)
+{
+	return syscall(SYS_ipc_notify, 0, envid, bits, 0, 0, 0);
+}
+
+int
+sys_irq_notify(uint32_t irq, uint32_t bits)
+{
+	return syscall(SYS_irq_notify, 1, irq, bits, 0, 0, 0);
+}
+
+int
+sys_env_set_type(envid_t envid, int type)
+{
+	return syscall(SYS_env_set_type, 1, envid, type, 0, 0, 0);
+}
+
+int
+sys_vm_copy(envid_t dstenv, void *start, void *end, int mode)
+{
+	return syscall(SYS_vm_copy, 1, dstenv, (uint32_t) start, (uint32_t) end, mode, 0);
+}
+
@@ -0,0 +1,52 @@
+// Page allocator benchmark: NWORKERS envs, spread over the CPUs by the
+// scheduler, each allocate and free one page NROUNDS times, and report
+// the cycles per allocation and the allocations per million cycles of
+// the CPU they ran on.  With the per-CPU page caches the rate should
+// hardly drop as CPUs are added.
+//
+// Run with e.g. "make run-allocbench CPUS=4".
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NWORKERS	4
+#define NROUNDS		20000
+
+static void
+worker(int id)
+{
+	uint64_t start;
+	uint32_t i, per;
+	int r;
+
+	start = read_tsc();
+	for (i = 0; i < NROUNDS; i++) {
+		if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		if ((r = sys_page_unmap(0, UTEMP)) < 0)
+			panic("sys_page_unmap: %e", r);
+	}
+	start = read_tsc() - start;
+	per = start / NROUNDS;
+	cprintf("allocbench: worker %d on CPU %d: %u cycles per alloc+free, "
+		"%u allocs per Mcycle\n",
+		id, thisenv->env_cpunum, per, 1000000 / (per ? per : 1));
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who[NWORKERS];
+	int i;
+
+	for (i = 0; i < NWORKERS; i++) {
+		if ((who[i] = fork()) < 0)
+			panic("fork: %e", who[i]);
+		if (who[i] == 0) {
+			worker(i);
+			return;
+		}
+	}
+	for (i = 0; i < NWORKERS; i++)
+		wait(who[i]);
+}
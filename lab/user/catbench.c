@@ -0,0 +1,68 @@
+// Large-file sequential read benchmark: write a file bigger than the
+// file server's block cache, then read it back the way cat does and
+// report the throughput along with the block cache counters, which
+// show how many blocks came in through read-ahead.  A second pass reads
+// into a big page-aligned buffer, which the file server fills by
+// mapping its block cache pages (FSREQ_READMAP) instead of copying.
+//
+// Run with e.g. "make run-catbench".
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define FILESIZE	(8 * 1024 * 1024)
+
+static char buf[8192];	// Same as cat
+static char bigbuf[1024 * 1024] __attribute__((aligned(PGSIZE)));
+
+static void
+readpass(const char *name, char *b, size_t bufsize)
+{
+	struct FsStats st0, st1;
+	uint64_t start;
+	int fd, i, r, n;
+
+	if ((fd = open("/catbench", O_RDONLY)) < 0)
+		panic("open /catbench: %e", fd);
+	if ((r = fs_stats(&st0)) < 0)
+		panic("fs_stats: %e", r);
+	start = read_tsc();
+	for (n = 0; (r = read(fd, b, bufsize)) > 0; n += r)
+		;
+	if (r < 0)
+		panic("read: %e", r);
+	start = read_tsc() - start;
+	fs_stats(&st1);
+	close(fd);
+	if (n != FILESIZE)
+		panic("read %d bytes, want %d", n, FILESIZE);
+	// The last read filled the whole buffer.
+	for (i = 0; i < bufsize; i++)
+		if (b[i] != (char) i)
+			panic("%s: bad byte at %d", name, i);
+
+	cprintf("catbench %s: %d MB in %u kcycles per MB; %u misses, %u blocks read ahead, %u lent\n",
+		name, FILESIZE >> 20, (uint32_t) (start / 1000 / (FILESIZE >> 20)),
+		st1.st_bc_misses - st0.st_bc_misses,
+		st1.st_bc_readahead - st0.st_bc_readahead,
+		st1.st_bc_lent - st0.st_bc_lent);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int fd, i, r, n;
+
+	if ((fd = open("/catbench", O_RDWR | O_CREAT | O_TRUNC)) < 0)
+		panic("open /catbench: %e", fd);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i;
+	for (n = 0; n < FILESIZE; n += r)
+		if ((r = write(fd, buf, sizeof(buf))) < 0)
+			panic("write: %e", r);
+	sync();
+	close(fd);
+
+	readpass("cat", buf, sizeof(buf));
+	readpass("mapped", bigbuf, sizeof(bigbuf));
+}
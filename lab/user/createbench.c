@@ -0,0 +1,54 @@
+// File creation benchmark: create NFILES files of FILEBLOCKS blocks
+// each, two at a time with their writes interleaved, sync, and report
+// the time along with how many blocks each write-back command carried,
+// which is higher the more contiguous the files are on disk.  Run it on
+// a mostly full disk to exercise the block allocator there.
+//
+// Run with e.g. "make FSFILL=6000 run-createbench".
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NFILES		64
+#define FILEBLOCKS	16
+
+static char buf[BLKSIZE];
+
+void
+umain(int argc, char **argv)
+{
+	struct FsStats st0, st1;
+	char path[MAXNAMELEN];
+	uint64_t start;
+	int fd[2], i, j, k, r;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i;
+	sync();
+	if ((r = fs_stats(&st0)) < 0)
+		panic("fs_stats: %e", r);
+	start = read_tsc();
+	for (i = 0; i < NFILES; i += 2) {
+		for (k = 0; k < 2; k++) {
+			snprintf(path, sizeof(path), "/create.%d", i + k);
+			if ((fd[k] = open(path, O_RDWR | O_CREAT | O_TRUNC)) < 0)
+				panic("open %s: %e", path, fd[k]);
+		}
+		for (j = 0; j < FILEBLOCKS; j++)
+			for (k = 0; k < 2; k++)
+				if ((r = write(fd[k], buf, sizeof(buf))) != sizeof(buf))
+					panic("write: %e", r);
+		close(fd[0]);
+		close(fd[1]);
+	}
+	sync();
+	start = read_tsc() - start;
+	fs_stats(&st1);
+
+	cprintf("createbench: %d files of %d KB in %u kcycles per file; "
+		"%u blocks in %u writes\n",
+		NFILES, FILEBLOCKS * BLKSIZE / 1024,
+		(uint32_t) (start / 1000 / NFILES),
+		st1.st_bc_flushed - st0.st_bc_flushed,
+		st1.st_bc_flushes - st0.st_bc_flushes);
+}
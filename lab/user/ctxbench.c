@@ -0,0 +1,62 @@
+// Context switch benchmark: a client and a server env bounce a value
+// back and forth with ipc_call/ipc_reply_recv, so every round trip is
+// two address space switches.  Besides the cycles per round trip, the
+// client times the first system call after each switch back to it and
+// a second one right after: the difference is mostly the TLB misses
+// the switch left behind.  With global kernel mappings (CR4.PGE) only
+// the user mappings are lost, so the gap shrinks.
+//
+// Run with e.g. "make run-ctxbench CPUS=1", and compare with
+// "make run-ctxbench CPUS=1 QEMUEXTRA='-cpu qemu32,-pge'" on a
+// hardware-virtualized QEMU (TCG doesn't model the TLB's cost).
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUNDS	20000
+
+static void
+server(void)
+{
+	envid_t who;
+	uint32_t v;
+
+	v = ipc_recv(&who, 0, 0);
+	for (;;)
+		v = ipc_reply_recv(who, v + 1, 0, 0, &who, 0, 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t srv;
+	uint64_t start, t0, t1, t2, cold = 0, warm = 0;
+	uint32_t i, v;
+
+	if ((srv = fork()) < 0)
+		panic("fork: %e", srv);
+	if (srv == 0) {
+		server();
+		return;
+	}
+
+	start = read_tsc();
+	for (i = v = 0; i < NROUNDS; i++) {
+		v = ipc_call(srv, v, 0, 0, 0, 0);
+		t0 = read_tsc();
+		sys_getenvid();
+		t1 = read_tsc();
+		sys_getenvid();
+		t2 = read_tsc();
+		cold += t1 - t0;
+		warm += t2 - t1;
+	}
+	start = read_tsc() - start;
+	if (v != NROUNDS)
+		panic("got %u, want %u", v, NROUNDS);
+	cprintf("ctxbench: %u cycles per round trip; system call after a "
+		"switch %u cycles, next one %u cycles\n",
+		(uint32_t) (start / NROUNDS), (uint32_t) (cold / NROUNDS),
+		(uint32_t) (warm / NROUNDS));
+	sys_env_destroy(srv);
+}
@@ -0,0 +1,85 @@
+// Measure fork() latency for an environment with a large address
+// space, against the old scheme of two sys_page_map calls per page.
+//
+// Run with "make run-forkbench".
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NPAGES	1024		// 4MB of private, touched memory
+#define NFORK	20
+
+static char buf[NPAGES * PGSIZE];
+
+extern void _pgfault_upcall(void);
+
+// fork() as lib/fork.c used to do it: walk every page below UTOP and
+// map each present one into the child with sys_page_map.
+static envid_t
+slowfork(void)
+{
+	envid_t envid;
+	uintptr_t va;
+	pte_t pte;
+	int r;
+
+	if ((envid = sys_exofork()) < 0)
+		panic("sys_exofork: %e", envid);
+	if (envid == 0) {
+		thisenv = &envs[ENVX(sys_getenvid())];
+		return 0;
+	}
+	if ((r = sys_page_alloc(envid, (void *) (UXSTACKTOP - PGSIZE), PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	sys_env_set_pgfault_upcall(envid, _pgfault_upcall);
+	for (va = 0; va < UXSTACKTOP - PGSIZE; va += PGSIZE) {
+		if (!(uvpd[PDX(va)] & PTE_P) || !((pte = uvpt[PGNUM(va)]) & PTE_P))
+			continue;
+		if (pte & PTE_SHARE)
+			r = sys_page_map(0, (void *) va, envid, (void *) va, pte & PTE_SYSCALL);
+		else if (pte & (PTE_W|PTE_COW)) {
+			if ((r = sys_page_map(0, (void *) va, envid, (void *) va, PTE_P|PTE_U|PTE_COW)) == 0)
+				r = sys_page_map(0, (void *) va, 0, (void *) va, PTE_P|PTE_U|PTE_COW);
+		} else
+			r = sys_page_map(0, (void *) va, envid, (void *) va, PTE_P|PTE_U);
+		if (r < 0)
+			panic("sys_page_map: %e", r);
+	}
+	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
+		panic("sys_env_set_status: %e", r);
+	return envid;
+}
+
+static uint32_t
+bench(envid_t (*forkfn)(void))
+{
+	uint64_t start, total = 0;
+	envid_t child;
+	int i;
+
+	for (i = 0; i < NFORK; i++) {
+		start = read_tsc();
+		if ((child = forkfn()) < 0)
+			panic("fork: %e", child);
+		if (child == 0)
+			exit();
+		total += read_tsc() - start;
+		wait(child);
+	}
+	return total / NFORK / 1000;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t fast, slow;
+	int i;
+
+	for (i = 0; i < NPAGES; i++)
+		buf[i * PGSIZE] = i;
+
+	fast = bench(fork);
+	slow = bench(slowfork);
+	cprintf("forkbench: %d pages mapped, fork %u kcycles, per-page fork %u kcycles\n",
+		NPAGES, fast, slow);
+}
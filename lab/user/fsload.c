@@ -0,0 +1,54 @@
+// File server load test: several clients hammer the file server at
+// once, each opening, reading and closing a file in a loop.  Compare
+// the time per operation across kernels, e.g. with a yield-spinning
+// ipc_send against a blocking one.
+//
+// Run with e.g. "make run-fsload CPUS=4".
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCLIENT	8
+#define NOPS	200
+
+static void
+client(void)
+{
+	char buf[512];
+	uint64_t start;
+	int i, fd, r;
+
+	start = read_tsc();
+	for (i = 0; i < NOPS; i++) {
+		if ((fd = open("/lorem", O_RDONLY)) < 0)
+			panic("open /lorem: %e", fd);
+		if ((r = read(fd, buf, sizeof buf)) < 0)
+			panic("read /lorem: %e", r);
+		close(fd);
+	}
+	ipc_send(thisenv->env_parent_id, (read_tsc() - start) / 1000, 0, 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t kcycles, total = 0, max = 0;
+	envid_t who;
+	int i, r;
+
+	for (i = 0; i < NCLIENT; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			client();
+			return;
+		}
+	}
+	for (i = 0; i < NCLIENT; i++) {
+		kcycles = ipc_recv(&who, 0, 0);
+		total += kcycles;
+		max = MAX(max, kcycles);
+	}
+	cprintf("fsload: %d clients x %d open/read/close, avg %u kcycles/op, slowest client %u kcycles\n",
+		NCLIENT, NOPS, total / (NCLIENT * NOPS), max);
+}
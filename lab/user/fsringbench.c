@@ -0,0 +1,93 @@
+// Compare synchronous file I/O with requests queued on an FsRing:
+// the same small reads and writes at scattered offsets, first one IPC
+// round trip each, then pipelined FSRING_NENT at a time, which the
+// file server runs in batches.
+//
+// Run with e.g. "make run-fsringbench CPUS=2".
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NOPS		2048
+#define OPSIZE		512
+#define FILESIZE	(64 * 1024)
+#define RING		((struct FsRing *) 0x0e000000)
+
+static char buf[OPSIZE];
+
+// Offset of the i'th operation: stride through the file so that
+// consecutive operations touch different blocks.
+static off_t
+op_offset(int i)
+{
+	return (i * 9 * OPSIZE) % FILESIZE;
+}
+
+static uint32_t
+run_sync(int fd, uint32_t type)
+{
+	uint64_t start = read_tsc();
+	int i, r;
+
+	for (i = 0; i < NOPS; i++) {
+		seek(fd, op_offset(i));
+		if (type == FSREQ_READ)
+			r = readn(fd, buf, OPSIZE);
+		else
+			r = write(fd, buf, OPSIZE);
+		if (r != OPSIZE)
+			panic("sync op %d: %e", i, r);
+	}
+	return (read_tsc() - start) / NOPS;
+}
+
+static uint32_t
+run_ring(int fd, uint32_t type)
+{
+	uint64_t start = read_tsc();
+	struct FsSqe *sqe;
+	struct FsCqe *cqe;
+	int queued = 0, done = 0, r;
+
+	while (done < NOPS) {
+		// Keep the ring full; each request has its own data slot.
+		while (queued < NOPS && (sqe = fsring_get_sqe(RING)) != NULL) {
+			if ((r = fsring_prep(sqe, type, fd, op_offset(queued),
+					     (queued % FSRING_NENT) * OPSIZE,
+					     OPSIZE, queued)) < 0)
+				panic("fsring_prep: %e", r);
+			queued++;
+		}
+		fsring_submit(RING);
+		cqe = fsring_wait_cqe(RING);
+		do {
+			if (cqe->cqe_result != OPSIZE)
+				panic("ring op %d: %e", cqe->cqe_tag, cqe->cqe_result);
+			fsring_cqe_seen(RING);
+			done++;
+		} while ((cqe = fsring_peek_cqe(RING)) != NULL);
+	}
+	return (read_tsc() - start) / NOPS;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int fd, r;
+
+	static_assert(FSRING_NENT * OPSIZE <= FSRING_DATASIZE);
+
+	if ((fd = open("/ringbench", O_RDWR | O_CREAT)) < 0)
+		panic("open /ringbench: %e", fd);
+	if ((r = ftruncate(fd, FILESIZE)) < 0)
+		panic("ftruncate: %e", r);
+	if ((r = fsring_init(RING)) < 0)
+		panic("fsring_init: %e", r);
+
+	cprintf("fsringbench: %d x %d-byte ops, cycles per op:\n", NOPS, OPSIZE);
+	cprintf("  write: sync %u, ring %u\n",
+		run_sync(fd, FSREQ_WRITE), run_ring(fd, FSREQ_WRITE));
+	cprintf("  read:  sync %u, ring %u\n",
+		run_sync(fd, FSREQ_READ), run_ring(fd, FSREQ_READ));
+	close(fd);
+}
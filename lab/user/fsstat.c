@@ -0,0 +1,23 @@
+// Print the file server's counters.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	struct FsStats st;
+	int r;
+
+	if ((r = fs_stats(&st)) < 0)
+		panic("fs_stats: %e", r);
+	printf("block cache: %u/%u blocks, %u hits, %u misses, %u evictions (%u dirty)\n",
+	       st.st_bc_cached, st.st_bc_max, st.st_bc_hits, st.st_bc_misses,
+	       st.st_bc_evictions, st.st_bc_writebacks);
+	printf("read-ahead: %u blocks\n", st.st_bc_readahead);
+	printf("write-back: %u blocks in %u writes\n", st.st_bc_flushed,
+	       st.st_bc_flushes);
+	printf("zero-copy reads: %u blocks lent, %u copied on write\n",
+	       st.st_bc_lent, st.st_bc_copied);
+	printf("path cache: %u hits (%u negative), %u misses\n",
+	       st.st_dc_hits, st.st_dc_negative, st.st_dc_misses);
+}
@@ -0,0 +1,71 @@
+// Measure IPC round-trip latency between a client and a server env,
+// first with separate ipc_send/ipc_recv calls on each side, then with
+// ipc_call/ipc_reply_recv, which switch straight to the partner instead
+// of going through the scheduler.
+//
+// Run with e.g. "make run-ipcbench CPUS=1".
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUNDS	20000
+
+static void
+server_sendrecv(void)
+{
+	envid_t who;
+	uint32_t v;
+
+	for (;;) {
+		v = ipc_recv(&who, 0, 0);
+		ipc_send(who, v + 1, 0, 0);
+	}
+}
+
+static void
+server_call(void)
+{
+	envid_t who;
+	uint32_t v;
+
+	v = ipc_recv(&who, 0, 0);
+	for (;;)
+		v = ipc_reply_recv(who, v + 1, 0, 0, &who, 0, 0);
+}
+
+static void
+run(const char *name, void (*server)(void), bool call)
+{
+	envid_t srv;
+	uint64_t start;
+	uint32_t i, v;
+
+	if ((srv = fork()) < 0)
+		panic("fork: %e", srv);
+	if (srv == 0) {
+		server();
+		return;
+	}
+
+	start = read_tsc();
+	for (i = v = 0; i < NROUNDS; i++) {
+		if (call)
+			v = ipc_call(srv, v, 0, 0, 0, 0);
+		else {
+			ipc_send(srv, v, 0, 0);
+			v = ipc_recv(0, 0, 0);
+		}
+	}
+	if (v != NROUNDS)
+		panic("%s: got %u, want %u", name, v, NROUNDS);
+	cprintf("ipcbench: %s: %u cycles per round trip\n",
+		name, (uint32_t) ((read_tsc() - start) / NROUNDS));
+	sys_env_destroy(srv);
+}
+
+void
+umain(int argc, char **argv)
+{
+	run("send/recv", server_sendrecv, false);
+	run("call/reply_recv", server_call, true);
+}
@@ -0,0 +1,97 @@
+// Count the primes below N with 1, 2, 4 and 8 sfork()ed threads that
+// take chunks of numbers from a shared counter, to show the speedup
+// from running threads of one address space on several CPUs.
+//
+// Run with e.g. "make run-sforkprimes CPUS=4".
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define N		400000
+#define CHUNK		2000
+#define MAXTHREADS	8
+
+// Shared by all the threads.
+static struct mutex lock;
+static uint32_t next;		// Next number to hand out
+static uint32_t nprimes;
+
+static int
+isprime(uint32_t n)
+{
+	uint32_t d;
+
+	if (n < 2)
+		return 0;
+	for (d = 2; d * d <= n; d++)
+		if (n % d == 0)
+			return 0;
+	return 1;
+}
+
+static void
+worker(void)
+{
+	uint32_t i, lo, hi, count, chunks = 0;
+
+	for (;;) {
+		mutex_lock(&lock);
+		lo = next;
+		next += CHUNK;
+		mutex_unlock(&lock);
+		if (lo >= N)
+			break;
+		hi = MIN(lo + CHUNK, N);
+
+		count = 0;
+		for (i = lo; i < hi; i++)
+			count += isprime(i);
+		mutex_lock(&lock);
+		nprimes += count;
+		mutex_unlock(&lock);
+		chunks++;
+	}
+	// thisenv is per-thread, so this reaches whoever sforked us.
+	ipc_send(thisenv->env_parent_id, chunks, 0, 0);
+}
+
+static uint32_t
+run(int nthreads)
+{
+	uint64_t start;
+	envid_t who;
+	int i, r;
+
+	mutex_init(&lock);
+	next = 0;
+	nprimes = 0;
+
+	start = read_tsc();
+	for (i = 0; i < nthreads; i++) {
+		if ((r = sfork()) < 0)
+			panic("sfork: %e", r);
+		if (r == 0) {
+			worker();
+			exit();
+		}
+	}
+	for (i = 0; i < nthreads; i++)
+		ipc_recv(&who, 0, 0);
+	return (read_tsc() - start) / 1000000;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t mcycles, base = 0;
+	int n;
+
+	for (n = 1; n <= MAXTHREADS; n *= 2) {
+		mcycles = run(n);
+		if (n == 1)
+			base = mcycles;
+		cprintf("sforkprimes: %d threads: %u primes below %u in %u Mcycles (speedup %u.%02u)\n",
+			n, nprimes, N, mcycles,
+			base / MAX(mcycles, 1), base * 100 / MAX(mcycles, 1) % 100);
+	}
+}
@@ -0,0 +1,43 @@
+// Measure system call throughput with several environments making
+// system calls at once.  With a big kernel lock the total time grows
+// with the number of CPUs; without one it should stay roughly flat.
+//
+// Run with e.g. "make run-syscallbench CPUS=4".
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCHILD	8
+#define NCALLS	100000
+
+void
+umain(int argc, char **argv)
+{
+	int i, j;
+	envid_t who;
+	uint64_t start;
+	uint32_t kcycles, maxkcycles;
+
+	for (i = 0; i < NCHILD; i++) {
+		if (fork() == 0) {
+			start = read_tsc();
+			for (j = 0; j < NCALLS; j++)
+				sys_getenvid();
+			kcycles = (read_tsc() - start) / 1000;
+			cprintf("[%08x] %d calls on CPU %d: %u kcycles\n",
+				thisenv->env_id, NCALLS, thisenv->env_cpunum,
+				kcycles);
+			ipc_send(thisenv->env_parent_id, kcycles, 0, 0);
+			return;
+		}
+	}
+
+	maxkcycles = 0;
+	for (i = 0; i < NCHILD; i++) {
+		kcycles = ipc_recv(&who, 0, 0);
+		if (kcycles > maxkcycles)
+			maxkcycles = kcycles;
+	}
+	cprintf("syscallbench: %d calls in %d envs, slowest env %u kcycles\n",
+		NCHILD * NCALLS, NCHILD, maxkcycles);
+}
@@ -0,0 +1,66 @@
+// Test 4MB pages: sys_page_alloc with PTE_PS maps one in place of a
+// page table, fork gives the child its own copy, and unmapping any
+// address in it unmaps all of it.
+
+#include <inc/lib.h>
+
+#define LPVA	((char *) 0x40000000)
+
+static void
+fill(char *p, char c)
+{
+	int i;
+
+	for (i = 0; i < PTSIZE; i += PGSIZE)
+		p[i] = c + i / PGSIZE;
+}
+
+static bool
+filled(char *p, char c)
+{
+	int i;
+
+	for (i = 0; i < PTSIZE; i += PGSIZE)
+		if (p[i] != (char) (c + i / PGSIZE))
+			return false;
+	return true;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	int r;
+
+	if ((r = sys_page_alloc(0, LPVA + PGSIZE, PTE_P|PTE_U|PTE_W|PTE_PS)) != -E_INVAL)
+		panic("unaligned 4MB page: got %e, want -E_INVAL", r);
+	if ((r = sys_page_alloc(0, LPVA, PTE_P|PTE_U|PTE_W|PTE_PS)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if (!(uvpd[PDX(LPVA)] & PTE_PS))
+		panic("no 4MB page in the page directory");
+	if (LPVA[PTSIZE - 1] != 0)
+		panic("4MB page not zeroed");
+	if ((r = sys_page_alloc(0, LPVA + PGSIZE, PTE_P|PTE_U|PTE_W)) != -E_INVAL)
+		panic("4KB page inside a 4MB page: got %e, want -E_INVAL", r);
+	fill(LPVA, 'a');
+	cprintf("4MB page allocated\n");
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		if (!filled(LPVA, 'a'))
+			panic("child's 4MB page differs");
+		fill(LPVA, 'b');
+		exit();
+	}
+	wait(who);
+	if (!filled(LPVA, 'a'))
+		panic("child's writes reached the parent");
+	cprintf("4MB page copied by fork\n");
+
+	if ((r = sys_page_unmap(0, LPVA + 5 * PGSIZE)) < 0)
+		panic("sys_page_unmap: %e", r);
+	if (uvpd[PDX(LPVA)] & PTE_P)
+		panic("4MB page still mapped");
+	cprintf("4MB page unmapped\n");
+}
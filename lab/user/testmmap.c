@@ -0,0 +1,71 @@
+// Test mmap: a mapping reads like the file, writes to it stay private,
+// and spawned copies of a program share its text.
+
+#include <inc/lib.h>
+
+static char buf[8192];
+
+void
+childofspawn(void)
+{
+	// Tell the parent which physical page our text is in.
+	ipc_send(thisenv->env_parent_id, PTE_ADDR(get_pte(umain)), 0, 0);
+	exit();
+}
+
+static uint32_t
+spawnchild(void)
+{
+	envid_t who;
+	uint32_t pa;
+	int r;
+
+	if ((r = spawnl("/testmmap", "testmmap", "arg", 0)) < 0)
+		panic("spawn: %e", r);
+	pa = ipc_recv(&who, 0, 0);
+	wait(r);
+	return pa;
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct Stat st;
+	char *p;
+	int fd, n, r;
+
+	if (argc != 0)
+		childofspawn();
+
+	if ((fd = open("/lorem", O_RDONLY)) < 0)
+		panic("open /lorem: %e", fd);
+	if ((r = fstat(fd, &st)) < 0)
+		panic("fstat: %e", r);
+	if ((r = mmap(fd, 0, st.st_size, PROT_READ | PROT_WRITE, (void **) &p)) < 0)
+		panic("mmap: %e", r);
+	if ((n = readn(fd, buf, sizeof(buf))) < 0)
+		panic("readn: %e", n);
+	close(fd);
+	if (memcmp(p, buf, n) != 0)
+		panic("mapped file differs from read file");
+	if (n < sizeof(buf) && p[n] != 0)
+		panic("mapping not zero past the end of the file");
+	cprintf("mmap reads right\n");
+
+	// The change stays ours.
+	p[0] ^= 1;
+	if ((fd = open("/lorem", O_RDONLY)) < 0)
+		panic("open /lorem: %e", fd);
+	if ((r = readn(fd, buf, 1)) != 1)
+		panic("readn: %e", r);
+	close(fd);
+	if (buf[0] == p[0])
+		panic("write to a private mapping reached the file");
+	if ((r = munmap(p, st.st_size)) < 0)
+		panic("munmap: %e", r);
+	cprintf("mmap writes are private\n");
+
+	if (spawnchild() != spawnchild())
+		panic("spawned children don't share text pages");
+	cprintf("spawn shares text right\n");
+}